@@ -5,6 +5,7 @@
 #include <string.h>
 #include <async/http/status.h>
 #include <yajl/yajl_gen.h>
+#include <yajl/yajl_tree.h>
 #include "util/hash.h"
 #include "util/url.h"
 #include "page.h"
@@ -85,7 +86,7 @@ cleanup:
 int api_enqueue(HTTPConnectionRef const conn, strarg_t const URL) {
 	uint64_t const now = time(NULL);
 	bool existing = false;
-	int rc = queue_add(now, URL, ""); // TODO: client
+	int rc = queue_add(now, URL, "", HX_POLICY_FULL, HX_CLASS_INTERACTIVE); // TODO: client
 	if(KVS_KEYEXIST == rc) {
 		existing = true;
 		rc = 0;
@@ -96,16 +97,20 @@ int api_enqueue(HTTPConnectionRef const conn, strarg_t const URL) {
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
 	HTTPConnectionWriteHeader(conn, "Content-Type", "text/json; charset=utf-8");
 	HTTPConnectionBeginBody(conn);
-	if(!existing) for(;;) {
-		rc = queue_timedwait(now, URL, uv_now(async_loop) + 1000*30);
-		if(UV_ETIMEDOUT != rc) break;
-		HTTPConnectionWriteChunk(conn, (unsigned char const *)STR_LEN("\n"));
-	}
 
 	yajl_gen json = NULL;
 	struct response res[1];
-	ssize_t const count = hx_get_history(URL, res, 1);
-	if(1 != count) rc = KVS_NOTFOUND;
+	if(!existing) {
+		// Fills in res directly, so there's nothing to look up.
+		for(;;) {
+			rc = queue_timedwait(now, URL, uv_now(async_loop) + 1000*30, res);
+			if(UV_ETIMEDOUT != rc) break;
+			HTTPConnectionWriteChunk(conn, (unsigned char const *)STR_LEN("\n"));
+		}
+	} else {
+		ssize_t const count = hx_get_history(URL, res, 1);
+		if(1 != count) rc = KVS_NOTFOUND;
+	}
 	if(rc < 0) goto cleanup;
 
 	json = yajl_gen_alloc(NULL);
@@ -123,6 +128,115 @@ cleanup:
 	json = NULL;
 	return 0;
 }
+// Splits the body into URLs in place. It's either a JSON array of
+// strings, or one URL per line.
+static ssize_t enqueue_parse(char *const body, yajl_val *const tree, strarg_t *const out, size_t const max) {
+	size_t count = 0;
+	char const *p = body;
+	while(' ' == *p || '\t' == *p || '\r' == *p || '\n' == *p) p++;
+	if('[' == *p) {
+		*tree = yajl_tree_parse(body, NULL, 0);
+		if(!YAJL_IS_ARRAY(*tree)) return UV_EINVAL;
+		for(size_t i = 0; i < YAJL_GET_ARRAY(*tree)->len; i++) {
+			strarg_t const URL = YAJL_GET_STRING(YAJL_GET_ARRAY(*tree)->values[i]);
+			if(!URL) return UV_EINVAL;
+			if(count >= max) return UV_E2BIG;
+			out[count++] = URL;
+		}
+		return count;
+	}
+	for(char *line = body; line;) {
+		char *const next = strchr(line, '\n');
+		if(next) *next = '\0';
+		size_t len = strlen(line);
+		while(len && ('\r' == line[len-1] || ' ' == line[len-1])) line[--len] = '\0';
+		if(len) {
+			if(count >= max) return UV_E2BIG;
+			out[count++] = line;
+		}
+		line = next ? next+1 : NULL;
+	}
+	return count;
+}
+int api_enqueue_bulk(HTTPConnectionRef const conn) {
+	char *body = NULL;
+	size_t len = 0;
+	yajl_val tree = NULL;
+	strarg_t *URLs = NULL;
+	int *results = NULL;
+	yajl_gen json = NULL;
+	int rc = 0;
+
+	body = malloc(CONFIG_API_ENQUEUE_BODY_MAX+1);
+	URLs = calloc(CONFIG_API_ENQUEUE_MAX, sizeof(*URLs));
+	results = calloc(CONFIG_API_ENQUEUE_MAX, sizeof(*results));
+	if(!body || !URLs || !results) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+	for(;;) {
+		uv_buf_t buf[1];
+		rc = HTTPConnectionReadBody(conn, buf);
+		if(rc < 0) goto cleanup;
+		if(0 == buf->len) break;
+		if(buf->len > CONFIG_API_ENQUEUE_BODY_MAX - len) {
+			HTTPConnectionSendStatus(conn, 413);
+			goto cleanup;
+		}
+		memcpy(body+len, buf->base, buf->len);
+		len += buf->len;
+	}
+	body[len] = '\0';
+
+	ssize_t const count = enqueue_parse(body, &tree, URLs, CONFIG_API_ENQUEUE_MAX);
+	if(UV_E2BIG == count) {
+		HTTPConnectionSendStatus(conn, 413);
+		goto cleanup;
+	}
+	if(count < 0) {
+		HTTPConnectionSendStatus(conn, 400);
+		goto cleanup;
+	}
+
+	// New URLs get every algorithm, but nobody is waiting on them.
+	rc = queue_add_bulk(time(NULL), URLs, count, HX_POLICY_FULL, HX_CLASS_BULK, results);
+	if(rc < 0) goto cleanup;
+
+	json = yajl_gen_alloc(NULL);
+	if(!json) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+	yajl_gen_config(json, yajl_gen_print_callback, yajl_print_cb, conn);
+	yajl_gen_config(json, yajl_gen_beautify, 1);
+
+	HTTPConnectionWriteResponse(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteHeader(conn, "Content-Type", "text/json; charset=utf-8");
+	HTTPConnectionBeginBody(conn);
+	yajl_gen_array_open(json);
+	for(size_t i = 0; i < count; i++) {
+		strarg_t const status =
+			0 == results[i] ? "queued" :
+			1 == results[i] ? "pending" :
+			KVS_KEYEXIST == results[i] ? "recent" :
+			hx_strerror(results[i]);
+		yajl_gen_map_open(json);
+		yajl_gen_string2(json, STR_LEN("url"));
+		yajl_gen_string2(json, URLs[i], strlen(URLs[i]));
+		yajl_gen_string2(json, STR_LEN("status"));
+		yajl_gen_string2(json, status, strlen(status));
+		yajl_gen_map_close(json);
+	}
+	yajl_gen_array_close(json);
+	HTTPConnectionWriteChunkEnd(conn);
+	HTTPConnectionEnd(conn);
+
+cleanup:
+	if(json) yajl_gen_free(json);
+	json = NULL;
+	yajl_tree_free(tree); tree = NULL;
+	free(body); body = NULL;
+	free(URLs); URLs = NULL;
+	free(results); results = NULL;
+	return rc;
+}
 int api_history(HTTPConnectionRef const conn, strarg_t const URL) {
 	size_t const max = CONFIG_API_HISTORY_MAX;
 	struct response *responses = NULL;
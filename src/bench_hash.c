@@ -0,0 +1,318 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Measures hasher and codec throughput, and prints the results as JSON
+// so they can be compared between machines and releases.
+// Usage: bench-hash [max-threads] [seconds-per-run] [max-stream-bytes]
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "util/hash.h"
+
+#define BENCH_SIZE_MIN (1024*4)
+#define BENCH_SIZE_MAX (1024*1024*16)
+#define BENCH_SIZE_STEP 4
+#define THREADED_SIZE_MIN (1024*1024*1) // Starts a thread per algorithm
+#define DIGEST_SIZE 32 // What the codecs usually see
+#define B58_SIZE_MAX 1024 // Quadratic, and uses the stack
+#define BENCH_SECONDS 0.25
+#define STREAM_CHUNK (1024*64) // Roughly what HTTPConnectionReadBody hands us
+
+typedef enum {
+	BENCH_HASHER = 0,
+	BENCH_THREADED = 1, // hasher_create_threaded
+	BENCH_HEX = 2,
+	BENCH_B64 = 3,
+	BENCH_B58 = 4,
+} bench_type;
+
+struct job {
+	bench_type type;
+	uint64_t algos;
+	size_t size;
+	double seconds;
+	unsigned char *buf;
+	char *out;
+	size_t outmax;
+	pthread_t thread;
+	uint64_t bytes;
+	double elapsed;
+	int rc;
+};
+
+static double now_sec(void) {
+	struct timespec ts[1];
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static char const *error_name(int const rc) {
+	char const *const x = hash_strerror(rc);
+	return x ? x : strerror(-rc);
+}
+
+static int run_once(struct job *const job) {
+	hasher_t *hasher = NULL;
+	hash_digest_t digests[HASH_ALGO_MAX];
+	int rc = 0;
+	switch(job->type) {
+	case BENCH_HASHER:
+	case BENCH_THREADED:
+		rc = BENCH_THREADED == job->type ?
+			hasher_create_threaded(job->algos, &hasher) :
+			hasher_create(job->algos, &hasher);
+		if(rc < 0) break;
+		rc = hasher_update(hasher, job->buf, job->size);
+		if(rc < 0) break;
+		rc = hasher_digests(hasher, digests, HASH_ALGO_MAX);
+		break;
+	case BENCH_HEX:
+		hex_encode(job->buf, job->size, job->out, job->outmax);
+		break;
+	case BENCH_B64:
+		b64_encode(B64_STD, job->buf, job->size, job->out, job->outmax);
+		break;
+	case BENCH_B58:
+		b58_encode(job->buf, job->size, job->out, job->outmax);
+		break;
+	}
+	hasher_free(&hasher);
+	return rc;
+}
+static void *job_main(void *const arg) {
+	struct job *const job = arg;
+	double const start = now_sec();
+	for(;;) {
+		job->rc = run_once(job);
+		if(job->rc < 0) break;
+		job->bytes += job->size;
+		job->elapsed = now_sec() - start;
+		if(job->elapsed >= job->seconds) break;
+	}
+	return NULL;
+}
+
+static char const *type_name(bench_type const type) {
+	switch(type) {
+	case BENCH_HASHER: return "hasher";
+	case BENCH_THREADED: return "hasher-threaded";
+	case BENCH_HEX: return "hex";
+	case BENCH_B64: return "b64";
+	case BENCH_B58: return "b58";
+	default: return NULL;
+	}
+}
+static char const *algos_name(bench_type const type, uint64_t const algos) {
+	if(BENCH_HASHER != type && BENCH_THREADED != type) return "";
+	if(HASHER_ALGOS_ALL == algos) return "all";
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(1ull << i == algos) return hash_algo_names[i];
+	}
+	return NULL;
+}
+
+static bool first_result = true;
+static int bench(bench_type const type, uint64_t const algos, size_t const size, size_t const nthreads, double const seconds) {
+	struct job *jobs = calloc(nthreads, sizeof(struct job));
+	if(!jobs) return HASH_ENOMEM;
+	size_t started = 0;
+	int rc = 0;
+	for(size_t i = 0; i < nthreads; i++) {
+		struct job *const job = &jobs[i];
+		job->type = type;
+		job->algos = algos;
+		job->size = size;
+		job->seconds = seconds;
+		job->buf = malloc(size);
+		job->outmax = size*2+8; // Enough for every codec
+		job->out = malloc(job->outmax);
+		if(!job->buf || !job->out) rc = HASH_ENOMEM;
+		if(rc < 0) goto cleanup;
+		for(size_t j = 0; j < size; j++) job->buf[j] = j * 7 + 3 + i;
+	}
+	double const start = now_sec();
+	for(; started < nthreads; started++) {
+		rc = -pthread_create(&jobs[started].thread, NULL, job_main, &jobs[started]);
+		if(rc < 0) goto cleanup;
+	}
+	uint64_t bytes = 0;
+	for(size_t i = 0; i < nthreads; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		bytes += jobs[i].bytes;
+		if(jobs[i].rc < 0) rc = jobs[i].rc;
+	}
+	started = 0;
+	if(rc < 0) goto cleanup;
+	double const elapsed = now_sec() - start;
+
+	printf("%s\t{\"type\": \"%s\", \"algos\": \"%s\", \"size\": %zu, \"threads\": %zu, "
+		"\"bytes\": %llu, \"seconds\": %.4f, \"gbps\": %.4f}",
+		first_result ? "" : ",\n",
+		type_name(type), algos_name(type, algos), size, nthreads,
+		(unsigned long long)bytes, elapsed, bytes / elapsed / 1e9);
+	fflush(stdout);
+	first_result = false;
+
+cleanup:
+	for(size_t i = 0; i < started; i++) pthread_join(jobs[i].thread, NULL);
+	for(size_t i = 0; i < nthreads; i++) {
+		free(jobs[i].buf); jobs[i].buf = NULL;
+		free(jobs[i].out); jobs[i].out = NULL;
+	}
+	free(jobs); jobs = NULL;
+	return rc;
+}
+
+// Large bodies are streamed through one small buffer instead of being
+// allocated, and each mode runs once since these take a while.
+static int stream_once(bool const threaded, unsigned char const *const buf, uint64_t const total, hash_digest_t *const out, double *const secs) {
+	hasher_t *hasher = NULL;
+	double const start = now_sec();
+	int rc = threaded ?
+		hasher_create_threaded(HASHER_ALGOS_ALL, &hasher) :
+		hasher_create(HASHER_ALGOS_ALL, &hasher);
+	if(rc < 0) goto cleanup;
+	for(uint64_t pos = 0; pos < total; pos += STREAM_CHUNK) {
+		size_t const len = total-pos < STREAM_CHUNK ? total-pos : STREAM_CHUNK;
+		rc = hasher_update(hasher, buf, len);
+		if(rc < 0) goto cleanup;
+	}
+	rc = hasher_digests(hasher, out, HASH_ALGO_MAX);
+	if(rc < 0) goto cleanup;
+	*secs = now_sec() - start;
+cleanup:
+	hasher_free(&hasher);
+	return rc;
+}
+static int bench_stream(uint64_t const total) {
+	unsigned char buf[STREAM_CHUNK];
+	for(size_t i = 0; i < sizeof(buf); i++) buf[i] = i * 7 + 3;
+	hash_digest_t a[HASH_ALGO_MAX], b[HASH_ALGO_MAX];
+	double secs[2] = {};
+	int rc = stream_once(false, buf, total, a, &secs[0]);
+	if(rc < 0) return rc;
+	rc = stream_once(true, buf, total, b, &secs[1]);
+	if(rc < 0) return rc;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(a[i].len == b[i].len && 0 == memcmp(a[i].buf, b[i].buf, a[i].len)) continue;
+		fprintf(stderr, "Digest mismatch for %s\n", hash_algo_names[i]);
+		return HASH_EPANIC;
+	}
+	for(size_t i = 0; i < 2; i++) {
+		printf("%s\t{\"type\": \"%s\", \"algos\": \"all\", \"size\": %llu, \"threads\": 1, "
+			"\"bytes\": %llu, \"seconds\": %.4f, \"gbps\": %.4f}",
+			first_result ? "" : ",\n",
+			i ? "stream-threaded" : "stream",
+			(unsigned long long)total, (unsigned long long)total,
+			secs[i], total / secs[i] / 1e9);
+		fflush(stdout);
+		first_result = false;
+	}
+	return 0;
+}
+
+// Serial and threaded modes must agree before timing either one.
+static int check_threaded(size_t const size) {
+	unsigned char *buf = malloc(size);
+	hasher_t *a = NULL, *b = NULL;
+	hash_digest_t x[HASH_ALGO_MAX], y[HASH_ALGO_MAX];
+	int rc = 0;
+	if(!buf) rc = HASH_ENOMEM;
+	if(rc < 0) goto cleanup;
+	for(size_t i = 0; i < size; i++) buf[i] = i * 7 + 3;
+	rc = rc < 0 ? rc : hasher_create(HASHER_ALGOS_ALL, &a);
+	rc = rc < 0 ? rc : hasher_create_threaded(HASHER_ALGOS_ALL, &b);
+	rc = rc < 0 ? rc : hasher_update(a, buf, size);
+	rc = rc < 0 ? rc : hasher_update(b, buf, size);
+	rc = rc < 0 ? rc : hasher_digests(a, x, HASH_ALGO_MAX);
+	rc = rc < 0 ? rc : hasher_digests(b, y, HASH_ALGO_MAX);
+	if(rc < 0) goto cleanup;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(x[i].len == y[i].len && 0 == memcmp(x[i].buf, y[i].buf, x[i].len)) continue;
+		fprintf(stderr, "Digest mismatch for %s\n", hash_algo_names[i]);
+		rc = HASH_EPANIC;
+		goto cleanup;
+	}
+cleanup:
+	hasher_free(&a);
+	hasher_free(&b);
+	free(buf); buf = NULL;
+	return rc;
+}
+
+int main(int const argc, char const *const *const argv) {
+	long const ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t const maxthreads = argc > 1 ? strtoull(argv[1], NULL, 10) : ncpu > 0 ? ncpu : 1;
+	double const seconds = argc > 2 ? strtod(argv[2], NULL) : BENCH_SECONDS;
+	uint64_t const maxstream = argc > 3 ? strtoull(argv[3], NULL, 10) : UINT64_MAX;
+	if(maxthreads < 1 || seconds <= 0 || argc > 4) {
+		fprintf(stderr, "Usage: %s [max-threads] [seconds-per-run] [max-stream-bytes]\n", argv[0]);
+		return 1;
+	}
+	int rc = hasher_init();
+	if(rc < 0) {
+		fprintf(stderr, "Hasher init error: %s\n", hash_strerror(rc));
+		return 1;
+	}
+	rc = check_threaded(BENCH_SIZE_MAX);
+	if(rc < 0) {
+		fprintf(stderr, "Hash error: %s\n", error_name(rc));
+		return 1;
+	}
+
+	printf("{\n\"kernels\": {\n");
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		printf("\t\"%s\": {\"name\": \"%s\", \"startup_mbps\": %.0f, \"by_policy\": %s}%s\n",
+			hash_algo_names[i], hasher_kernel_name(i), hasher_kernel_speed(i),
+			hasher_kernel_by_policy(i) ? "true" : "false",
+			i+1 < HASH_ALGO_MAX ? "," : "");
+	}
+	printf("},\n\"results\": [\n");
+
+	// 1, 2, 4... threads, plus the maximum if it's not a power of two.
+	for(size_t t = 1;; t = t*2 < maxthreads ? t*2 : maxthreads) {
+		for(size_t size = BENCH_SIZE_MIN; size <= BENCH_SIZE_MAX; size *= BENCH_SIZE_STEP) {
+			for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+				rc = bench(BENCH_HASHER, 1ull << i, size, t, seconds);
+				if(rc < 0) goto cleanup;
+			}
+			rc = bench(BENCH_HASHER, HASHER_ALGOS_ALL, size, t, seconds);
+			if(rc < 0) goto cleanup;
+			if(size < THREADED_SIZE_MIN) continue;
+			rc = bench(BENCH_THREADED, HASHER_ALGOS_ALL, size, t, seconds);
+			if(rc < 0) goto cleanup;
+		}
+		size_t const codec_sizes[] = { DIGEST_SIZE, BENCH_SIZE_MIN, BENCH_SIZE_MAX };
+		for(size_t i = 0; i < numberof(codec_sizes); i++) {
+			size_t const size = codec_sizes[i];
+			rc = bench(BENCH_HEX, 0, size, t, seconds);
+			if(rc < 0) goto cleanup;
+			rc = bench(BENCH_B64, 0, size, t, seconds);
+			if(rc < 0) goto cleanup;
+			if(size > B58_SIZE_MAX) continue;
+			rc = bench(BENCH_B58, 0, size, t, seconds);
+			if(rc < 0) goto cleanup;
+		}
+		if(t == maxthreads) break;
+	}
+
+	// Serial against threaded for bodies too big for the runs above.
+	uint64_t const stream_sizes[] = { 1024ull*1024*100, 1024ull*1024*1024*4 };
+	for(size_t i = 0; i < numberof(stream_sizes); i++) {
+		if(stream_sizes[i] > maxstream) break;
+		rc = bench_stream(stream_sizes[i]);
+		if(rc < 0) goto cleanup;
+	}
+
+cleanup:
+	printf("\n]\n}\n");
+	if(rc < 0) {
+		fprintf(stderr, "Bench error: %s\n", error_name(rc));
+		return 1;
+	}
+	return 0;
+}
@@ -21,23 +21,105 @@
 #define CONFIG_SERVER_TLS_KEY_PATH "./key.pem"
 #define CONFIG_SERVER_TLS_CRT_PATH "./crt.pem"
 
+// Crawl workers to start with. The pool scales between the limits
+// every so often. More than CONFIG_FETCH_SOCKETS_MAX would just wait
+// for sockets. Set all three to 0 to leave crawling to
+// hash-archive-worker.
 #define CONFIG_QUEUE_WORKERS 16
+#define CONFIG_QUEUE_WORKERS_MIN 4
+#define CONFIG_QUEUE_WORKERS_MAX 64
+#define CONFIG_QUEUE_SCALE_DELAY (1000*5) // ms
+#define CONFIG_QUEUE_SCALE_HASH_MAX 0.9 // Share of CPUs spent hashing
+#define CONFIG_QUEUE_BULK_BATCH 1000 // URLs per transaction
+#define CONFIG_QUEUE_RETRY_MAX 3 // Attempts before the failure is recorded
+#define CONFIG_QUEUE_RECENT_MAX (1024*64) // Recently seen SURTs, power of two
+#define CONFIG_QUEUE_DEFERRED_MAX 256 // Background enqueues in flight
+// Share of dispatches for each priority class when all have work.
+#define CONFIG_QUEUE_WEIGHT_INTERACTIVE 16
+#define CONFIG_QUEUE_WEIGHT_CRITICAL 4
+#define CONFIG_QUEUE_WEIGHT_BULK 1
+
+// Responses with a known length of at least this size are hashed
+// with one thread per algorithm.
+#define CONFIG_HASHER_THREADED_MIN (1024*1024*32)
+
+// Long downloads save their hasher state this often, so they can
+// pick up where they left off with a Range request.
+#define CONFIG_FETCH_CHECKPOINT_BYTES (1024*1024*64)
+#define CONFIG_FETCH_RESUME_MAX 3
+
+// Keep-alive connections for the crawler. The socket limit counts
+// connections in use as well as idle ones.
+#define CONFIG_FETCH_POOL_PER_HOST 4
+#define CONFIG_FETCH_SOCKETS_MAX 64
+#define CONFIG_FETCH_IDLE_TIMEOUT (1000*10) // ms
 
 #define CONFIG_API_HISTORY_MAX 30
 #define CONFIG_API_SOURCES_MAX 30
 #define CONFIG_API_BATCH_SIZE 50
+#define CONFIG_API_ENQUEUE_BODY_MAX (1024*1024*8)
+#define CONFIG_API_ENQUEUE_MAX 50000 // URLs per request
 #define CONFIG_HISTORY_MAX CONFIG_API_HISTORY_MAX
 #define CONFIG_SOURCES_MAX CONFIG_API_SOURCES_MAX
 
 #define CONFIG_CRAWL_DELAY_SECONDS (60*60*24)
+#define CONFIG_CRAWL_HOST_ACTIVE_MAX 2
+#define CONFIG_CRAWL_HOST_DELAY (1000*1) // Between fetches from one host
+// Consecutive failures (errors and 5xx responses) back off, doubling
+// each time. URLs can't be queued again until theirs is up, and a
+// failing host gets no fetches at all until its backoff is over.
+#define CONFIG_CRAWL_FAILURE_BACKOFF (60*60*1) // seconds
+#define CONFIG_CRAWL_FAILURE_BACKOFF_MAX (60*60*24*30)
+#define CONFIG_CRAWL_HOST_BACKOFF (1000*30) // ms
+#define CONFIG_CRAWL_HOST_BACKOFF_MAX (1000*60*60*6)
+
+// Known URLs are recrawled in the background, more often the more
+// their content has changed in the last few responses.
+#define CONFIG_RECRAWL_MIN_SECONDS (60*60*1)
+#define CONFIG_RECRAWL_MAX_SECONDS (60*60*24*30)
+#define CONFIG_RECRAWL_CRITICAL_SECONDS (60*60*6) // Longest for critical URLs
+#define CONFIG_RECRAWL_HISTORY 8
+#define CONFIG_RECRAWL_BATCH 256 // Due URLs looked at per batch
+#define CONFIG_RECRAWL_BATCH_DELAY (1000*1) // ms between full batches
+#define CONFIG_RECRAWL_SWEEP_DELAY (1000*60*10) // ms once nothing is due
 
 #define CONFIG_DB_PATH "./hash-archive.db"
+// Writes are grouped into one commit, which waits this long for
+// company unless the batch fills up first.
+#define CONFIG_DB_COMMIT_DELAY 2 // ms
+#define CONFIG_DB_COMMIT_BATCH 64
+// Bloom filter over queued and crawled SURTs, rebuilt at startup.
+// 64Mbit (8MB) holds about seven million URLs at 1% false positives.
+#define CONFIG_DB_FILTER_BITS (1024*1024*64) // Power of two
+#define CONFIG_DB_FILTER_HASHES 7
+#define CONFIG_DB_ID_BLOCK (1024*16) // IDs reserved per write
+// Decoded responses for history and source lookups.
+#define CONFIG_DB_CACHE_SIZE (1024*1024*64) // Bytes
+#define CONFIG_DB_CACHE_SHARDS 16
+#define CONFIG_DB_CACHE_BUCKETS (1024*8) // Per shard, power of two
+#define CONFIG_DB_CACHE_WARM 10000 // Newest responses loaded at startup
+// Index entries for new responses carry a short summary (status,
+// length and digest prefixes), so history pages only read the
+// responses they show, and sources skip truncation collisions.
+// Run hash-archive-migrate to add them to older entries.
+#define CONFIG_DB_COVERING_INDEXES 0
 
 #define CONFIG_TEMPLATE_DIR "./templates"
 #define CONFIG_STATIC_DIR "./static"
 
 #define CONFIG_IMPORT_SOCKET_PATH "./import.sock"
 
+// Crawl workers in other processes lease URLs here. There's no
+// authentication, so only listen on TCP inside a trusted network.
+#define CONFIG_LEASE_SOCKET_PATH "./worker.sock"
+#define CONFIG_LEASE_TCP_ADDR "127.0.0.1"
+#define CONFIG_LEASE_TCP_PORT 0 // 0 for disabled
+#define CONFIG_LEASE_TIMEOUT (1000*60*60) // ms before a job goes back in line
+#define CONFIG_LEASE_WAIT_MAX (1000*30) // Longest a worker can wait for work
+#define CONFIG_LEASE_BATCH_MAX 16 // Jobs per request
+#define CONFIG_LEASE_HELD_MAX 64 // Jobs per connection
+#define CONFIG_LEASE_SWEEP_DELAY (1000*10)
+
 static strarg_t const example_url = "https://torrents.linuxmint.com/torrents/linuxmint-18-cinnamon-64bit.iso.torrent";
 static strarg_t const example_hash_uri = "hash://sha256/030d8c2d6b7163a482865716958ca03806dfde99a309c927e56aa9962afbb95d";
 
@@ -0,0 +1,143 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <string.h>
+#include <async/async.h>
+#include "conn_pool.h"
+#include "common.h"
+#include "config.h"
+
+struct idle_conn {
+	host_t host[1];
+	bool secure;
+	HTTPConnectionRef conn;
+	uint64_t time;
+};
+
+static async_mutex_t pool_lock[1];
+static async_cond_t pool_cond[1];
+static struct idle_conn idle[CONFIG_FETCH_SOCKETS_MAX];
+static size_t idle_count = 0;
+static size_t open_count = 0; // Idle and checked out
+
+static bool idle_match(struct idle_conn const *const x, host_t const *const host, bool const secure) {
+	return x->secure == secure &&
+		0 == strcmp(x->host->domain, host->domain) &&
+		0 == strcmp(x->host->port, host->port);
+}
+// Caller must hold the lock and free the connection after unlocking.
+static HTTPConnectionRef idle_take(size_t const i) {
+	assert(i < idle_count);
+	HTTPConnectionRef const conn = idle[i].conn;
+	idle[i] = idle[--idle_count];
+	return conn;
+}
+// Closes connections idle for too long, or the oldest one if force is set.
+static void idle_expire(bool const force) {
+	HTTPConnectionRef expired[CONFIG_FETCH_SOCKETS_MAX];
+	size_t count = 0;
+	async_mutex_lock(pool_lock);
+	uint64_t const now = uv_now(async_loop);
+	for(size_t i = 0; i < idle_count;) {
+		if(idle[i].time + CONFIG_FETCH_IDLE_TIMEOUT <= now) {
+			expired[count++] = idle_take(i);
+		} else {
+			i++;
+		}
+	}
+	if(force && 0 == count && idle_count > 0) {
+		size_t oldest = 0;
+		for(size_t i = 1; i < idle_count; i++) {
+			if(idle[i].time < idle[oldest].time) oldest = i;
+		}
+		expired[count++] = idle_take(oldest);
+	}
+	open_count -= count;
+	if(count) async_cond_broadcast(pool_cond);
+	async_mutex_unlock(pool_lock);
+	for(size_t i = 0; i < count; i++) HTTPConnectionFree(&expired[i]);
+}
+static void conn_pool_sweep(void *ignored) {
+	for(;;) {
+		async_sleep(CONFIG_FETCH_IDLE_TIMEOUT / 2);
+		idle_expire(false);
+	}
+}
+
+void conn_pool_init(void) {
+	async_mutex_init(pool_lock, 0);
+	async_cond_init(pool_cond, 0);
+	async_spawn(STACK_DEFAULT, conn_pool_sweep, NULL);
+}
+int conn_pool_connect(host_t const *const host, bool const secure, HTTPConnectionRef *const out, bool *const reused) {
+	assert(host);
+	assert(out);
+	assert(reused);
+	*reused = false;
+	idle_expire(false);
+	async_mutex_lock(pool_lock);
+	for(;;) {
+		// Prefer the most recently used, which is least likely to have
+		// been closed by the server.
+		size_t best = idle_count;
+		for(size_t i = 0; i < idle_count; i++) {
+			if(!idle_match(&idle[i], host, secure)) continue;
+			if(best < idle_count && idle[i].time < idle[best].time) continue;
+			best = i;
+		}
+		if(best < idle_count) {
+			*out = idle_take(best);
+			*reused = true;
+			async_mutex_unlock(pool_lock);
+			return 0;
+		}
+		if(open_count < CONFIG_FETCH_SOCKETS_MAX) break;
+		if(idle_count > 0) {
+			// Make room by closing some other host's connection.
+			async_mutex_unlock(pool_lock);
+			idle_expire(true);
+			async_mutex_lock(pool_lock);
+			continue;
+		}
+		async_cond_wait(pool_cond, pool_lock);
+	}
+	open_count++;
+	async_mutex_unlock(pool_lock);
+
+	int rc = HTTPConnectionConnect(host->domain, host->port, secure, 0, out);
+	if(rc < 0) {
+		async_mutex_lock(pool_lock);
+		open_count--;
+		async_cond_broadcast(pool_cond);
+		async_mutex_unlock(pool_lock);
+	}
+	return rc;
+}
+void conn_pool_release(host_t const *const host, bool const secure, HTTPConnectionRef *const conn, bool const keep) {
+	assert(host);
+	assert(conn);
+	if(!*conn) return;
+	bool pooled = keep && HTTPConnectionDrainMessage(*conn) >= 0;
+	async_mutex_lock(pool_lock);
+	if(pooled) {
+		size_t count = 0;
+		for(size_t i = 0; i < idle_count; i++) {
+			if(idle_match(&idle[i], host, secure)) count++;
+		}
+		pooled = count < CONFIG_FETCH_POOL_PER_HOST;
+	}
+	if(pooled) {
+		assert(idle_count < CONFIG_FETCH_SOCKETS_MAX);
+		struct idle_conn *const x = &idle[idle_count++];
+		*x->host = *host;
+		x->secure = secure;
+		x->conn = *conn; *conn = NULL;
+		x->time = uv_now(async_loop);
+	} else {
+		open_count--;
+	}
+	async_cond_broadcast(pool_cond);
+	async_mutex_unlock(pool_lock);
+	HTTPConnectionFree(conn);
+}
@@ -0,0 +1,13 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <stdbool.h>
+#include <async/http/HTTP.h>
+#include "util/url.h"
+
+// Idle keep-alive connections shared by the queue workers.
+// Also caps the number of sockets open at once, idle or not.
+void conn_pool_init(void);
+int conn_pool_connect(host_t const *const host, bool const secure, HTTPConnectionRef *const out, bool *const reused);
+// Only keep connections whose last response was read to the end.
+void conn_pool_release(host_t const *const host, bool const secure, HTTPConnectionRef *const conn, bool const keep);
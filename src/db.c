@@ -1,6 +1,7 @@
 // Copyright 2016 Ben Trask
 // MIT licensed (see LICENSE for details)
 
+#include <pthread.h>
 #include <async/async.h>
 #include "util/url.h"
 #include "db.h"
@@ -17,6 +18,57 @@ static int timeidcmp(uint64_t const t1, uint64_t const i1, uint64_t const t2, ui
 
 static KVS_env *shared_db = NULL;
 
+struct hx_write {
+	hx_write_fn fn;
+	void *ctx;
+	int rc;
+	bool done;
+	struct hx_write *next;
+};
+static async_mutex_t write_lock[1];
+static async_cond_t write_cond[1]; // New requests
+static async_cond_t done_cond[1]; // Finished commits
+static struct hx_write *write_head = NULL;
+static struct hx_write **write_tail = &write_head;
+static size_t write_count = 0;
+static void hx_writer(void *ignored);
+
+// Bloom filter over every SURT that's been queued or crawled. Bits are
+// only ever set, so an aborted write just leaves a false positive.
+// Only the writer touches it after startup, so it needs no lock.
+static uint64_t *filter_bits = NULL;
+static int hx_filter_load(KVS_env *const db);
+
+static async_mutex_t ids_lock[1]; // Refills only
+
+// Decoded responses by (time, id), which never change once written,
+// so entries only leave when they're evicted. Lookups run on the
+// thread pool, so each shard has its own pthread lock.
+struct cache_entry {
+	struct cache_entry *hnext; // Bucket
+	struct cache_entry *prev; // LRU
+	struct cache_entry *next;
+	uint64_t time;
+	uint64_t id;
+	size_t size;
+	int status;
+	uint64_t length;
+	hash_digest_t digests[HASH_ALGO_MAX];
+	char const *type; // Points into url
+	char url[];
+};
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry *buckets[CONFIG_DB_CACHE_BUCKETS];
+	struct cache_entry *head; // Most recently used
+	struct cache_entry *tail;
+	size_t size;
+	uint64_t hits;
+	uint64_t misses;
+};
+static struct cache_shard cache[CONFIG_DB_CACHE_SHARDS];
+static int hx_cache_load(KVS_env *const db);
+
 int hx_db_load(void) {
 	if(shared_db) return 0;
 	size_t mapsize = 1024ull*1024*1024*64; // 64GB
@@ -28,7 +80,17 @@ int hx_db_load(void) {
 	if(rc < 0) goto cleanup;
 	rc = kvs_env_open(db, CONFIG_DB_PATH, 0, 0600);
 	if(rc < 0) goto cleanup;
+	rc = hx_filter_load(db);
+	if(rc < 0) goto cleanup;
+	rc = hx_cache_load(db);
+	if(rc < 0) goto cleanup;
 	shared_db = db; db = NULL;
+	async_mutex_init(write_lock, 0);
+	async_cond_init(write_cond, 0);
+	async_cond_init(done_cond, 0);
+	async_mutex_init(ids_lock, 0);
+	rc = async_spawn(STACK_DEFAULT, hx_writer, NULL);
+	if(rc < 0) goto cleanup;
 cleanup:
 	kvs_env_close(db); db = NULL;
 	return rc;
@@ -47,6 +109,373 @@ void hx_db_close(KVS_env **const in) {
 	async_pool_leave(NULL);
 }
 
+// A request that fails only aborts its own nested transaction.
+// Everyone else gets the result of the shared commit.
+static void hx_write_batch(struct hx_write *const batch) {
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc = 0;
+	for(struct hx_write *w = batch; w; w = w->next) w->rc = 0;
+
+	rc = hx_db_open(&db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+	for(struct hx_write *w = batch; w; w = w->next) {
+		KVS_txn *subtxn = NULL;
+		w->rc = kvs_txn_begin(db, txn, KVS_RDWR, &subtxn);
+		if(w->rc >= 0) w->rc = w->fn(subtxn, w->ctx);
+		if(w->rc >= 0) {
+			w->rc = kvs_txn_commit(subtxn); subtxn = NULL;
+		}
+		kvs_txn_abort(subtxn); subtxn = NULL;
+	}
+	rc = kvs_txn_commit(txn); txn = NULL;
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	hx_db_close(&db);
+	for(struct hx_write *w = batch; w; w = w->next) {
+		if(w->rc >= 0) w->rc = rc;
+	}
+}
+static void hx_writer(void *ignored) {
+	async_mutex_lock(write_lock);
+	for(;;) {
+		while(!write_head) async_cond_wait(write_cond, write_lock);
+		uint64_t const deadline = uv_now(async_loop) + CONFIG_DB_COMMIT_DELAY;
+		while(write_count < CONFIG_DB_COMMIT_BATCH) {
+			if(async_cond_timedwait(write_cond, write_lock, deadline) < 0) break;
+		}
+
+		struct hx_write *const batch = write_head;
+		struct hx_write **x = &write_head;
+		for(size_t i = 0; *x && i < CONFIG_DB_COMMIT_BATCH; i++) {
+			x = &(*x)->next;
+			write_count--;
+		}
+		write_head = *x;
+		*x = NULL;
+		if(!write_head) write_tail = &write_head;
+
+		async_mutex_unlock(write_lock);
+		hx_write_batch(batch);
+		async_mutex_lock(write_lock);
+		// The callers own these, so don't touch them after this.
+		for(struct hx_write *w = batch, *next; w; w = next) {
+			next = w->next;
+			w->done = true;
+		}
+		async_cond_broadcast(done_cond);
+	}
+}
+int hx_db_write(hx_write_fn const fn, void *const ctx) {
+	assert(fn);
+	struct hx_write w[1] = {{ fn, ctx, 0, false, NULL }};
+	async_mutex_lock(write_lock);
+	*write_tail = w;
+	write_tail = &w->next;
+	write_count++;
+	async_cond_signal(write_cond);
+	while(!w->done) async_cond_wait(done_cond, write_lock);
+	async_mutex_unlock(write_lock);
+	return w->rc;
+}
+
+static void hx_filter_hash(strarg_t const surt, uint64_t *const h1, uint64_t *const h2) {
+	uint64_t x = 0xcbf29ce484222325ull; // FNV-1a
+	for(char const *p = surt; *p; p++) x = (x ^ (unsigned char)*p) * 0x100000001b3ull;
+	*h1 = x;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	*h2 = x | 1;
+}
+void hx_filter_add(strarg_t const surt) {
+	assert(surt);
+	if(!filter_bits) return;
+	uint64_t h1, h2;
+	hx_filter_hash(surt, &h1, &h2);
+	for(size_t i = 0; i < CONFIG_DB_FILTER_HASHES; i++) {
+		uint64_t const bit = (h1 + i*h2) & (CONFIG_DB_FILTER_BITS-1);
+		filter_bits[bit / 64] |= 1ull << (bit % 64);
+	}
+}
+bool hx_filter_maybe(strarg_t const surt) {
+	assert(surt);
+	if(!filter_bits) return true;
+	uint64_t h1, h2;
+	hx_filter_hash(surt, &h1, &h2);
+	for(size_t i = 0; i < CONFIG_DB_FILTER_HASHES; i++) {
+		uint64_t const bit = (h1 + i*h2) & (CONFIG_DB_FILTER_BITS-1);
+		if(0 == (filter_bits[bit / 64] & 1ull << (bit % 64))) return false;
+	}
+	return true;
+}
+static int hx_filter_scan(KVS_txn *const txn, KVS_cursor *const cursor, KVS_range const *const range) {
+	KVS_val key[1];
+	int rc = kvs_cursor_firstr(cursor, range, key, NULL, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, range, key, NULL, +1)) {
+		// Both tables start with the SURT.
+		kvs_read_uint64(key);
+		strarg_t const surt = kvs_read_string(key, txn);
+		hx_filter_add(surt ? surt : "");
+	}
+	if(KVS_NOTFOUND != rc) return rc;
+	return 0;
+}
+// Runs at startup, before anyone else can write.
+static int hx_filter_load(KVS_env *const db) {
+	KVS_txn *txn = NULL;
+	KVS_cursor *cursor = NULL;
+	int rc = 0;
+	filter_bits = calloc(CONFIG_DB_FILTER_BITS / 64, sizeof(*filter_bits));
+	if(!filter_bits) rc = KVS_ENOMEM;
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) goto cleanup;
+	KVS_range crawled[1], queued[1];
+	HXURLSurtAndTimeIDRange0(crawled);
+	HXQueuedURLSurtAndTimeIDRange0(queued);
+	rc = hx_filter_scan(txn, cursor, crawled);
+	if(rc < 0) goto cleanup;
+	rc = hx_filter_scan(txn, cursor, queued);
+	if(rc < 0) goto cleanup;
+cleanup:
+	cursor = NULL;
+	kvs_txn_abort(txn); txn = NULL;
+	if(rc < 0) {
+		free(filter_bits); filter_bits = NULL;
+	}
+	return rc;
+}
+
+struct hx_ids_args {
+	uint64_t count;
+	uint64_t start; // Out
+};
+static int hx_ids_txn(KVS_txn *const txn, void *const ctx) {
+	struct hx_ids_args *const args = ctx;
+	KVS_val key[1], val[1];
+	HXNextIDKeyPack(key);
+	int rc = kvs_get(txn, key, val);
+	if(rc >= 0) HXNextIDValUnpack(val, &args->start);
+	else if(KVS_NOTFOUND == rc) args->start = 1;
+	else return rc;
+	KVS_val new_val[1];
+	HXNextIDValPack(new_val, args->start + args->count);
+	return kvs_put(txn, key, new_val, 0);
+}
+int hx_ids_next(struct hx_ids *const ids, uint64_t const count, uint64_t *const out) {
+	assert(ids);
+	assert(out);
+	assert(count);
+	int rc = 0;
+	if(ids->end - ids->next < count) {
+		// Blocks are durable before they're used, so IDs can't be
+		// handed out twice even if we crash.
+		async_mutex_lock(ids_lock);
+		if(ids->end - ids->next < count) {
+			struct hx_ids_args args[1] = {{ MAX(count, CONFIG_DB_ID_BLOCK), 0 }};
+			rc = hx_db_write(hx_ids_txn, args);
+			if(rc >= 0) {
+				ids->next = args->start;
+				ids->end = args->start + args->count;
+			}
+		}
+		async_mutex_unlock(ids_lock);
+		if(rc < 0) return rc;
+	}
+	*out = ids->next;
+	ids->next += count;
+	return 0;
+}
+
+static uint64_t cache_hash(uint64_t const time, uint64_t const id) {
+	uint64_t x = time*0x9e3779b97f4a7c15ull ^ id*0xc2b2ae3d27d4eb4full;
+	return x ^ x >> 29;
+}
+static struct cache_shard *cache_shard(uint64_t const hash) {
+	return &cache[hash % CONFIG_DB_CACHE_SHARDS];
+}
+static struct cache_entry **cache_bucket(struct cache_shard *const shard, uint64_t const hash) {
+	return &shard->buckets[hash / CONFIG_DB_CACHE_SHARDS & (CONFIG_DB_CACHE_BUCKETS-1)];
+}
+// The shard must be locked for all of these.
+static void cache_unlink(struct cache_shard *const shard, struct cache_entry *const e) {
+	if(e->prev) e->prev->next = e->next;
+	else shard->head = e->next;
+	if(e->next) e->next->prev = e->prev;
+	else shard->tail = e->prev;
+	e->prev = NULL;
+	e->next = NULL;
+}
+static void cache_push(struct cache_shard *const shard, struct cache_entry *const e) {
+	e->prev = NULL;
+	e->next = shard->head;
+	if(shard->head) shard->head->prev = e;
+	else shard->tail = e;
+	shard->head = e;
+}
+static void cache_evict(struct cache_shard *const shard, struct cache_entry *const e) {
+	struct cache_entry **x = cache_bucket(shard, cache_hash(e->time, e->id));
+	while(*x != e) x = &(*x)->hnext;
+	*x = e->hnext;
+	cache_unlink(shard, e);
+	shard->size -= e->size;
+	free(e);
+}
+
+static bool hx_cache_get(uint64_t const time, uint64_t const id, struct response *const out) {
+	uint64_t const hash = cache_hash(time, id);
+	struct cache_shard *const shard = cache_shard(hash);
+	pthread_mutex_lock(&shard->lock);
+	struct cache_entry *e = *cache_bucket(shard, hash);
+	for(; e; e = e->hnext) {
+		if(time == e->time && id == e->id) break;
+	}
+	if(!e) {
+		shard->misses++;
+		pthread_mutex_unlock(&shard->lock);
+		return false;
+	}
+	shard->hits++;
+	cache_unlink(shard, e);
+	cache_push(shard, e);
+	out->time = time;
+	out->id = id;
+	strlcpy(out->url, e->url, sizeof(out->url));
+	out->status = e->status;
+	strlcpy(out->type, e->type, sizeof(out->type));
+	out->length = e->length;
+	memcpy(out->digests, e->digests, sizeof(out->digests));
+	out->etag[0] = '\0';
+	out->modified[0] = '\0';
+	pthread_mutex_unlock(&shard->lock);
+	return true;
+}
+// Caching is optional, so running out of memory isn't an error.
+static void hx_cache_put(struct response const *const res) {
+	size_t const ulen = strlen(res->url)+1;
+	size_t const tlen = strlen(res->type)+1;
+	size_t const size = sizeof(struct cache_entry) + ulen + tlen;
+	struct cache_entry *e = malloc(size);
+	if(!e) return;
+	e->time = res->time;
+	e->id = res->id;
+	e->size = size;
+	e->status = res->status;
+	e->length = res->length;
+	memcpy(e->digests, res->digests, sizeof(e->digests));
+	memcpy(e->url, res->url, ulen);
+	memcpy(e->url+ulen, res->type, tlen);
+	e->type = e->url+ulen;
+
+	uint64_t const hash = cache_hash(res->time, res->id);
+	struct cache_shard *const shard = cache_shard(hash);
+	struct cache_entry **const bucket = cache_bucket(shard, hash);
+	pthread_mutex_lock(&shard->lock);
+	for(struct cache_entry *x = *bucket; x; x = x->hnext) {
+		if(res->time != x->time || res->id != x->id) continue;
+		free(e); e = NULL; // Someone else got there first
+		goto cleanup;
+	}
+	e->hnext = *bucket;
+	*bucket = e;
+	cache_push(shard, e);
+	shard->size += size;
+	while(shard->size > CONFIG_DB_CACHE_SIZE / CONFIG_DB_CACHE_SHARDS && shard->tail != e) {
+		cache_evict(shard, shard->tail);
+	}
+cleanup:
+	pthread_mutex_unlock(&shard->lock);
+}
+// Warms the cache with the newest responses, which are the ones
+// most likely to be looked up. Runs at startup.
+static int hx_cache_load(KVS_env *const db) {
+	KVS_txn *txn = NULL;
+	KVS_cursor *cursor = NULL;
+	size_t i = 0;
+	int rc = 0;
+	for(size_t j = 0; j < CONFIG_DB_CACHE_SHARDS; j++) {
+		rc = -pthread_mutex_init(&cache[j].lock, NULL);
+		if(rc < 0) return rc;
+	}
+	if(!CONFIG_DB_CACHE_WARM) return 0;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) goto cleanup;
+	KVS_range range[1];
+	KVS_val key[1], val[1];
+	struct response res[1];
+	HXTimeIDToResponseRange0(range);
+	rc = kvs_cursor_firstr(cursor, range, key, val, -1);
+	for(; rc >= 0 && i < CONFIG_DB_CACHE_WARM; rc = kvs_cursor_nextr(cursor, range, key, val, -1)) {
+		HXTimeIDToResponseKeyUnpack(key, &res->time, &res->id);
+		HXTimeIDToResponseValUnpack(val, txn, res);
+		hx_cache_put(res);
+		i++;
+	}
+	if(KVS_NOTFOUND == rc) rc = 0;
+cleanup:
+	cursor = NULL;
+	kvs_txn_abort(txn); txn = NULL;
+	return rc;
+}
+void hx_cache_stats(uint64_t *const hits, uint64_t *const misses, size_t *const size) {
+	uint64_t h = 0, m = 0;
+	size_t s = 0;
+	for(size_t i = 0; i < CONFIG_DB_CACHE_SHARDS; i++) {
+		pthread_mutex_lock(&cache[i].lock);
+		h += cache[i].hits;
+		m += cache[i].misses;
+		s += cache[i].size;
+		pthread_mutex_unlock(&cache[i].lock);
+	}
+	if(hits) *hits = h;
+	if(misses) *misses = m;
+	if(size) *size = s;
+}
+// Looks up a response by its key, from the cache if possible.
+// Doesn't touch next, prev or flags, except to clear HX_RES_SUMMARY.
+static int hx_response_get(KVS_txn *const txn, uint64_t const time, uint64_t const id, struct response *const out) {
+	out->flags &= ~HX_RES_SUMMARY;
+	if(hx_cache_get(time, id, out)) return 0;
+	KVS_val key[1], val[1];
+	HXTimeIDToResponseKeyPack(key, time, id);
+	int rc = kvs_get(txn, key, val);
+	if(rc < 0) return rc;
+	out->time = time;
+	out->id = id;
+	HXTimeIDToResponseValUnpack(val, txn, out);
+	hx_cache_put(out);
+	return 0;
+}
+
+static int recrawl_set(KVS_txn *const txn, strarg_t const surt, strarg_t const URL, uint64_t const time) {
+	KVS_val key[1], val[1];
+	HXURLSurtToRecrawlKeyPack(key, txn, surt);
+	int rc = kvs_get(txn, key, val);
+	if(rc >= 0) {
+		uint64_t old;
+		HXURLSurtToRecrawlValUnpack(val, &old);
+		KVS_val old_key[1];
+		HXRecrawlTimeAndURLSurtKeyPack(old_key, txn, old, surt);
+		rc = kvs_del(txn, old_key, 0);
+	}
+	if(KVS_NOTFOUND == rc) rc = 0;
+	if(rc < 0) return rc;
+	HXURLSurtToRecrawlValPack(val, time);
+	rc = kvs_put(txn, key, val, 0);
+	if(rc < 0) return rc;
+	KVS_val time_key[1], time_val[1];
+	HXRecrawlTimeAndURLSurtKeyPack(time_key, txn, time, surt);
+	HXRecrawlTimeAndURLSurtValPack(time_val, txn, URL);
+	return kvs_put(txn, time_key, time_val, 0);
+}
+
 int hx_response_add(KVS_txn *const txn, struct response const *const res, uint64_t const id) {
 	assert(txn);
 	assert(res);
@@ -83,20 +512,36 @@ int hx_response_add(KVS_txn *const txn, struct response const *const res, uint64
 	rc = kvs_put(txn, res_key, res_val, KVS_NOOVERWRITE_FAST);
 	if(rc < 0) return rc;
 
-	KVS_val url_key[1];
+	KVS_val url_key[1], url_val[1];
 	HXURLSurtAndTimeIDKeyPack(url_key, txn, URL_surt, res->time, id);
-	rc = kvs_put(txn, url_key, NULL, KVS_NOOVERWRITE_FAST);
+	HXIndexSummaryValPack(url_val, res, -1);
+	rc = kvs_put(txn, url_key, CONFIG_DB_COVERING_INDEXES ? url_val : NULL, KVS_NOOVERWRITE_FAST);
 	if(rc < 0) return rc;
+	hx_filter_add(URL_surt);
 
-	KVS_val hash_key[1];
 	for(size_t i = 0; i < numberof(res->digests); i++) {
 		if(!res->digests[i].len) continue;
 		assert(res->digests[i].len >= HX_HASH_INDEX_LEN);
+		KVS_val hash_key[1], hash_val[1];
 		HXAlgoHashAndTimeIDKeyPack(hash_key, i, res->digests[i].buf, res->time, id);
-		rc = kvs_put(txn, hash_key, NULL, KVS_NOOVERWRITE_FAST);
+		HXIndexSummaryValPack(hash_val, res, (int)i);
+		rc = kvs_put(txn, hash_key, CONFIG_DB_COVERING_INDEXES ? hash_val : NULL, KVS_NOOVERWRITE_FAST);
 		if(rc < 0) return rc;
 	}
 
+	// Old validators can stay when there are no new ones, because
+	// the server only honors them if they still match.
+	if(200 == res->status && (res->etag[0] || res->modified[0])) {
+		KVS_val vkey[1], vval[1];
+		HXURLSurtToValidatorsKeyPack(vkey, txn, URL_surt);
+		HXURLSurtToValidatorsValPack(vval, txn, res->time, id, res);
+		rc = kvs_put(txn, vkey, vval, 0);
+		if(rc < 0) return rc;
+	}
+
+	rc = recrawl_set(txn, URL_surt, res->url, res->time + CONFIG_RECRAWL_MIN_SECONDS);
+	if(rc < 0) return rc;
+
 	return 0;
 }
 
@@ -196,7 +641,7 @@ cleanup:
 	if(rc < 0) return rc;
 	return i;
 }
-ssize_t hx_get_history(strarg_t const URL, struct response *const out, size_t const max) {
+static ssize_t get_history(strarg_t const URL, struct response *const out, size_t const max, bool const dups) {
 	assert(out);
 	assert(max > 0);
 
@@ -217,27 +662,36 @@ ssize_t hx_get_history(strarg_t const URL, struct response *const out, size_t co
 	if(rc < 0) goto cleanup;
 
 	KVS_range range[1];
-	KVS_val key[1];
+	KVS_val key[1], val[1];
 	HXURLSurtAndTimeIDRange1(range, txn, surt);
-	rc = kvs_cursor_firstr(cursor, range, key, NULL, -1);
+	rc = kvs_cursor_firstr(cursor, range, key, val, -1);
 	if(rc < 0 && KVS_NOTFOUND != rc) goto cleanup;
-	for(; rc >= 0 && i < max; rc = kvs_cursor_nextr(cursor, range, key, NULL, -1)) {
+	for(; rc >= 0 && i < max; rc = kvs_cursor_nextr(cursor, range, key, val, -1)) {
 		strarg_t surt;
 		uint64_t time, id;
 		HXURLSurtAndTimeIDKeyUnpack(key, txn, &surt, &time, &id);
 
-		KVS_val res_key[1], res_val[1];
-		HXTimeIDToResponseKeyPack(res_key, time, id);
-		rc = kvs_get(txn, res_key, res_val);
-		if(rc < 0) goto cleanup;
-
 		out[i].time = time;
 		out[i].id = id;
-		HXTimeIDToResponseValUnpack(res_val, txn, &out[i]);
+		out[i].flags = 0;
+		if(val->size) {
+			HXIndexSummaryValUnpack(val, &out[i]);
+		} else {
+			rc = hx_response_get(txn, time, id, &out[i]);
+			if(rc < 0) goto cleanup;
+		}
 		i++;
 	}
 	rc = 0;
+	// Summaries have enough of each digest to find repeats,
+	// which are the only ones that can stay summaries.
 	res_merge_common_content(out, i);
+	for(size_t j = 0; j < i; j++) {
+		if(!(out[j].flags & HX_RES_SUMMARY)) continue;
+		if(!dups && out[j].prev) continue;
+		rc = hx_response_get(txn, out[j].time, out[j].id, &out[j]);
+		if(rc < 0) goto cleanup;
+	}
 
 cleanup:
 	kvs_cursor_close(cursor); cursor = NULL;
@@ -246,6 +700,12 @@ cleanup:
 	if(rc < 0) return rc;
 	return i;
 }
+ssize_t hx_get_history(strarg_t const URL, struct response *const out, size_t const max) {
+	return get_history(URL, out, max, true);
+}
+ssize_t hx_get_history_unique(strarg_t const URL, struct response *const out, size_t const max) {
+	return get_history(URL, out, max, false);
+}
 ssize_t hx_get_sources(hash_uri_t const *const obj, struct response *const out, size_t const max) {
 	assert(out);
 	assert(max > 0);
@@ -265,30 +725,35 @@ ssize_t hx_get_sources(hash_uri_t const *const obj, struct response *const out,
 	if(rc < 0) goto cleanup;
 
 	KVS_range range[1];
-	KVS_val hash_key[1];
+	KVS_val hash_key[1], hash_val[1];
 	HXAlgoHashAndTimeIDRange2(range, obj->algo, obj->buf, obj->len);
-	rc = kvs_cursor_firstr(cursor, range, hash_key, NULL, -1);
-	for(; rc >= 0 && i < max; rc = kvs_cursor_nextr(cursor, range, hash_key, NULL, -1)) {
+	rc = kvs_cursor_firstr(cursor, range, hash_key, hash_val, -1);
+	for(; rc >= 0 && i < max; rc = kvs_cursor_nextr(cursor, range, hash_key, hash_val, -1)) {
 		hash_algo algo;
 		unsigned char const *hash;
 		uint64_t time, id;
 		HXAlgoHashAndTimeIDKeyUnpack(hash_key, &algo, &hash, &time, &id);
 
-		KVS_val res_key[1], res_val[1];
-		HXTimeIDToResponseKeyPack(res_key, time, id);
-		rc = kvs_get(txn, res_key, res_val);
-		if(rc < 0) goto cleanup;
-
 		out[i].time = time;
 		out[i].id = id;
 		out[i].flags = 0;
-		HXTimeIDToResponseValUnpack(res_val, txn, &out[i]);
+		if(hash_val->size) {
+			HXIndexSummaryValUnpack(hash_val, &out[i]);
+		} else {
+			rc = hx_response_get(txn, time, id, &out[i]);
+			if(rc < 0) goto cleanup;
+		}
 
 		// Our index is truncated so it can return spurrious matches.
 		// Ensure the complete prefix matches.
 		if(obj->len > out[i].digests[obj->algo].len) continue;
 		if(0 != memcmp(out[i].digests[obj->algo].buf, obj->buf, obj->len)) continue;
 
+		if(out[i].flags & HX_RES_SUMMARY) {
+			rc = hx_response_get(txn, time, id, &out[i]);
+			if(rc < 0) goto cleanup;
+		}
+
 		uint64_t ltime, lid;
 		rc = hx_get_latest(out[i].url, txn, &ltime, &lid);
 		if(rc < 0) goto cleanup;
@@ -366,3 +831,151 @@ cleanup:
 	return rc;
 }
 
+
+int hx_checkpoint_get(strarg_t const URL, struct checkpoint *const out) {
+	assert(out);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	char surt[URI_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) goto cleanup;
+	rc = hx_db_open(&db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	KVS_val key[1], val[1];
+	HXURLSurtToCheckpointKeyPack(key, txn, surt);
+	rc = kvs_get(txn, key, val);
+	if(rc < 0) goto cleanup;
+	HXURLSurtToCheckpointValUnpack(val, txn, out);
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	hx_db_close(&db);
+	return rc;
+}
+int hx_checkpoint_put(strarg_t const URL, struct checkpoint const *const cp) {
+	assert(cp);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	char surt[URI_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) goto cleanup;
+	rc = hx_db_open(&db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+	KVS_val key[1], val[1];
+	HXURLSurtToCheckpointKeyPack(key, txn, surt);
+	HXURLSurtToCheckpointValPack(val, txn, cp);
+	rc = kvs_put(txn, key, val, 0);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_commit(txn); txn = NULL;
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	hx_db_close(&db);
+	return rc;
+}
+int hx_checkpoint_del(strarg_t const URL) {
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	char surt[URI_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) goto cleanup;
+	rc = hx_db_open(&db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+	KVS_val key[1];
+	HXURLSurtToCheckpointKeyPack(key, txn, surt);
+	rc = kvs_del(txn, key, 0);
+	if(KVS_NOTFOUND == rc) rc = 0;
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_commit(txn); txn = NULL;
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	hx_db_close(&db);
+	return rc;
+}
+
+// Gets the response that the stored validators belong to,
+// along with the validators themselves.
+int hx_validators_get(strarg_t const URL, struct response *const out) {
+	assert(out);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	char surt[URI_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) goto cleanup;
+	rc = hx_db_open(&db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+
+	KVS_val vkey[1], vval[1];
+	HXURLSurtToValidatorsKeyPack(vkey, txn, surt);
+	rc = kvs_get(txn, vkey, vval);
+	if(rc < 0) goto cleanup;
+	uint64_t time, id;
+	strarg_t etag, modified;
+	HXURLSurtToValidatorsValUnpack(vval, txn, &time, &id, &etag, &modified);
+	char etag_copy[VALIDATOR_MAX], modified_copy[VALIDATOR_MAX];
+	strlcpy(etag_copy, etag, sizeof(etag_copy));
+	strlcpy(modified_copy, modified, sizeof(modified_copy));
+
+	KVS_val key[1], val[1];
+	HXTimeIDToResponseKeyPack(key, time, id);
+	rc = kvs_get(txn, key, val);
+	if(rc < 0) goto cleanup;
+	out->time = time;
+	out->id = id;
+	HXTimeIDToResponseValUnpack(val, txn, out);
+	strlcpy(out->etag, etag_copy, sizeof(out->etag));
+	strlcpy(out->modified, modified_copy, sizeof(out->modified));
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	hx_db_close(&db);
+	return rc;
+}
+
+ssize_t hx_recrawl_get(uint64_t const now, struct hx_recrawl *const out, size_t const max) {
+	assert(out);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	KVS_cursor *cursor = NULL;
+	size_t i = 0;
+	int rc = hx_db_open(&db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = kvs_cursor_open(txn, &cursor);
+	if(rc < 0) goto cleanup;
+
+	KVS_range range[1];
+	KVS_val key[1], val[1];
+	HXRecrawlTimeAndURLSurtRange0(range);
+	rc = kvs_cursor_firstr(cursor, range, key, val, +1);
+	for(; rc >= 0 && i < max; rc = kvs_cursor_nextr(cursor, range, key, val, +1)) {
+		uint64_t time;
+		strarg_t surt, URL;
+		HXRecrawlTimeAndURLSurtKeyUnpack(key, txn, &time, &surt);
+		if(time > now) break;
+		HXRecrawlTimeAndURLSurtValUnpack(val, txn, &URL);
+		strlcpy(out[i].URL, URL, sizeof(out[i].URL));
+		out[i].time = time;
+		i++;
+	}
+	if(KVS_NOTFOUND == rc) rc = 0;
+cleanup:
+	kvs_cursor_close(cursor); cursor = NULL;
+	kvs_txn_abort(txn); txn = NULL;
+	hx_db_close(&db);
+	if(rc < 0) return rc;
+	return i;
+}
+int hx_recrawl_set(KVS_txn *const txn, strarg_t const URL, uint64_t const time) {
+	assert(txn);
+	char surt[URI_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) return rc;
+	return recrawl_set(txn, surt, URL, time);
+}
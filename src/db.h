@@ -12,8 +12,13 @@ enum {
 	// If there is a later response and their hashes differ,
 	// then the current response is obsolete.
 	HX_RES_LATEST = 1 << 0,
+	// Only has what the index summary holds: status, length and
+	// digest prefixes. The URL and type are empty.
+	HX_RES_SUMMARY = 1 << 1,
 };
 
+#define VALIDATOR_MAX (255+1)
+
 struct response {
 	uint64_t time;
 	uint64_t id;
@@ -22,32 +27,111 @@ struct response {
 	char type[TYPE_MAX];
 	uint64_t length;
 	hash_digest_t digests[HASH_ALGO_MAX];
+	char etag[VALIDATOR_MAX]; // Not stored with the response
+	char modified[VALIDATOR_MAX];
 	struct response *next;
 	struct response *prev;
 	unsigned int flags;
 };
 
+// Progress of a partial download, so it can be resumed with a Range
+// request as long as the validators still match.
+struct checkpoint {
+	uint64_t offset;
+	char etag[VALIDATOR_MAX];
+	char modified[VALIDATOR_MAX];
+	size_t len;
+	unsigned char state[HASHER_CHECKPOINT_MAX];
+};
+
 int hx_db_load(void);
 int hx_db_open(KVS_env **const out);
 void hx_db_close(KVS_env **const in);
 
+// Runs fn in a nested transaction as part of the next group commit,
+// and returns once that commit is durable. fn runs on the thread pool.
+typedef int (*hx_write_fn)(KVS_txn *const txn, void *const ctx);
+int hx_db_write(hx_write_fn const fn, void *const ctx);
+
+// Whether a SURT might have been queued or crawled. False means
+// it definitely hasn't. Only call these from a write.
+void hx_filter_add(strarg_t const surt);
+bool hx_filter_maybe(strarg_t const surt);
+
+// A block of IDs reserved on disk, so each writer can hand them out
+// without a lock and parallel writers never share one. Zero-initialize
+// before first use. IDs left over at exit are just skipped.
+struct hx_ids {
+	uint64_t next;
+	uint64_t end;
+};
+// Gets count consecutive IDs. Only waits when the block runs out.
+int hx_ids_next(struct hx_ids *const ids, uint64_t const count, uint64_t *const out);
+
 int hx_response_add(KVS_txn *const txn, struct response const *const res, uint64_t const id);
 
+// Lookups served from the response cache versus the database.
+void hx_cache_stats(uint64_t *const hits, uint64_t *const misses, size_t *const size);
+
 ssize_t hx_get_recent(struct response *const out, size_t const max);
 ssize_t hx_get_history(strarg_t const URL, struct response *const out, size_t const max);
+// Like hx_get_history(), but responses merged into an earlier one
+// (with prev set) might only be summaries. See HX_RES_SUMMARY.
+ssize_t hx_get_history_unique(strarg_t const URL, struct response *const out, size_t const max);
 ssize_t hx_get_sources(hash_uri_t const *const obj, struct response *const out, size_t const max);
 ssize_t hx_get_times(uint64_t const time, uint64_t const id, int const dir, struct response *const out, size_t const max);
 int hx_get_latest(strarg_t const URL, KVS_txn *const txn, uint64_t *const time, uint64_t *const id);
 
+int hx_validators_get(strarg_t const URL, struct response *const out);
+
+// When each URL should next be looked at for recrawling. Set to
+// CONFIG_RECRAWL_MIN_SECONDS after each response, the earliest it
+// could be due, and pushed back by the recrawler once it knows better.
+struct hx_recrawl {
+	char URL[URI_MAX];
+	uint64_t time;
+};
+ssize_t hx_recrawl_get(uint64_t const now, struct hx_recrawl *const out, size_t const max);
+int hx_recrawl_set(KVS_txn *const txn, strarg_t const URL, uint64_t const time);
+
+int hx_checkpoint_get(strarg_t const URL, struct checkpoint *const out);
+int hx_checkpoint_put(strarg_t const URL, struct checkpoint const *const cp);
+int hx_checkpoint_del(strarg_t const URL);
+
+// Which hash algorithms to compute for a queued URL.
+// Stored with the queue entry, so it's part of the on-disk format too.
+typedef enum {
+	HX_POLICY_FULL = 0, // Every algorithm
+	HX_POLICY_BULK = 1, // SHA-256, plus MD5 and SHA-1 for legacy lookups
+} hx_policy;
+
+// Dispatch priority for a queued URL, lowest first.
+// Each class has its own forward queue table.
+typedef enum {
+	HX_CLASS_BULK = 0, // Recrawls and imports
+	HX_CLASS_CRITICAL = 1, // The critical[] list
+	HX_CLASS_INTERACTIVE = 2, // Someone is waiting for it
+	HX_CLASS_MAX = 3,
+} hx_class;
+
 enum {
 	// 0-19 reserved.
 	// Remember this is the permanent on-disk format.
 
 	HXTimeIDToResponse = 20,
 	HXURLSurtAndTimeID = 21,
+	HXURLSurtToCheckpoint = 22,
+	HXURLSurtToValidators = 23,
+	HXURLSurtToFailures = 24,
+	HXHostToFailures = 25,
+	HXNextID = 26,
+	HXURLSurtToRecrawl = 27,
+	HXRecrawlTimeAndURLSurt = 28,
 
-	HXTimeIDQueuedURLAndClient = 30,
+	HXTimeIDQueuedURLAndClient = 30, // HX_CLASS_BULK
 	HXQueuedURLSurtAndTimeID = 31,
+	HXTimeIDQueuedCriticalURLAndClient = 32,
+	HXTimeIDQueuedInteractiveURLAndClient = 33,
 
 	HXHashAndTimeID = 50, // Note: hashes truncated, not necessarily unique!
 	// Add HASH_ALGO_XX to get per-algo table.
@@ -81,6 +165,8 @@ static void HXTimeIDToResponseValUnpack(KVS_val *const val, KVS_txn *const txn,
 	strlcpy(out->url, url, sizeof(out->url));
 	out->status = status;
 	strlcpy(out->type, type, sizeof(out->type));
+	strlcpy(out->etag, "", sizeof(out->etag));
+	strlcpy(out->modified, "", sizeof(out->modified));
 	assert(UINT64_MAX == (uint64_t)-1);
 	out->length = length-1; // 0 -> UINT64_MAX
 	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
@@ -96,6 +182,47 @@ static void HXTimeIDToResponseValUnpack(KVS_val *const val, KVS_txn *const txn,
 	}
 }
 
+// Optional index values (CONFIG_DB_COVERING_INDEXES), so lookups can
+// skip reading responses they won't show. URL entries keep a short
+// prefix of every digest, which is enough to spot repeated content,
+// and hash entries keep their own algorithm's whole digest, which is
+// enough to rule out truncation collisions. Pass -1 for URL entries.
+#define HX_SUMMARY_DIGEST_LEN 12
+#define HXIndexSummaryValPack(val, res, algo) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*2 + KVS_BLOB_MAX(HASH_DIGEST_MAX)*HASH_ALGO_MAX); \
+	kvs_bind_uint64((val), (uint64_t)(0xffff + (res)->status)); \
+	kvs_bind_uint64((val), (res)->length+1); \
+	for(int __i = 0; __i < HASH_ALGO_MAX; __i++) { \
+		if((algo) >= 0 && __i > (algo)) break; \
+		size_t const __len = (algo) < 0 ? \
+			MIN((res)->digests[__i].len, HX_SUMMARY_DIGEST_LEN) : \
+			(algo) == __i ? (res)->digests[__i].len : 0; \
+		kvs_bind_uint64((val), __len); \
+		kvs_bind_blob((val), (res)->digests[__i].buf, __len); \
+	} \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXIndexSummaryValUnpack(KVS_val *const val, struct response *const out) {
+	assert(out);
+	out->url[0] = '\0';
+	out->status = kvs_read_uint64(val) - 0xffff;
+	out->type[0] = '\0';
+	out->length = kvs_read_uint64(val)-1; // 0 -> UINT64_MAX
+	out->etag[0] = '\0';
+	out->modified[0] = '\0';
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(0 == val->size) {
+			out->digests[i].len = 0;
+			continue;
+		}
+		uint64_t const len = kvs_read_uint64(val);
+		kvs_assert(len <= hash_algo_digest_len(i));
+		unsigned char const *const buf = kvs_read_blob(val, len);
+		out->digests[i].len = len;
+		memcpy(out->digests[i].buf, buf, len);
+	}
+	out->flags |= HX_RES_SUMMARY;
+}
+
 #define HXURLSurtAndTimeIDKeyPack(val, txn, url, time, id) \
 	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*3 + KVS_INLINE_MAX); \
 	kvs_bind_uint64((val), HXURLSurtAndTimeID); \
@@ -103,6 +230,11 @@ static void HXTimeIDToResponseValUnpack(KVS_val *const val, KVS_txn *const txn,
 	kvs_bind_uint64((val), (time)); \
 	kvs_bind_uint64((val), (id)); \
 	KVS_VAL_STORAGE_VERIFY(val);
+#define HXURLSurtAndTimeIDRange0(range) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, HXURLSurtAndTimeID); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
 #define HXURLSurtAndTimeIDRange1(range, txn, url) \
 	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX+KVS_INLINE_MAX); \
 	kvs_bind_uint64((range)->min, HXURLSurtAndTimeID); \
@@ -117,26 +249,185 @@ static void HXURLSurtAndTimeIDKeyUnpack(KVS_val *const val, KVS_txn *const txn,
 	*id = kvs_read_uint64(val);
 }
 
-#define HXTimeIDQueuedURLAndClientKeyPack(val, txn, time, id, url, client) \
-	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*3 + KVS_INLINE_MAX*2) \
-	kvs_bind_uint64((val), HXTimeIDQueuedURLAndClient); \
+#define HXURLSurtToCheckpointKeyPack(val, txn, url) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX + KVS_INLINE_MAX); \
+	kvs_bind_uint64((val), HXURLSurtToCheckpoint); \
+	kvs_bind_string((val), (url), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define HXURLSurtToCheckpointValPack(val, txn, cp) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*2 + KVS_INLINE_MAX*2 + KVS_BLOB_MAX(HASHER_CHECKPOINT_MAX)); \
+	kvs_bind_uint64((val), (cp)->offset); \
+	kvs_bind_string((val), (cp)->etag, (txn)); \
+	kvs_bind_string((val), (cp)->modified, (txn)); \
+	kvs_bind_uint64((val), (cp)->len); \
+	kvs_bind_blob((val), (cp)->state, (cp)->len); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXURLSurtToCheckpointValUnpack(KVS_val *const val, KVS_txn *const txn, struct checkpoint *const out) {
+	assert(out);
+	out->offset = kvs_read_uint64(val);
+	strlcpy(out->etag, kvs_read_string(val, txn), sizeof(out->etag));
+	strlcpy(out->modified, kvs_read_string(val, txn), sizeof(out->modified));
+	uint64_t const len = kvs_read_uint64(val);
+	kvs_assert(len <= sizeof(out->state));
+	memcpy(out->state, kvs_read_blob(val, len), len);
+	out->len = len;
+}
+
+// Validators from the latest 200 response for a URL, so the next
+// crawl can make a conditional request.
+#define HXURLSurtToValidatorsKeyPack(val, txn, url) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX + KVS_INLINE_MAX); \
+	kvs_bind_uint64((val), HXURLSurtToValidators); \
+	kvs_bind_string((val), (url), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define HXURLSurtToValidatorsValPack(val, txn, time, id, res) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*2 + KVS_INLINE_MAX*2); \
+	kvs_bind_uint64((val), (time)); \
+	kvs_bind_uint64((val), (id)); \
+	kvs_bind_string((val), (res)->etag, (txn)); \
+	kvs_bind_string((val), (res)->modified, (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXURLSurtToValidatorsValUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const time, uint64_t *const id, strarg_t *const etag, strarg_t *const modified) {
+	*time = kvs_read_uint64(val);
+	*id = kvs_read_uint64(val);
+	*etag = kvs_read_string(val, txn);
+	*modified = kvs_read_string(val, txn);
+	// Older records also have the length, which we ignore.
+}
+
+// Consecutive failed fetches. The URL's last failure is its
+// latest response, so only hosts need the time.
+#define HXURLSurtToFailuresKeyPack(val, txn, url) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX + KVS_INLINE_MAX); \
+	kvs_bind_uint64((val), HXURLSurtToFailures); \
+	kvs_bind_string((val), (url), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define HXURLSurtToFailuresValPack(val, count) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX); \
+	kvs_bind_uint64((val), (count)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXURLSurtToFailuresValUnpack(KVS_val *const val, uint64_t *const count) {
+	*count = kvs_read_uint64(val);
+}
+#define HXHostToFailuresKeyPack(val, txn, host) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX + KVS_INLINE_MAX); \
+	kvs_bind_uint64((val), HXHostToFailures); \
+	kvs_bind_string((val), (host), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define HXHostToFailuresRange0(range) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, HXHostToFailures); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+static void HXHostToFailuresKeyUnpack(KVS_val *const val, KVS_txn *const txn, strarg_t *const host) {
+	uint64_t const table = kvs_read_uint64(val);
+	assert(HXHostToFailures == table);
+	*host = kvs_read_string(val, txn);
+}
+#define HXHostToFailuresValPack(val, count, time) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*2); \
+	kvs_bind_uint64((val), (count)); \
+	kvs_bind_uint64((val), (time)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXHostToFailuresValUnpack(KVS_val *const val, uint64_t *const count, uint64_t *const time) {
+	*count = kvs_read_uint64(val);
+	*time = kvs_read_uint64(val);
+}
+
+#define HXURLSurtToRecrawlKeyPack(val, txn, url) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX + KVS_INLINE_MAX); \
+	kvs_bind_uint64((val), HXURLSurtToRecrawl); \
+	kvs_bind_string((val), (url), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define HXURLSurtToRecrawlValPack(val, time) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX); \
+	kvs_bind_uint64((val), (time)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXURLSurtToRecrawlValUnpack(KVS_val *const val, uint64_t *const time) {
+	*time = kvs_read_uint64(val);
+}
+
+#define HXRecrawlTimeAndURLSurtKeyPack(val, txn, time, url) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*2 + KVS_INLINE_MAX); \
+	kvs_bind_uint64((val), HXRecrawlTimeAndURLSurt); \
+	kvs_bind_uint64((val), (time)); \
+	kvs_bind_string((val), (url), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define HXRecrawlTimeAndURLSurtRange0(range) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, HXRecrawlTimeAndURLSurt); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+static void HXRecrawlTimeAndURLSurtKeyUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const time, strarg_t *const url) {
+	uint64_t const table = kvs_read_uint64(val);
+	assert(HXRecrawlTimeAndURLSurt == table);
+	*time = kvs_read_uint64(val);
+	*url = kvs_read_string(val, txn);
+}
+// The original URL, since it can't be recovered from the SURT.
+#define HXRecrawlTimeAndURLSurtValPack(val, txn, URL) \
+	KVS_VAL_STORAGE(val, KVS_INLINE_MAX); \
+	kvs_bind_string((val), (URL), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXRecrawlTimeAndURLSurtValUnpack(KVS_val *const val, KVS_txn *const txn, strarg_t *const URL) {
+	*URL = kvs_read_string(val, txn);
+}
+
+// The first ID that hasn't been reserved by hx_ids_next().
+#define HXNextIDKeyPack(val) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX); \
+	kvs_bind_uint64((val), HXNextID); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define HXNextIDValPack(val, id) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX); \
+	kvs_bind_uint64((val), (id)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXNextIDValUnpack(KVS_val *const val, uint64_t *const id) {
+	*id = kvs_read_uint64(val);
+}
+
+static uint64_t HXQueueTable(hx_class const class) {
+	switch(class) {
+	case HX_CLASS_CRITICAL: return HXTimeIDQueuedCriticalURLAndClient;
+	case HX_CLASS_INTERACTIVE: return HXTimeIDQueuedInteractiveURLAndClient;
+	default: return HXTimeIDQueuedURLAndClient;
+	}
+}
+
+// The policy is omitted when it's HX_POLICY_FULL, for compatibility
+// with entries queued before it existed.
+#define HXTimeIDQueuedURLAndClientKeyPack(val, txn, class, time, id, url, client, policy) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*4 + KVS_INLINE_MAX*2) \
+	kvs_bind_uint64((val), HXQueueTable((class))); \
 	kvs_bind_uint64((val), (time)); \
 	kvs_bind_uint64((val), (id)); \
 	kvs_bind_string((val), (url), (txn)); \
 	kvs_bind_string((val), (client), (txn)); \
+	if(HX_POLICY_FULL != (policy)) kvs_bind_uint64((val), (policy)); \
 	KVS_VAL_STORAGE_VERIFY(val);
-#define HXTimeIDQueuedURLAndClientRange0(range) \
+#define HXTimeIDQueuedURLAndClientRange0(range, class) \
 	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX) \
-	kvs_bind_uint64((range)->min, HXTimeIDQueuedURLAndClient); \
+	kvs_bind_uint64((range)->min, HXQueueTable((class))); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+#define HXTimeIDQueuedURLAndClientRange2(range, class, time, id) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX*3) \
+	kvs_bind_uint64((range)->min, HXQueueTable((class))); \
+	kvs_bind_uint64((range)->min, (time)); \
+	kvs_bind_uint64((range)->min, (id)); \
 	kvs_range_genmax((range)); \
 	KVS_RANGE_STORAGE_VERIFY(range);
-static void HXTimeIDQueuedURLAndClientKeyUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const time, uint64_t *const id, strarg_t *const URL, strarg_t *const client) {
+static void HXTimeIDQueuedURLAndClientKeyUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const time, uint64_t *const id, strarg_t *const URL, strarg_t *const client, hx_policy *const policy) {
 	uint64_t const table = kvs_read_uint64(val);
-	assert(HXTimeIDQueuedURLAndClient == table);
+	assert(
+		HXTimeIDQueuedURLAndClient == table ||
+		HXTimeIDQueuedCriticalURLAndClient == table ||
+		HXTimeIDQueuedInteractiveURLAndClient == table);
 	*time = kvs_read_uint64(val);
 	*id = kvs_read_uint64(val);
 	*URL = kvs_read_string(val, txn);
 	*client = kvs_read_string(val, txn);
+	*policy = 0 == val->size ? HX_POLICY_FULL : kvs_read_uint64(val);
 }
 
 #define HXQueuedURLSurtAndTimeIDKeyPack(val, txn, url, time, id) \
@@ -146,12 +437,27 @@ static void HXTimeIDQueuedURLAndClientKeyUnpack(KVS_val *const val, KVS_txn *con
 	kvs_bind_uint64((val), (time)); \
 	kvs_bind_uint64((val), (id)); \
 	KVS_VAL_STORAGE_VERIFY(val);
+#define HXQueuedURLSurtAndTimeIDRange0(range) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, HXQueuedURLSurtAndTimeID); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
 #define HXQueuedURLSurtAndTimeIDRange1(range, txn, url) \
 	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX+KVS_INLINE_MAX); \
 	kvs_bind_uint64((range)->min, HXQueuedURLSurtAndTimeID); \
 	kvs_bind_string((range)->min, (url), (txn)); \
 	kvs_range_genmax((range)); \
 	KVS_RANGE_STORAGE_VERIFY(range);
+// The class is omitted when it's HX_CLASS_BULK, which is
+// what entries queued before it existed were.
+#define HXQueuedURLSurtAndTimeIDValPack(val, class) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX); \
+	if(HX_CLASS_BULK != (class)) kvs_bind_uint64((val), (class)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void HXQueuedURLSurtAndTimeIDValUnpack(KVS_val *const val, hx_class *const class) {
+	*class = 0 == val->size ? HX_CLASS_BULK : kvs_read_uint64(val);
+	kvs_assert(*class < HX_CLASS_MAX);
+}
 static void HXQueuedURLSurtAndTimeIDKeyUnpack(KVS_val *const val, KVS_txn *const txn, strarg_t *const url, uint64_t *const time, uint64_t *const id) {
 	uint64_t const table = kvs_read_uint64(val);
 	assert(HXQueuedURLSurtAndTimeID == table);
@@ -1,33 +1,236 @@
 // Copyright 2016 Ben Trask
 // MIT licensed (see LICENSE for details)
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
 #include <async/http/HTTP.h>
 #include "util/hash.h"
+#include "util/strext.h"
 #include "util/url.h"
 #include "db.h"
 #include "common.h"
 #include "errors.h"
+#include "config.h"
+#include "conn_pool.h"
 
 #define USER_AGENT "Hash Archive (https://github.com/btrask/hash-archive)"
 #define REDIRECT_MAX 5
 
-static int send_get(strarg_t const URL, strarg_t const client, HTTPConnectionRef *const out) {
-	assert(out);
-	HTTPConnectionRef conn = NULL;
-	url_t obj[1];
+// Body chunks are coalesced into batches, which a separate coroutine
+// hashes on the thread pool while the next batch is being read.
+#define FETCH_BATCH_SIZE (1024*1024*1)
+#define FETCH_BATCHES 3
+
+struct fetch_pipe {
+	hasher_t *hasher;
+	async_mutex_t lock[1];
+	async_cond_t cond[1];
+	unsigned char *bufs[FETCH_BATCHES];
+	size_t lens[FETCH_BATCHES];
+	size_t fill; // Bytes in the unpublished batch
+	uint64_t head; // Batches published
+	uint64_t tail; // Batches hashed
+	bool eof;
+	bool running;
+	int rc;
+};
+
+// Time spent in hasher calls on the thread pool, including any wait
+// for a free thread, so the worker pool can tell when CPUs run out.
+static uint64_t hash_time = 0; // ns
+uint64_t fetch_hash_time(void) {
+	return hash_time;
+}
+
+static void fetch_pipe_hash(void *const arg) {
+	struct fetch_pipe *const p = arg;
+	async_mutex_lock(p->lock);
+	for(;;) {
+		while(p->tail == p->head && !p->eof) {
+			async_cond_wait(p->cond, p->lock);
+		}
+		if(p->tail == p->head) break;
+		size_t const x = p->tail % FETCH_BATCHES;
+		async_mutex_unlock(p->lock);
+		// Keep draining after an error so the reader never stalls.
+		if(p->rc >= 0) {
+			uint64_t const start = uv_hrtime();
+			async_pool_enter(NULL);
+			int rc = hasher_update(p->hasher, p->bufs[x], p->lens[x]);
+			async_pool_leave(NULL);
+			hash_time += uv_hrtime() - start;
+			if(rc < 0) p->rc = rc;
+		}
+		async_mutex_lock(p->lock);
+		p->tail++;
+		async_cond_broadcast(p->cond);
+	}
+	p->running = false;
+	async_cond_broadcast(p->cond);
+	async_mutex_unlock(p->lock);
+}
+static int fetch_pipe_init(struct fetch_pipe *const p, hasher_t *const hasher) {
+	memset(p, 0, sizeof(*p));
+	async_mutex_init(p->lock, 0);
+	async_cond_init(p->cond, 0);
+	p->hasher = hasher;
+	for(size_t i = 0; i < FETCH_BATCHES; i++) {
+		p->bufs[i] = malloc(FETCH_BATCH_SIZE);
+		if(!p->bufs[i]) return UV_ENOMEM;
+	}
+	p->running = true;
+	int rc = async_spawn(STACK_DEFAULT, fetch_pipe_hash, p);
+	if(rc < 0) p->running = false;
+	return rc;
+}
+static void fetch_pipe_publish(struct fetch_pipe *const p) {
+	if(!p->fill) return;
+	async_mutex_lock(p->lock);
+	p->lens[p->head % FETCH_BATCHES] = p->fill;
+	p->head++;
+	p->fill = 0;
+	async_cond_broadcast(p->cond);
+	async_mutex_unlock(p->lock);
+}
+static int fetch_pipe_write(struct fetch_pipe *const p, unsigned char const *const buf, size_t const len) {
+	size_t pos = 0;
+	while(pos < len) {
+		if(0 == p->fill) {
+			async_mutex_lock(p->lock);
+			while(p->head - p->tail >= FETCH_BATCHES) {
+				async_cond_wait(p->cond, p->lock);
+			}
+			async_mutex_unlock(p->lock);
+			if(p->rc < 0) return p->rc;
+		}
+		unsigned char *const batch = p->bufs[p->head % FETCH_BATCHES];
+		size_t x = FETCH_BATCH_SIZE - p->fill;
+		if(x > len-pos) x = len-pos;
+		memcpy(batch+p->fill, buf+pos, x);
+		p->fill += x;
+		pos += x;
+		if(FETCH_BATCH_SIZE == p->fill) fetch_pipe_publish(p);
+	}
+	return 0;
+}
+// Waits for everything written so far to be hashed.
+static int fetch_pipe_sync(struct fetch_pipe *const p) {
+	if(p->running) {
+		fetch_pipe_publish(p);
+		async_mutex_lock(p->lock);
+		while(p->tail != p->head) async_cond_wait(p->cond, p->lock);
+		async_mutex_unlock(p->lock);
+	}
+	return p->rc;
+}
+// Like fetch_pipe_sync(), but also stops the hashing coroutine.
+static int fetch_pipe_finish(struct fetch_pipe *const p) {
+	if(p->running) {
+		fetch_pipe_publish(p);
+		async_mutex_lock(p->lock);
+		p->eof = true;
+		async_cond_broadcast(p->cond);
+		while(p->running) async_cond_wait(p->cond, p->lock);
+		async_mutex_unlock(p->lock);
+	}
+	return p->rc;
+}
+static void fetch_pipe_destroy(struct fetch_pipe *const p) {
+	if(!p->hasher) return; // Never initialized
+	// Never free the buffers out from under the hashing coroutine.
+	p->fill = 0;
+	fetch_pipe_finish(p);
+	async_mutex_destroy(p->lock);
+	async_cond_destroy(p->cond);
+	for(size_t i = 0; i < FETCH_BATCHES; i++) {
+		free(p->bufs[i]); p->bufs[i] = NULL;
+	}
+	p->hasher = NULL;
+}
+
+// If-Range only accepts strong ETags.
+static strarg_t checkpoint_validator(struct checkpoint const *const cp) {
+	if(cp->etag[0] && 0 != strncmp(cp->etag, "W/", 2)) return cp->etag;
+	if(cp->modified[0]) return cp->modified;
+	return NULL;
+}
+static int checkpoint_resumes(struct checkpoint const *const cp, HTTPHeadersRef const headers) {
+	char const *const range = HTTPHeadersGet(headers, "Content-Range");
+	unsigned long long start = 0;
+	if(!range || 1 != sscanf(range, "bytes %llu-", &start)) return HX_ERR_TRUNCATED;
+	if(start != cp->offset) return HX_ERR_TRUNCATED;
+	char const *const etag = HTTPHeadersGet(headers, "ETag");
+	if(etag && cp->etag[0] && 0 != strcmp(etag, cp->etag)) return HX_ERR_TRUNCATED;
+	return 0;
+}
+// Only pipe and hasher errors are returned. A checkpoint that can't be
+// saved just means starting over if the fetch fails, so it's logged and
+// cp->offset is left at the last one that was.
+static int checkpoint_save(strarg_t const URL, struct fetch_pipe *const pipe, hasher_t *const hasher, uint64_t const length, struct checkpoint *const cp) {
+	int rc = fetch_pipe_sync(pipe);
+	if(rc < 0) return rc;
+	// Might have to wait for hasher threads.
+	async_pool_enter(NULL);
+	ssize_t const len = hasher_checkpoint(hasher, cp->state, sizeof(cp->state));
+	async_pool_leave(NULL);
+	if(len < 0 && HASH_ENOMEM != len) return (int)len; // Hasher failed
+	uint64_t const offset = cp->offset;
+	if(len >= 0) {
+		cp->offset = length;
+		cp->len = (size_t)len;
+		rc = hx_checkpoint_put(URL, cp);
+	} else {
+		rc = (int)len; // State too big to save
+	}
+	if(rc < 0) {
+		alogf("Couldn't checkpoint %s: %s\n", URL, hx_strerror(rc));
+		cp->offset = offset;
+	}
+	return 0;
+}
+
+// A 304 only helps if the old response has every digest we want.
+static bool validators_usable(struct response const *const prev, uint64_t const algos) {
+	if(200 != prev->status) return false;
+	if(!prev->etag[0] && !prev->modified[0]) return false;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(!(algos & 1ull << i)) continue;
+		if(!prev->digests[i].len) return false;
+	}
+	return true;
+}
+
+// A connection checked out of the pool.
+struct fetch_conn {
 	host_t host[1];
 	bool secure;
+	bool reused;
+	HTTPConnectionRef conn;
+};
+static void fetch_conn_release(struct fetch_conn *const fc, bool const keep) {
+	conn_pool_release(fc->host, fc->secure, &fc->conn, keep);
+}
+static bool fetch_conn_keepalive(HTTPHeadersRef const headers) {
+	char const *const x = HTTPHeadersGet(headers, "Connection");
+	return !x || 0 != strcasecmp(x, "close");
+}
+
+static int send_get(strarg_t const URL, strarg_t const client, struct checkpoint const *const cp, struct response const *const prev, struct fetch_conn *const fc) {
+	assert(fc);
+	assert(!fc->conn);
+	url_t obj[1];
 	int rc = 0;
 
 	rc = url_parse(URL, obj);
 	if(rc < 0) goto cleanup;
-	rc = host_parse(obj->host, host);
+	rc = host_parse(obj->host, fc->host);
 	if(rc < 0) goto cleanup;
 
 	if(0 == strcmp(obj->scheme, "http")) {
-		secure = false;
+		fc->secure = false;
 	} else if(0 == strcmp(obj->scheme, "https")) {
-		secure = true;
+		fc->secure = true;
 	} else {
 		rc = UV_EPROTONOSUPPORT;
 		goto cleanup;
@@ -38,68 +241,199 @@ static int send_get(strarg_t const URL, strarg_t const client, HTTPConnectionRef
 	}
 	strlcat(obj->path, obj->query, sizeof(obj->path));
 
-	rc = rc < 0 ? rc : HTTPConnectionConnect(host->domain, host->port, secure, 0, &conn);
+	rc = conn_pool_connect(fc->host, fc->secure, &fc->conn, &fc->reused);
+	if(rc < 0) goto cleanup;
+	HTTPConnectionRef const conn = fc->conn;
 	rc = rc < 0 ? rc : HTTPConnectionWriteRequest(conn, HTTP_GET, obj->path, obj->host);
 	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "User-Agent", USER_AGENT);
 	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Referer", URL);
 	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "X-Forwarded-For", client); // TODO
-	HTTPConnectionSetKeepAlive(conn, false); // No point.
+	if(cp->offset) {
+		char range[64];
+		snprintf(range, sizeof(range), "bytes=%llu-", (unsigned long long)cp->offset);
+		rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Range", range);
+		rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "If-Range", checkpoint_validator(cp));
+	} else if(prev) {
+		if(prev->etag[0]) {
+			rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "If-None-Match", prev->etag);
+		}
+		if(prev->modified[0]) {
+			rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "If-Modified-Since", prev->modified);
+		}
+	}
 	rc = rc < 0 ? rc : HTTPConnectionBeginBody(conn);
 	rc = rc < 0 ? rc : HTTPConnectionEnd(conn);
 	if(rc < 0) goto cleanup;
-	*out = conn; conn = NULL;
 cleanup:
-	HTTPConnectionFree(&conn);
+	if(rc < 0) fetch_conn_release(fc, false);
 	return rc;
 }
-static int url_fetch_internal(char *const URL, strarg_t const client, struct response *const res) {
+// Sets retry when the fetch failed but can be resumed right away,
+// or when a stale checkpoint was thrown out.
+static int url_fetch_internal(char *const URL, strarg_t const client, uint64_t const algos, struct response *const res, bool *const retry) {
 	assert(res);
+	assert(retry);
 
-	HTTPConnectionRef conn = NULL;
+	struct fetch_conn fc[1] = {};
+	bool keep = false;
 	HTTPHeadersRef headers = NULL;
 	uint64_t length = 0;
+	uint64_t tried = 0; // Length at the last checkpoint attempt
 	hasher_t *hasher = NULL;
+	bool threaded = false;
+	struct fetch_pipe pipe[1] = {};
+	struct checkpoint *cp = NULL;
+	bool checkpointed = false;
+	struct response *prev = NULL;
+	bool conditional = false;
+	uint64_t start = 0;
 	char const *type = NULL;
 	int rc = 0;
 
-	rc = rc < 0 ? rc : send_get(URL, client, &conn);
-	rc = rc < 0 ? rc : HTTPConnectionReadResponseStatus(conn, &res->status);
-	rc = rc < 0 ? rc : HTTPHeadersCreateFromConnection(conn, &headers);
+	cp = calloc(1, sizeof(struct checkpoint));
+	if(!cp) rc = UV_ENOMEM;
 	if(rc < 0) goto cleanup;
+	// Checkpoints are just an optimization, so any problem
+	// with one means starting over.
+	checkpointed = hx_checkpoint_get(URL, cp) >= 0;
+	if(!checkpointed ||
+		!checkpoint_validator(cp) ||
+		hasher_checkpoint_verify(algos, cp->state, cp->len) < 0)
+	{
+		memset(cp, 0, sizeof(*cp));
+	}
+	// Resuming takes precedence, since the validators were just checked.
+	prev = calloc(1, sizeof(struct response));
+	if(!prev) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+	if(!cp->offset && hx_validators_get(res->url, prev) >= 0) {
+		conditional = validators_usable(prev, algos);
+	}
+
+	for(;;) {
+		rc = send_get(URL, client, cp, conditional ? prev : NULL, fc);
+		rc = rc < 0 ? rc : HTTPConnectionReadResponseStatus(fc->conn, &res->status);
+		if(rc >= 0 || !fc->reused) break;
+		// The server closed an idle connection, so try another one.
+		fetch_conn_release(fc, false);
+	}
+	rc = rc < 0 ? rc : HTTPHeadersCreateFromConnection(fc->conn, &headers);
+	if(rc < 0) goto cleanup;
+	bool const keepalive = fetch_conn_keepalive(headers);
 
 	if(res->status >= 300 && res->status < 400) {
 		char const *const loc = HTTPHeadersGet(headers, "Location");
 		if(loc) {
 			strlcpy(URL, loc, URI_MAX);
+			// Reading the rest of a short body is cheaper
+			// than a new connection.
+			keep = keepalive;
 			rc = HX_ERR_REDIRECT;
 			goto cleanup;
 		}
 	}
 
+	if(conditional && 304 == res->status) {
+		// Unchanged, so record the old digests without a body.
+		char const *const etag = HTTPHeadersGet(headers, "ETag");
+		char const *const modified = HTTPHeadersGet(headers, "Last-Modified");
+		alogf("Unchanged %s\n", URL);
+		res->status = 200;
+		strlcpy(res->type, prev->type, sizeof(res->type));
+		res->length = prev->length;
+		memcpy(res->digests, prev->digests, sizeof(res->digests));
+		strlcpy(res->etag, etag ? etag : prev->etag, sizeof(res->etag));
+		strlcpy(res->modified, modified ? modified : prev->modified, sizeof(res->modified));
+		keep = keepalive;
+		goto cleanup;
+	}
+
+	if(cp->offset && (206 == res->status || 416 == res->status)) {
+		rc = 206 == res->status ? checkpoint_resumes(cp, headers) : HX_ERR_TRUNCATED;
+		if(rc < 0) {
+			alogf("Discarding checkpoint for %s\n", URL);
+			(void)hx_checkpoint_del(URL);
+			keep = keepalive && 416 == res->status;
+			*retry = true;
+			goto cleanup;
+		}
+		alogf("Resuming %s at %llu\n", URL, (unsigned long long)cp->offset);
+		res->status = 200;
+	} else {
+		// Either a fresh fetch, or the server sent the whole thing anyway.
+		char const *const etag = HTTPHeadersGet(headers, "ETag");
+		char const *const modified = HTTPHeadersGet(headers, "Last-Modified");
+		memset(cp, 0, sizeof(*cp));
+		strlcpy(cp->etag, etag ? etag : "", sizeof(cp->etag));
+		strlcpy(cp->modified, modified ? modified : "", sizeof(cp->modified));
+	}
+	start = cp->offset;
+	length = cp->offset;
+	tried = cp->offset;
+	strlcpy(res->etag, cp->etag, sizeof(res->etag));
+	strlcpy(res->modified, cp->modified, sizeof(res->modified));
+
 	type = HTTPHeadersGet(headers, "Content-Type");
 	if(type) strlcpy(res->type, type, sizeof(res->type));
 
-	rc = hasher_create(HASHER_ALGOS_ALL, &hasher);
+	char const *const clen = HTTPHeadersGet(headers, "Content-Length");
+	if(clen && strtoull(clen, NULL, 10) >= CONFIG_HASHER_THREADED_MIN) {
+		rc = hasher_create_threaded(algos, &hasher);
+		threaded = true;
+	} else {
+		rc = hasher_create(algos, &hasher);
+	}
+	if(rc < 0) goto cleanup;
+	if(cp->offset) {
+		rc = hasher_restore(hasher, cp->state, cp->len);
+		if(rc < 0) goto cleanup;
+	}
+	rc = fetch_pipe_init(pipe, hasher);
 	if(rc < 0) goto cleanup;
 	for(;;) {
 		uv_buf_t buf[1];
-		rc = HTTPConnectionReadBody(conn, buf);
+		rc = HTTPConnectionReadBody(fc->conn, buf);
 		if(rc < 0) goto cleanup;
 		if(0 == buf->len) break;
-		async_pool_enter(NULL);
-		rc = hasher_update(hasher, (unsigned char *)buf->base, buf->len);
-		async_pool_leave(NULL);
+		rc = fetch_pipe_write(pipe, (unsigned char *)buf->base, buf->len);
 		if(rc < 0) goto cleanup;
 		length += buf->len;
+		if(!checkpoint_validator(cp)) continue;
+		if(length - tried < CONFIG_FETCH_CHECKPOINT_BYTES) continue;
+		tried = length;
+		rc = checkpoint_save(URL, pipe, hasher, length, cp);
+		if(rc < 0) goto cleanup;
+		checkpointed = checkpointed || cp->offset > start;
 	}
+	rc = fetch_pipe_finish(pipe);
+	if(rc < 0) goto cleanup;
 	res->length = length;
+	// Might have to wait for hasher threads.
+	uint64_t const hash_start = uv_hrtime();
+	async_pool_enter(NULL);
 	rc = hasher_digests(hasher, res->digests, numberof(res->digests));
+	async_pool_leave(NULL);
+	hash_time += uv_hrtime() - hash_start;
 	if(rc < 0) goto cleanup;
+	if(checkpointed) (void)hx_checkpoint_del(URL);
+	keep = keepalive;
 
 cleanup:
-	HTTPConnectionFree(&conn);
+	// Only retry if this attempt got somewhere, so a server that
+	// always drops the connection can't keep us busy.
+	if(rc < 0 && cp && cp->offset > start) *retry = true;
+	fetch_conn_release(fc, keep);
 	HTTPHeadersFree(&headers);
+	fetch_pipe_destroy(pipe);
+	if(threaded) {
+		// Joins the hasher threads, which may still be draining slots.
+		async_pool_enter(NULL);
+		hasher_free(&hasher);
+		async_pool_leave(NULL);
+	}
 	hasher_free(&hasher);
+	free(cp); cp = NULL;
+	free(prev); prev = NULL;
 	type = NULL;
 	if(rc < 0) {
 		res->status = rc;
@@ -107,7 +441,7 @@ cleanup:
 	}
 	return 0;
 }
-int url_fetch(strarg_t const URL, strarg_t const client, struct response *const out) {
+int url_fetch(strarg_t const URL, strarg_t const client, uint64_t const algos, struct response *const out) {
 	assert(out);
 	if(!URL) return UV_EINVAL;
 
@@ -116,6 +450,8 @@ int url_fetch(strarg_t const URL, strarg_t const client, struct response *const
 	strlcpy(out->url, URL, sizeof(out->url));
 	out->status = 0;
 	strlcpy(out->type, "", sizeof(out->type));
+	strlcpy(out->etag, "", sizeof(out->etag));
+	strlcpy(out->modified, "", sizeof(out->modified));
 	out->length = 0;
 	for(size_t i = 0; i < numberof(out->digests); i++) {
 		out->digests[i].len = 0;
@@ -123,10 +459,17 @@ int url_fetch(strarg_t const URL, strarg_t const client, struct response *const
 
 	char tmp[URI_MAX];
 	strlcpy(tmp, URL, URI_MAX);
-	for(size_t i = 0; i < REDIRECT_MAX; i++) {
-		int rc = url_fetch_internal(tmp, client, out);
+	size_t resumes = 0;
+	for(size_t i = 0; i < REDIRECT_MAX;) {
+		bool retry = false;
+		int rc = url_fetch_internal(tmp, client, algos, out, &retry);
 		if(rc < 0) return rc;
+		if(retry && resumes < CONFIG_FETCH_RESUME_MAX) {
+			resumes++;
+			continue;
+		}
 		if(HX_ERR_REDIRECT != out->status) return rc;
+		i++;
 	}
 	return 0;
 }
@@ -0,0 +1,193 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <async/async.h>
+#include "util/hash.h"
+#include "util/strext.h"
+#include "util/url.h"
+#include "db.h"
+#include "errors.h"
+#include "config.h"
+#include "queue.h"
+#include "wire.h"
+#include "lease.h"
+
+struct lease_conn {
+	uv_stream_t *stream;
+	struct wire_buf buf[1];
+	struct queue_lease jobs[CONFIG_LEASE_BATCH_MAX];
+	struct response res[1];
+	uint64_t held[CONFIG_LEASE_HELD_MAX]; // Failed if we disconnect
+	size_t held_count;
+};
+
+// Lease IDs are sequential, so a connection can only settle its own.
+static int lease_held_remove(struct lease_conn *const c, uint64_t const lease) {
+	for(size_t i = 0; i < c->held_count; i++) {
+		if(lease != c->held[i]) continue;
+		c->held[i] = c->held[--c->held_count];
+		return 0;
+	}
+	return KVS_NOTFOUND;
+}
+static int lease_reply(struct lease_conn *const c, int const rc) {
+	wire_write_uint64(c->buf, (uint64_t)-(int64_t)MIN(rc, 0));
+	return wire_flush(c->stream, c->buf);
+}
+
+static int lease_jobs(struct lease_conn *const c) {
+	uint16_t max;
+	uint64_t wait;
+	int rc = wire_read_uint16(c->stream, &max);
+	if(rc < 0) return rc;
+	rc = wire_read_uint64(c->stream, &wait);
+	if(rc < 0) return rc;
+	max = MIN(max, CONFIG_LEASE_BATCH_MAX);
+	max = MIN(max, CONFIG_LEASE_HELD_MAX - c->held_count);
+	wait = MIN(wait, CONFIG_LEASE_WAIT_MAX);
+
+	// Only the first job is worth waiting for.
+	uint16_t count = 0;
+	for(; count < max; count++) {
+		rc = queue_lease(count ? 0 : wait, CONFIG_LEASE_TIMEOUT, &c->jobs[count]);
+		if(UV_ETIMEDOUT == rc) break;
+		if(rc < 0) return rc;
+		c->held[c->held_count++] = c->jobs[count].lease;
+	}
+
+	wire_write_uint16(c->buf, count);
+	for(size_t i = 0; i < count; i++) {
+		struct queue_lease const *const job = &c->jobs[i];
+		bool const prev = hx_validators_get(job->URL, c->res) >= 0;
+		wire_write_uint64(c->buf, job->lease);
+		wire_write_uint64(c->buf, CONFIG_LEASE_TIMEOUT);
+		wire_write_uint64(c->buf, job->algos);
+		wire_write_string(c->buf, job->URL);
+		wire_write_string(c->buf, job->client);
+		wire_write_uint8(c->buf, prev);
+		if(prev) {
+			wire_write_response(c->buf, c->res);
+			wire_write_string(c->buf, c->res->etag);
+			wire_write_string(c->buf, c->res->modified);
+		}
+		rc = wire_flush(c->stream, c->buf);
+		if(rc < 0) return rc;
+	}
+	return wire_flush(c->stream, c->buf);
+}
+static int lease_done(struct lease_conn *const c) {
+	uint64_t lease;
+	int rc = wire_read_uint64(c->stream, &lease);
+	if(rc < 0) return rc;
+	rc = wire_read_response(c->stream, c->res);
+	if(rc < 0) return rc;
+	rc = wire_read_string(c->stream, c->res->etag, sizeof(c->res->etag));
+	if(rc < 0) return rc;
+	rc = wire_read_string(c->stream, c->res->modified, sizeof(c->res->modified));
+	if(rc < 0) return rc;
+	rc = lease_held_remove(c, lease);
+	if(rc < 0) return lease_reply(c, rc);
+	return lease_reply(c, queue_lease_done(lease, c->res));
+}
+static int lease_fail(struct lease_conn *const c) {
+	uint64_t lease, err;
+	int rc = wire_read_uint64(c->stream, &lease);
+	if(rc < 0) return rc;
+	rc = wire_read_uint64(c->stream, &err);
+	if(rc < 0) return rc;
+	rc = lease_held_remove(c, lease);
+	if(rc < 0) return lease_reply(c, rc);
+	return lease_reply(c, queue_lease_fail(lease, -(int)err));
+}
+
+static void connection(uv_stream_t *const server, uv_stream_t *const stream) {
+	struct lease_conn *c = NULL;
+	int rc = uv_accept(server, stream);
+	if(rc < 0) goto cleanup;
+
+	c = calloc(1, sizeof(*c));
+	if(!c) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+	c->stream = stream;
+
+	for(;;) {
+		uint8_t type;
+		rc = wire_read_uint8(stream, &type);
+		if(rc < 0) goto cleanup;
+		switch(type) {
+		case 'L': rc = lease_jobs(c); break;
+		case 'D': rc = lease_done(c); break;
+		case 'F': rc = lease_fail(c); break;
+		default: rc = UV_EPROTO; break;
+		}
+		if(rc < 0) goto cleanup;
+	}
+
+cleanup:
+	// Someone else can have them.
+	for(size_t i = 0; c && i < c->held_count; i++) {
+		(void)queue_lease_fail(c->held[i], UV_ECONNRESET);
+	}
+	free(c); c = NULL;
+	async_close((uv_handle_t *)stream);
+	if(UV_EOF != rc) alogf("Worker connection ended: %s\n", hx_strerror(rc));
+}
+static void connection_pipe(void *arg) {
+	uv_pipe_t pipe[1];
+	int rc = uv_pipe_init(async_loop, pipe, false);
+	if(rc < 0) return;
+	connection(arg, (uv_stream_t *)pipe);
+}
+static void connection_tcp(void *arg) {
+	uv_tcp_t tcp[1];
+	int rc = uv_tcp_init(async_loop, tcp);
+	if(rc < 0) return;
+	connection(arg, (uv_stream_t *)tcp);
+}
+static void connection_pipe_cb(uv_stream_t *const server, int const status) {
+	async_spawn(STACK_DEFAULT, connection_pipe, server);
+}
+static void connection_tcp_cb(uv_stream_t *const server, int const status) {
+	async_spawn(STACK_DEFAULT, connection_tcp, server);
+}
+
+static void lease_expire_loop(void *ignored) {
+	for(;;) {
+		async_sleep(CONFIG_LEASE_SWEEP_DELAY);
+		queue_lease_expire();
+	}
+}
+
+int lease_init(void) {
+	static uv_pipe_t pipe[1];
+	static uv_tcp_t tcp[1];
+
+	int rc = uv_pipe_init(async_loop, pipe, false);
+	if(rc < 0) goto cleanup;
+	async_fs_unlink(CONFIG_LEASE_SOCKET_PATH);
+	rc = uv_pipe_bind(pipe, CONFIG_LEASE_SOCKET_PATH);
+	if(rc < 0) goto cleanup;
+	rc = uv_listen((uv_stream_t *)pipe, 511, connection_pipe_cb);
+	if(rc < 0) goto cleanup;
+
+	if(CONFIG_LEASE_TCP_PORT) {
+		struct sockaddr_in addr[1];
+		rc = uv_ip4_addr(CONFIG_LEASE_TCP_ADDR, CONFIG_LEASE_TCP_PORT, addr);
+		if(rc < 0) goto cleanup;
+		rc = uv_tcp_init(async_loop, tcp);
+		if(rc < 0) goto cleanup;
+		rc = uv_tcp_bind(tcp, (struct sockaddr const *)addr, 0);
+		if(rc < 0) goto cleanup;
+		rc = uv_listen((uv_stream_t *)tcp, 511, connection_tcp_cb);
+		if(rc < 0) goto cleanup;
+	}
+
+	rc = async_spawn(STACK_DEFAULT, lease_expire_loop, NULL);
+	if(rc < 0) goto cleanup;
+cleanup:
+	return rc;
+}
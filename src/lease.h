@@ -0,0 +1,17 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Lets hash-archive-worker processes lease queued URLs over a local
+// socket or TCP, and send back what they fetched. The server still
+// does all of the database writes.
+//
+// Each request gets one reply. Integers are big-endian, strings have
+// a 16-bit length, and errors are sent negated as a u64.
+//   'L' max:u16 wait:u64 -> count:u16, then for each job:
+//       lease:u64 timeout:u64 algos:u64 URL client
+//       has_prev:u8 [response etag modified]
+//   'D' lease:u64 response etag modified -> -rc:u64
+//   'F' lease:u64 -err:u64 -> -rc:u64
+// Responses use the import record format. A previous response is
+// included when it has validators, so workers can revalidate.
+int lease_init(void);
@@ -0,0 +1,133 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Backfills index summaries (see CONFIG_DB_COVERING_INDEXES) and
+// recrawl times for responses written before they existed. Safe to
+// run more than once, but the server has to be stopped first.
+// Usage: hash-archive-migrate [database-path]
+
+#include <stdlib.h>
+#include <string.h>
+#include "util/hash.h"
+#include "util/strext.h"
+#include "util/url.h"
+#include "db.h"
+#include "config.h"
+
+#define MIGRATE_BATCH 1000 // Responses per transaction
+
+struct item {
+	struct response res[1];
+	char surt[URI_MAX];
+};
+
+// Reads up to max responses after (time, id), since writing while
+// the cursor is open isn't safe.
+static ssize_t migrate_read(KVS_env *const db, uint64_t const time, uint64_t const id, bool const first, struct item *const out, size_t const max) {
+	KVS_txn *txn = NULL;
+	KVS_cursor *cursor = NULL;
+	size_t i = 0;
+	int rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) goto cleanup;
+
+	KVS_range range[1];
+	KVS_val key[1], val[1];
+	HXTimeIDToResponseRange0(range);
+	if(first) {
+		rc = kvs_cursor_firstr(cursor, range, key, val, +1);
+	} else {
+		HXTimeIDToResponseKeyPack(key, time, id);
+		rc = kvs_cursor_seekr(cursor, range, key, val, +1);
+		if(rc >= 0) rc = kvs_cursor_nextr(cursor, range, key, val, +1);
+	}
+	for(; rc >= 0 && i < max; rc = kvs_cursor_nextr(cursor, range, key, val, +1)) {
+		struct item *const item = &out[i];
+		HXTimeIDToResponseKeyUnpack(key, &item->res->time, &item->res->id);
+		HXTimeIDToResponseValUnpack(val, txn, item->res);
+		rc = url_normalize_surt(item->res->url, item->surt, sizeof(item->surt));
+		if(rc < 0) goto cleanup;
+		i++;
+	}
+	if(KVS_NOTFOUND == rc) rc = 0;
+cleanup:
+	cursor = NULL;
+	kvs_txn_abort(txn); txn = NULL;
+	if(rc < 0) return rc;
+	return i;
+}
+static int migrate_write(KVS_env *const db, struct item const *const items, size_t const count) {
+	KVS_txn *txn = NULL;
+	int rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+	for(size_t i = 0; i < count; i++) {
+		struct response const *const res = items[i].res;
+
+		KVS_val url_key[1], url_val[1];
+		HXURLSurtAndTimeIDKeyPack(url_key, txn, items[i].surt, res->time, res->id);
+		HXIndexSummaryValPack(url_val, res, -1);
+		rc = kvs_put(txn, url_key, url_val, 0);
+		if(rc < 0) goto cleanup;
+
+		for(size_t j = 0; j < numberof(res->digests); j++) {
+			if(res->digests[j].len < HX_HASH_INDEX_LEN) continue;
+			KVS_val hash_key[1], hash_val[1];
+			HXAlgoHashAndTimeIDKeyPack(hash_key, j, res->digests[j].buf, res->time, res->id);
+			HXIndexSummaryValPack(hash_val, res, (int)j);
+			rc = kvs_put(txn, hash_key, hash_val, 0);
+			if(rc < 0) goto cleanup;
+		}
+
+		// Responses are in time order, so the latest one wins.
+		rc = hx_recrawl_set(txn, res->url, res->time + CONFIG_RECRAWL_MIN_SECONDS);
+		if(rc < 0) goto cleanup;
+	}
+	rc = kvs_txn_commit(txn); txn = NULL;
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	return rc;
+}
+
+int main(int const argc, char const *const *const argv) {
+	char const *const path = argc > 1 ? argv[1] : CONFIG_DB_PATH;
+	if(argc > 2) {
+		fprintf(stderr, "Usage: %s [database-path]\n", argv[0]);
+		return 1;
+	}
+	size_t mapsize = 1024ull*1024*1024*64; // 64GB
+	KVS_env *db = NULL;
+	struct item *items = calloc(MIGRATE_BATCH, sizeof(struct item));
+	uint64_t time = 0, id = 0, total = 0;
+	int rc = 0;
+	if(!items) rc = KVS_ENOMEM;
+	if(rc < 0) goto cleanup;
+	rc = kvs_env_create_base("leveldb", &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_env_set_config(db, KVS_CFG_MAPSIZE, &mapsize);
+	if(rc < 0) goto cleanup;
+	rc = kvs_env_open(db, path, 0, 0600);
+	if(rc < 0) goto cleanup;
+
+	for(;;) {
+		ssize_t const count = migrate_read(db, time, id, 0 == total, items, MIGRATE_BATCH);
+		if(count < 0) rc = count;
+		if(rc < 0) goto cleanup;
+		if(!count) break;
+		rc = migrate_write(db, items, count);
+		if(rc < 0) goto cleanup;
+		time = items[count-1].res->time;
+		id = items[count-1].res->id;
+		total += count;
+		fprintf(stderr, "Migrated %llu responses\n", (unsigned long long)total);
+	}
+
+cleanup:
+	kvs_env_close(db); db = NULL;
+	free(items); items = NULL;
+	if(rc < 0) {
+		fprintf(stderr, "Migration error: %s\n", kvs_strerror(rc));
+		return 1;
+	}
+	return 0;
+}
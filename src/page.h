@@ -20,6 +20,7 @@ int page_sources(HTTPConnectionRef const conn, strarg_t const URI);
 int page_critical(HTTPConnectionRef const conn);
 
 int api_enqueue(HTTPConnectionRef const conn, strarg_t const URL);
+int api_enqueue_bulk(HTTPConnectionRef const conn);
 int api_history(HTTPConnectionRef const conn, strarg_t const URL);
 int api_sources(HTTPConnectionRef const conn, strarg_t const hash);
 int api_dump(HTTPConnectionRef const conn, uint64_t const start, uint64_t const duration);
@@ -24,6 +24,9 @@ size_t const algos[] = {
 	HASH_ALGO_SHA256,
 	HASH_ALGO_SHA384,
 	HASH_ALGO_SHA512,
+	HASH_ALGO_BLAKE3,
+	HASH_ALGO_BLAKE2B,
+	HASH_ALGO_BLAKE2S,
 	HASH_ALGO_SHA1,
 	HASH_ALGO_MD5,
 };
@@ -36,6 +39,12 @@ bool const deprecated[HASH_ALGO_MAX] = {
 
 
 
+static bool is_critical(strarg_t const URL) {
+	for(size_t i = 0; i < numberof(critical); i++) {
+		if(0 == strcmp(critical[i], URL)) return true;
+	}
+	return false;
+}
 static char *item_html_obj(hash_uri_t const *const obj) {
 	char uri[URI_MAX];
 	int rc = hash_uri_format(obj, uri, sizeof(uri));
@@ -134,7 +143,7 @@ int page_history(HTTPConnectionRef const conn, strarg_t const URL) {
 	google_url = aasprintf("https://webcache.googleusercontent.com/search?q=cache:%s", escaped);
 	virustotal_url = aasprintf("https://www.virustotal.com/en/url/%s", escaped);
 
-	ssize_t const count = hx_get_history(URL, responses, CONFIG_HISTORY_MAX);
+	ssize_t const count = hx_get_history_unique(URL, responses, CONFIG_HISTORY_MAX);
 	if(count < 0) rc = count;
 	if(rc < 0) goto cleanup;
 
@@ -153,11 +162,15 @@ int page_history(HTTPConnectionRef const conn, strarg_t const URL) {
 	TemplateWriteHTTPChunk(header, TemplateStaticVar, &args, conn);
 
 	// Note: This check is just an optimization.
-	// queue_add() does its own crawl delay checks.
+	// queue_add_async() does its own crawl delay checks.
 	uint64_t const now = time(NULL);
 	if(count < 1 || responses[0].time+CONFIG_CRAWL_DELAY_SECONDS < now) {
 		TemplateWriteHTTPChunk(outdated, TemplateStaticVar, &args, conn);
-		rc = queue_add(now, URL, ""); // TODO: Get client
+		// New URLs get every algorithm, recrawls just the common ones.
+		hx_policy const policy = count < 1 || is_critical(URL) ?
+			HX_POLICY_FULL : HX_POLICY_BULK;
+		// Page views shouldn't wait on the write lock.
+		rc = queue_add_async(now, URL, "", policy, HX_CLASS_INTERACTIVE); // TODO: Get client
 		if(rc < 0 && KVS_KEYEXIST != rc) {
 			alogf("queue error: %s\n", hx_strerror(rc));
 		}
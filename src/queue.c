@@ -3,8 +3,10 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <async/async.h>
 #include <async/http/HTTP.h>
 #include "util/hash.h"
@@ -17,37 +19,398 @@
 #include "queue.h"
 
 // fetch.c
-int url_fetch(strarg_t const URL, strarg_t const client, struct response *const out);
+int url_fetch(strarg_t const URL, strarg_t const client, uint64_t const algos, struct response *const out);
+uint64_t fetch_hash_time(void);
 
 
-static uint64_t current_id = 0;
-static async_mutex_t id_lock[1];
+static struct hx_ids ids[1] = {};
 
-static uint64_t work_time = 0;
-static uint64_t work_id = 0;
 static async_mutex_t work_lock[1];
 static async_cond_t work_cond[1];
 
+// The worker pool grows while there's ready work and nobody to take
+// it, and shrinks when workers sit idle or hashing eats every CPU.
+// Extra workers exit the next time they ask for work.
+static size_t workers = 0; // Protected by work_lock
+static size_t workers_target = 0;
+static size_t workers_idle = 0;
+static uint64_t fetch_time = 0; // ns spent in url_fetch(), total
+
+// Callers of queue_timedwait(), keyed by SURT, so a finished fetch
+// only wakes the callers waiting for that URL.
+#define WAITER_BUCKETS 256
+struct queue_waiter {
+	struct queue_waiter *next;
+	strarg_t surt;
+	struct response *out;
+	bool done;
+	async_cond_t cond[1];
+};
 static async_mutex_t wait_lock[1];
-static async_cond_t wait_cond[1];
+static struct queue_waiter *waiters[WAITER_BUCKETS] = {};
+
+// What the last trip to the database said about a SURT, so repeated
+// enqueues of popular URLs can be answered without one. Direct-mapped,
+// so a collision just evicts the older entry.
+struct queue_recent {
+	char *surt;
+	uint64_t crawled; // Latest known crawl time, or 0
+	bool queued;
+	uint64_t qid; // If queued
+	hx_policy policy;
+	hx_class class;
+	uint64_t finished; // Last queue ID we saw finish
+};
+static async_mutex_t recent_lock[1];
+static struct queue_recent recent[CONFIG_QUEUE_RECENT_MAX] = {};
+
+// Enqueues that queue_add_async() handed off and that haven't been
+// written yet, so repeated page views don't write them again.
+struct queue_deferred {
+	struct queue_deferred *next;
+	uint64_t time;
+	hx_policy policy;
+	hx_class class;
+	bool upgraded; // Since the write started
+	char surt[URI_MAX];
+	char URL[URI_MAX];
+	char client[255+1];
+};
+static async_mutex_t deferred_lock[1];
+static struct queue_deferred *deferred = NULL;
+static size_t deferred_count = 0;
+
+static size_t surt_hash(strarg_t const surt) {
+	size_t x = 5381;
+	for(char const *p = surt; *p; p++) x = x*33 ^ (unsigned char)*p;
+	return x;
+}
+
+static uint64_t policy_algos(hx_policy const policy) {
+	switch(policy) {
+	case HX_POLICY_BULK: return 0 |
+		1ull << HASH_ALGO_SHA256 |
+		1ull << HASH_ALGO_MD5 |
+		1ull << HASH_ALGO_SHA1;
+	default: return HASHER_ALGOS_ALL;
+	}
+}
+// Doubles with each consecutive failure.
+static uint64_t failure_backoff(uint64_t const failures, uint64_t const base, uint64_t const max) {
+	if(!failures) return 0;
+	if(failures > 32) return max;
+	return MIN(base << (failures-1), max);
+}
+static strarg_t policy_name(hx_policy const policy) {
+	switch(policy) {
+	case HX_POLICY_FULL: return "full";
+	case HX_POLICY_BULK: return "bulk";
+	default: return "unknown";
+	}
+}
+
+static int frontier_load(void);
+struct frontier_job;
+static int queue_give_up(struct frontier_job *const job, int const err);
 
 // TODO: Define static async_x_t initializers
-void queue_init(void) {
-	async_mutex_init(id_lock, 0);
+int queue_init(void) {
 	async_mutex_init(work_lock, 0);
 	async_cond_init(work_cond, 0);
 	async_mutex_init(wait_lock, 0);
-	async_cond_init(wait_cond, 0);
+	async_mutex_init(recent_lock, 0);
+	async_mutex_init(deferred_lock, 0);
+	return frontier_load();
 }
 
 
-void queue_log(size_t const n) {
+// The frontier mirrors the whole queue in memory, grouped by host, so
+// workers never touch the database to find work. The queue tables on
+// disk are still the source of truth, and the frontier is rebuilt from
+// them at startup. Each job is leased to one worker until it's released,
+// and failed jobs go back in line a few times before being dropped.
+// Nothing here yields while holding work_lock.
+
+struct frontier_host;
+struct frontier_job {
+	struct frontier_job *next;
+	struct frontier_host *host;
+	uint64_t time;
+	uint64_t id;
+	hx_policy policy;
+	hx_class class;
+	unsigned attempts;
+	char *URL;
+	char *client;
+	char strings[]; // URL and client
+};
+typedef enum {
+	FRONTIER_IDLE = 0, // Empty, or at the active limit
+	FRONTIER_READY = 1, // In the ready list for its best class
+	FRONTIER_DELAYED = 2, // In the delay heap
+} frontier_state;
+struct frontier_host {
+	struct frontier_host *hnext; // Hash bucket
+	struct frontier_host *rnext; // Ready list
+	struct frontier_host *rprev;
+	frontier_state state;
+	hx_class rclass; // Which ready list
+	size_t heap_pos;
+	struct frontier_job *head[HX_CLASS_MAX];
+	struct frontier_job *tail[HX_CLASS_MAX];
+	size_t active;
+	uint64_t ready; // uv_now() when the next fetch may start
+	char name[URL_HOST_MAX]; // From the SURT, so no scheme
+};
+
+static struct frontier_host **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t host_count = 0;
+// Hosts take turns through the ready lists, which is what makes
+// dispatch round-robin. Classes share workers by weight.
+static struct frontier_host *ready_head[HX_CLASS_MAX] = {};
+static struct frontier_host *ready_tail[HX_CLASS_MAX] = {};
+static int ready_credit[HX_CLASS_MAX] = {};
+static int const class_weight[HX_CLASS_MAX] = {
+	[HX_CLASS_BULK] = CONFIG_QUEUE_WEIGHT_BULK,
+	[HX_CLASS_CRITICAL] = CONFIG_QUEUE_WEIGHT_CRITICAL,
+	[HX_CLASS_INTERACTIVE] = CONFIG_QUEUE_WEIGHT_INTERACTIVE,
+};
+static struct frontier_host **delayed = NULL; // Min-heap on ready
+static size_t delayed_count = 0;
+static size_t delayed_size = 0;
+static size_t pending_count = 0;
+static size_t ready_count = 0; // Hosts in ready lists
+
+static void frontier_host_name(strarg_t const URL, char *const out, size_t const max) {
+	char surt[URI_MAX];
+	url_t obj[1];
+	strlcpy(out, "", max);
+	// Unparseable URLs all share one host, and fail when fetched.
+	if(url_normalize_surt(URL, surt, sizeof(surt)) < 0) return;
+	if(url_parse(surt, obj) < 0) return;
+	strlcpy(out, obj->host, max);
+}
+static size_t frontier_hash(strarg_t const name) {
+	size_t x = 5381;
+	for(char const *p = name; *p; p++) x = x*33 ^ (unsigned char)*p;
+	return x;
+}
+static int frontier_buckets_grow(void) {
+	size_t const count = bucket_count ? bucket_count*2 : 256;
+	struct frontier_host **const x = calloc(count, sizeof(*x));
+	if(!x) return UV_ENOMEM;
+	for(size_t i = 0; i < bucket_count; i++) {
+		while(buckets[i]) {
+			struct frontier_host *const h = buckets[i];
+			buckets[i] = h->hnext;
+			size_t const b = frontier_hash(h->name) % count;
+			h->hnext = x[b];
+			x[b] = h;
+		}
+	}
+	free(buckets);
+	buckets = x;
+	bucket_count = count;
+	return 0;
+}
+static struct frontier_host *frontier_host_find(strarg_t const name) {
+	if(!bucket_count) return NULL;
+	struct frontier_host *h = buckets[frontier_hash(name) % bucket_count];
+	for(; h; h = h->hnext) {
+		if(0 == strcmp(h->name, name)) return h;
+	}
+	return NULL;
+}
+static struct frontier_host *frontier_host_create(strarg_t const name) {
+	if(host_count >= bucket_count) {
+		if(frontier_buckets_grow() < 0) return NULL;
+	}
+	struct frontier_host *const h = calloc(1, sizeof(struct frontier_host));
+	if(!h) return NULL;
+	strlcpy(h->name, name, sizeof(h->name));
+	size_t const b = frontier_hash(name) % bucket_count;
+	h->hnext = buckets[b];
+	buckets[b] = h;
+	host_count++;
+	return h;
+}
+// Returns the highest class with pending jobs, or -1.
+static int frontier_host_pending(struct frontier_host const *const h) {
+	for(int i = HX_CLASS_MAX-1; i >= 0; i--) {
+		if(h->head[i]) return i;
+	}
+	return -1;
+}
+static void frontier_host_free(struct frontier_host *const h) {
+	assert(FRONTIER_IDLE == h->state);
+	assert(frontier_host_pending(h) < 0);
+	assert(!h->active);
+	struct frontier_host **x = &buckets[frontier_hash(h->name) % bucket_count];
+	while(*x != h) x = &(*x)->hnext;
+	*x = h->hnext;
+	host_count--;
+	free(h);
+}
+
+static void delayed_swap(size_t const a, size_t const b) {
+	struct frontier_host *const x = delayed[a];
+	delayed[a] = delayed[b];
+	delayed[b] = x;
+	delayed[a]->heap_pos = a;
+	delayed[b]->heap_pos = b;
+}
+static int delayed_push(struct frontier_host *const h) {
+	if(delayed_count >= delayed_size) {
+		size_t const size = delayed_size ? delayed_size*2 : 64;
+		struct frontier_host **const x = realloc(delayed, size * sizeof(*x));
+		if(!x) return UV_ENOMEM;
+		delayed = x;
+		delayed_size = size;
+	}
+	size_t i = delayed_count++;
+	delayed[i] = h;
+	h->heap_pos = i;
+	while(i > 0 && delayed[(i-1)/2]->ready > delayed[i]->ready) {
+		delayed_swap(i, (i-1)/2);
+		i = (i-1)/2;
+	}
+	return 0;
+}
+static void delayed_sift_down(size_t i) {
+	for(;;) {
+		size_t const l = i*2+1, r = i*2+2;
+		size_t min = i;
+		if(l < delayed_count && delayed[l]->ready < delayed[min]->ready) min = l;
+		if(r < delayed_count && delayed[r]->ready < delayed[min]->ready) min = r;
+		if(min == i) break;
+		delayed_swap(i, min);
+		i = min;
+	}
+}
+static struct frontier_host *delayed_pop(void) {
+	assert(delayed_count);
+	struct frontier_host *const h = delayed[0];
+	delayed_swap(0, --delayed_count);
+	delayed_sift_down(0);
+	return h;
+}
+
+static void ready_push(struct frontier_host *const h, hx_class const class) {
+	h->rclass = class;
+	h->rnext = NULL;
+	h->rprev = ready_tail[class];
+	if(ready_tail[class]) ready_tail[class]->rnext = h;
+	else ready_head[class] = h;
+	ready_tail[class] = h;
+	h->state = FRONTIER_READY;
+	ready_count++;
+}
+static void ready_remove(struct frontier_host *const h) {
+	assert(FRONTIER_READY == h->state);
+	if(h->rprev) h->rprev->rnext = h->rnext;
+	else ready_head[h->rclass] = h->rnext;
+	if(h->rnext) h->rnext->rprev = h->rprev;
+	else ready_tail[h->rclass] = h->rprev;
+	h->rnext = NULL;
+	h->rprev = NULL;
+	h->state = FRONTIER_IDLE;
+	ready_count--;
+}
+// Smooth weighted round-robin over the classes with ready hosts.
+// With the default weights, an interactive job never waits behind
+// more than one bulk dispatch.
+static int ready_pick(void) {
+	int total = 0;
+	int best = -1;
+	for(int i = 0; i < HX_CLASS_MAX; i++) {
+		if(!ready_head[i]) {
+			ready_credit[i] = 0;
+			continue;
+		}
+		ready_credit[i] += class_weight[i];
+		total += class_weight[i];
+		if(best < 0 || ready_credit[i] > ready_credit[best]) best = i;
+	}
+	if(best >= 0) ready_credit[best] -= total;
+	return best;
+}
+
+// Puts an idle host wherever it belongs now. A host stays in the heap
+// until its delay is up even when it has nothing to do, so that
+// new work for it still has to wait.
+static void frontier_schedule(struct frontier_host *const h, uint64_t const now) {
+	if(FRONTIER_IDLE != h->state) return;
+	if(h->ready > now) {
+		// If the heap can't grow, the host waits for its next release.
+		if(delayed_push(h) >= 0) h->state = FRONTIER_DELAYED;
+		return;
+	}
+	int const class = frontier_host_pending(h);
+	if(class >= 0 && h->active < CONFIG_CRAWL_HOST_ACTIVE_MAX) {
+		ready_push(h, class);
+		return;
+	}
+	if(class < 0 && !h->active) frontier_host_free(h);
+}
+// Keeps a failing host out of the ready lists until the given time.
+// The host stays in the heap until then even if it runs out of work,
+// so the failure count only has to be kept on disk.
+// Delays only ever grow here, so a host in the heap just sinks.
+static void frontier_host_backoff(struct frontier_host *const h, uint64_t const until, uint64_t const now) {
+	if(until > h->ready) {
+		h->ready = until;
+		if(FRONTIER_DELAYED == h->state) delayed_sift_down(h->heap_pos);
+		if(FRONTIER_READY == h->state) ready_remove(h);
+	}
+	frontier_schedule(h, now);
+}
+static void frontier_append(struct frontier_host *const h, struct frontier_job *const job) {
+	hx_class const class = job->class;
+	job->host = h;
+	job->next = NULL;
+	if(h->tail[class]) h->tail[class]->next = job;
+	else h->head[class] = job;
+	h->tail[class] = job;
+	pending_count++;
+	// A ready host moves up when it gets more urgent work.
+	if(FRONTIER_READY == h->state && class > h->rclass) {
+		ready_remove(h);
+		ready_push(h, class);
+	}
+}
+// Doesn't lock or signal, so it can be used while loading.
+static int frontier_insert(uint64_t const time, uint64_t const id, strarg_t const URL, strarg_t const client, hx_policy const policy, hx_class const class) {
+	size_t const ulen = strlen(URL);
+	size_t const clen = strlen(client);
+	char name[URL_HOST_MAX];
+	frontier_host_name(URL, name, sizeof(name));
+	struct frontier_host *h = frontier_host_find(name);
+	if(!h) h = frontier_host_create(name);
+	if(!h) return UV_ENOMEM;
+	struct frontier_job *const job = calloc(1, sizeof(struct frontier_job) + ulen+1 + clen+1);
+	if(!job) {
+		frontier_schedule(h, uv_now(async_loop)); // Might free it
+		return UV_ENOMEM;
+	}
+	job->time = time;
+	job->id = id;
+	job->policy = policy;
+	job->class = class;
+	job->URL = job->strings;
+	job->client = job->strings+ulen+1;
+	memcpy(job->URL, URL, ulen+1);
+	memcpy(job->client, client, clen+1);
+	frontier_append(h, job);
+	frontier_schedule(h, uv_now(async_loop));
+	return 0;
+}
+static int frontier_load(void) {
 	KVS_env *db = NULL;
 	KVS_txn *txn = NULL;
 	KVS_cursor *cursor = NULL;
 	KVS_range range[1];
 	KVS_val key[1];
-	strarg_t URL, client;
 	int rc = 0;
 
 	rc = hx_db_open(&db);
@@ -56,52 +419,170 @@ void queue_log(size_t const n) {
 	if(rc < 0) goto cleanup;
 	rc = kvs_txn_cursor(txn, &cursor);
 	if(rc < 0) goto cleanup;
+	for(hx_class class = 0; class < HX_CLASS_MAX; class++) {
+		HXTimeIDQueuedURLAndClientRange0(range, class);
+		rc = kvs_cursor_firstr(cursor, range, key, NULL, +1);
+		for(; rc >= 0; rc = kvs_cursor_nextr(cursor, range, key, NULL, +1)) {
+			uint64_t time, id;
+			strarg_t URL, client;
+			hx_policy policy;
+			HXTimeIDQueuedURLAndClientKeyUnpack(key, txn, &time, &id, &URL, &client, &policy);
+			rc = frontier_insert(time, id, URL ? URL : "", client ? client : "", policy, class);
+			if(rc < 0) goto cleanup;
+		}
+		if(KVS_NOTFOUND != rc) goto cleanup;
+	}
 
-	HXTimeIDQueuedURLAndClientRange0(range);
-	rc = kvs_cursor_firstr(cursor, range, key, NULL, +1);
-	size_t i = 0;
-	for(; i < n; i++) {
-		if(KVS_NOTFOUND == rc) break;
+	// Hosts still backing off from before the restart.
+	uint64_t const now = uv_now(async_loop);
+	uint64_t const wall = (uint64_t)time(NULL)*1000;
+	HXHostToFailuresRange0(range);
+	KVS_val val[1];
+	rc = kvs_cursor_firstr(cursor, range, key, val, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, range, key, val, +1)) {
+		strarg_t name;
+		uint64_t failures, last;
+		HXHostToFailuresKeyUnpack(key, txn, &name);
+		HXHostToFailuresValUnpack(val, &failures, &last);
+		uint64_t const end = last*1000 + failure_backoff(failures, CONFIG_CRAWL_HOST_BACKOFF, CONFIG_CRAWL_HOST_BACKOFF_MAX);
+		if(end <= wall) continue;
+		struct frontier_host *h = frontier_host_find(name ? name : "");
+		if(!h) h = frontier_host_create(name ? name : "");
+		if(!h) rc = UV_ENOMEM;
 		if(rc < 0) goto cleanup;
-
-		uint64_t time = 0;
-		uint64_t id = 0;
-		strarg_t URL = NULL;
-		strarg_t client = NULL;
-		HXTimeIDQueuedURLAndClientKeyUnpack(key, txn, &time, &id, &URL, &client);
-		alogf("Queue %zu (%llu): '%s' for '%s'", i+1, (unsigned long long)time, URL, client);
-
-		rc = kvs_cursor_nextr(cursor, range, key, NULL, +1);
+		frontier_host_backoff(h, now + (end - wall), now);
 	}
-
-	size_t count = 0;
-	rc = kvs_countr(txn, range, &count);
-	alogf("Logged %zu of %zu queued URLs", i, count);
-
+	if(KVS_NOTFOUND != rc) goto cleanup;
+	rc = 0;
 cleanup:
 	cursor = NULL;
 	kvs_txn_abort(txn); txn = NULL;
 	hx_db_close(&db);
-	if(rc) {
-		alogf("Queue log error %s", kvs_strerror(rc));
-	}
+	return rc;
 }
+static int frontier_push(uint64_t const time, uint64_t const id, strarg_t const URL, strarg_t const client, hx_policy const policy, hx_class const class) {
+	async_mutex_lock(work_lock);
+	int rc = frontier_insert(time, id, URL, client, policy, class);
+	if(rc >= 0) async_cond_broadcast(work_cond);
+	async_mutex_unlock(work_lock);
+	return rc;
+}
+// Local workers get UV_ECANCELED if the pool has shrunk and they should
+// exit. Remote leases give up with UV_ETIMEDOUT at the deadline.
+static int frontier_lease(struct frontier_job **const out, bool const local, uint64_t const deadline) {
+	int rc = 0;
+	async_mutex_lock(work_lock);
+	for(;;) {
+		if(local && workers > workers_target) {
+			workers--;
+			rc = UV_ECANCELED;
+			break;
+		}
+		uint64_t const now = uv_now(async_loop);
+		while(delayed_count && delayed[0]->ready <= now) {
+			struct frontier_host *const h = delayed_pop();
+			h->state = FRONTIER_IDLE;
+			frontier_schedule(h, now);
+		}
+		int const class = ready_pick();
+		if(class >= 0) {
+			struct frontier_host *const h = ready_head[class];
+			ready_remove(h);
 
+			struct frontier_job *const job = h->head[class];
+			h->head[class] = job->next;
+			if(!h->head[class]) h->tail[class] = NULL;
+			job->next = NULL;
+			pending_count--;
+			h->active++;
+			h->ready = now + CONFIG_CRAWL_HOST_DELAY;
+			frontier_schedule(h, now);
+			*out = job;
+			break;
+		}
+		if(deadline && deadline <= now) {
+			rc = UV_ETIMEDOUT;
+			break;
+		}
+		uint64_t wake = delayed_count ? delayed[0]->ready : 0;
+		if(deadline && (!wake || deadline < wake)) wake = deadline;
+		if(local) workers_idle++;
+		rc = wake ?
+			async_cond_timedwait(work_cond, work_lock, wake) :
+			async_cond_wait(work_cond, work_lock);
+		if(local) workers_idle--;
+		if(UV_ETIMEDOUT == rc) rc = 0;
+		if(rc < 0) break;
+	}
+	async_mutex_unlock(work_lock);
+	return rc;
+}
+// Ends the lease. Failed jobs go to the back of their host's line,
+// and once they're out of retries the failure is recorded instead.
+static void frontier_release(struct frontier_job *const job, int result) {
+	struct frontier_host *const h = job->host;
+	// Still holding the lease, so the host can't go away.
+	if(result < 0 && job->attempts+1 >= CONFIG_QUEUE_RETRY_MAX) {
+		result = queue_give_up(job, result);
+	}
+	async_mutex_lock(work_lock);
+	assert(h->active > 0);
+	h->active--;
+	if(result < 0 && ++job->attempts < CONFIG_QUEUE_RETRY_MAX) {
+		frontier_append(h, job);
+	} else {
+		if(result < 0) alogf("Giving up on %s until restart: %s\n", job->URL, hx_strerror(result));
+		free(job);
+	}
+	frontier_schedule(h, uv_now(async_loop));
+	async_cond_broadcast(work_cond);
+	async_mutex_unlock(work_lock);
+}
+// Keeps a pending job in sync after queue_upgrade().
+static void frontier_upgrade(strarg_t const URL, uint64_t const time, uint64_t const id, hx_policy const policy, hx_class const class) {
+	char name[URL_HOST_MAX];
+	frontier_host_name(URL, name, sizeof(name));
+	async_mutex_lock(work_lock);
+	struct frontier_host *const h = frontier_host_find(name);
+	for(int i = 0; h && i < HX_CLASS_MAX; i++) {
+		struct frontier_job *prev = NULL;
+		struct frontier_job *job = h->head[i];
+		for(; job; prev = job, job = job->next) {
+			if(job->time == time && job->id == id) break;
+		}
+		if(!job) continue;
+		job->policy = policy;
+		if(job->class != class) {
+			if(prev) prev->next = job->next;
+			else h->head[i] = job->next;
+			if(h->tail[i] == job) h->tail[i] = prev;
+			pending_count--;
+			job->class = class;
+			frontier_append(h, job);
+			async_cond_broadcast(work_cond);
+		}
+		break;
+	}
+	async_mutex_unlock(work_lock);
+}
 
-static int queue_peek(uint64_t *const outtime, uint64_t *const outid, char *const outURL, size_t const urlmax, char *const outclient, size_t const clientmax) {
-	assert(outtime);
-	assert(outid);
-	assert(outURL);
-	assert(urlmax > 0);
-	assert(outclient);
-	assert(clientmax > 0);
 
+static strarg_t class_name(hx_class const class) {
+	switch(class) {
+	case HX_CLASS_BULK: return "bulk";
+	case HX_CLASS_CRITICAL: return "critical";
+	case HX_CLASS_INTERACTIVE: return "interactive";
+	default: return "unknown";
+	}
+}
+void queue_log(size_t const n) {
 	KVS_env *db = NULL;
 	KVS_txn *txn = NULL;
 	KVS_cursor *cursor = NULL;
 	KVS_range range[1];
 	KVS_val key[1];
-	strarg_t URL, client;
+	size_t i = 0;
+	size_t total = 0;
 	int rc = 0;
 
 	rc = hx_db_open(&db);
@@ -110,202 +591,930 @@ static int queue_peek(uint64_t *const outtime, uint64_t *const outid, char *cons
 	if(rc < 0) goto cleanup;
 	rc = kvs_txn_cursor(txn, &cursor);
 	if(rc < 0) goto cleanup;
-	HXTimeIDQueuedURLAndClientRange0(range);
-	KVS_VAL_STORAGE(key, KVS_VARINT_MAX*3)
-	kvs_bind_uint64(key, HXTimeIDQueuedURLAndClient);
-	kvs_bind_uint64(key, work_time);
-	kvs_bind_uint64(key, work_id+1);
-	KVS_VAL_STORAGE_VERIFY(key);
-	rc = kvs_cursor_seekr(cursor, range, key, NULL, +1);
-	if(rc < 0) goto cleanup;
 
-	HXTimeIDQueuedURLAndClientKeyUnpack(key, txn, outtime, outid, &URL, &client);
-	strlcpy(outURL, URL ? URL : "", urlmax);
-	strlcpy(outclient, client ? client : "", clientmax);
-	work_time = *outtime;
-	work_id = *outid;
+	// Most urgent first, which is roughly dispatch order.
+	for(int class = HX_CLASS_MAX-1; class >= 0; class--) {
+		HXTimeIDQueuedURLAndClientRange0(range, class);
+		rc = kvs_cursor_firstr(cursor, range, key, NULL, +1);
+		for(; i < n; i++) {
+			if(KVS_NOTFOUND == rc) break;
+			if(rc < 0) goto cleanup;
+
+			uint64_t time = 0;
+			uint64_t id = 0;
+			strarg_t URL = NULL;
+			strarg_t client = NULL;
+			hx_policy policy = HX_POLICY_FULL;
+			HXTimeIDQueuedURLAndClientKeyUnpack(key, txn, &time, &id, &URL, &client, &policy);
+			alogf("Queue %zu (%llu): '%s' for '%s' (%s, %s)", i+1, (unsigned long long)time, URL, client, class_name(class), policy_name(policy));
+
+			rc = kvs_cursor_nextr(cursor, range, key, NULL, +1);
+		}
+
+		size_t count = 0;
+		rc = kvs_countr(txn, range, &count);
+		if(rc < 0) goto cleanup;
+		total += count;
+	}
+	alogf("Logged %zu of %zu queued URLs", i, total);
+
 cleanup:
 	cursor = NULL;
 	kvs_txn_abort(txn); txn = NULL;
 	hx_db_close(&db);
-	return rc;
+	if(rc) {
+		alogf("Queue log error %s", kvs_strerror(rc));
+	}
 }
-static int queue_remove(KVS_txn *const txn, uint64_t const time, uint64_t const id, strarg_t const URL, strarg_t const client) {
+
+
+// Looks up the forward key, because its policy and class might have
+// been upgraded since the entry was loaded.
+static int queue_remove(KVS_txn *const txn, uint64_t const time, uint64_t const id, strarg_t const URL) {
 	assert(time);
 	assert(id);
 	assert(URL);
-	assert(client);
+	KVS_cursor *cursor = NULL;
 	char surt[URI_MAX];
 	int rc = url_normalize_surt(URL, surt, sizeof(surt));
 	if(rc < 0) goto cleanup;
+	rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) goto cleanup;
+
+	KVS_val rev_key[1], rev_val[1];
+	hx_class class;
+	HXQueuedURLSurtAndTimeIDKeyPack(rev_key, txn, surt, time, id);
+	rc = kvs_get(txn, rev_key, rev_val);
+	if(rc < 0) goto cleanup;
+	HXQueuedURLSurtAndTimeIDValUnpack(rev_val, &class);
 
+	KVS_range fwd_range[1];
 	KVS_val fwd_key[1];
-	HXTimeIDQueuedURLAndClientKeyPack(fwd_key, txn, time, id, URL, client);
+	HXTimeIDQueuedURLAndClientRange2(fwd_range, class, time, id);
+	rc = kvs_cursor_firstr(cursor, fwd_range, fwd_key, NULL, +1);
+	if(rc < 0) goto cleanup;
 	rc = kvs_del(txn, fwd_key, 0);
 	if(rc < 0) goto cleanup;
 
-	KVS_val rev_key[1];
-	HXQueuedURLSurtAndTimeIDKeyPack(rev_key, txn, surt, time, id);
 	rc = kvs_del(txn, rev_key, 0);
 	if(rc < 0) goto cleanup;
 cleanup:
+	cursor = NULL;
 	return rc;
 }
+// If a URL is already queued with a cheaper policy or a lower class,
+// the stronger one wins. The entry keeps its time and ID, so it only
+// changes lines if its class changes.
+static int queue_upgrade(KVS_txn *const txn, KVS_cursor *const cursor, strarg_t const surt, uint64_t const time, uint64_t const id, hx_class const old_class, hx_policy *const policy, hx_class *const class) {
+	KVS_range range[1];
+	HXTimeIDQueuedURLAndClientRange2(range, old_class, time, id);
+	KVS_val key[1];
+	int rc = kvs_cursor_firstr(cursor, range, key, NULL, +1);
+	if(rc < 0) return rc;
+	uint64_t ltime, lid;
+	strarg_t URL, client;
+	hx_policy old_policy = HX_POLICY_FULL;
+	HXTimeIDQueuedURLAndClientKeyUnpack(key, txn, &ltime, &lid, &URL, &client, &old_policy);
+	if(HX_POLICY_FULL != *policy) *policy = old_policy;
+	if(*class < old_class) *class = old_class;
+	if(old_policy == *policy && old_class == *class) return 0;
 
+	// The strings may point into the cursor's page.
+	char URL_copy[URI_MAX], client_copy[255+1];
+	strlcpy(URL_copy, URL ? URL : "", sizeof(URL_copy));
+	strlcpy(client_copy, client ? client : "", sizeof(client_copy));
 
+	KVS_val old_key[1];
+	HXTimeIDQueuedURLAndClientKeyPack(old_key, txn, old_class, time, id, URL_copy, client_copy, old_policy);
+	rc = kvs_del(txn, old_key, 0);
+	if(rc < 0) return rc;
+	KVS_val new_key[1];
+	HXTimeIDQueuedURLAndClientKeyPack(new_key, txn, *class, time, id, URL_copy, client_copy, *policy);
+	rc = kvs_put(txn, new_key, NULL, 0);
+	if(rc < 0) return rc;
+	if(old_class != *class) {
+		KVS_val rev_key[1], rev_val[1];
+		HXQueuedURLSurtAndTimeIDKeyPack(rev_key, txn, surt, time, id);
+		HXQueuedURLSurtAndTimeIDValPack(rev_val, *class);
+		rc = kvs_put(txn, rev_key, rev_val, 0);
+		if(rc < 0) return rc;
+	}
+	return 0;
+}
 
-int queue_add(uint64_t const time, strarg_t const URL, strarg_t const client) {
-	assert(time);
-	assert(URL);
-	assert(client);
-	char surt[URI_MAX];
-	KVS_env *db = NULL;
-	KVS_txn *txn = NULL;
-	KVS_cursor *cursor = NULL;
-	int rc = 0;
 
-	rc = url_normalize_surt(URL, surt, sizeof(surt));
-	if(rc < 0) goto cleanup;
 
-	async_mutex_lock(id_lock);
-	uint64_t const id = ++current_id;
-	async_mutex_unlock(id_lock);
+static struct queue_recent *queue_recent_slot(strarg_t const surt) {
+	return &recent[surt_hash(surt) & (CONFIG_QUEUE_RECENT_MAX-1)];
+}
+// Returns 0 if the SURT is already queued at least as strongly,
+// KVS_KEYEXIST if it was crawled within interval, or KVS_NOTFOUND
+// if we have to ask the database.
+static int queue_recent_check(strarg_t const surt, uint64_t const time, uint64_t const interval, hx_policy const policy, hx_class const class) {
+	struct queue_recent const *const r = queue_recent_slot(surt);
+	int rc = KVS_NOTFOUND;
+	async_mutex_lock(recent_lock);
+	if(!r->surt || 0 != strcmp(r->surt, surt)) goto cleanup;
+	if(r->queued) {
+		bool const upgrade = class > r->class ||
+			(HX_POLICY_FULL == policy && HX_POLICY_FULL != r->policy);
+		if(!upgrade) rc = 0;
+		goto cleanup;
+	}
+	if(r->crawled && r->crawled+interval >= time) rc = KVS_KEYEXIST;
+cleanup:
+	async_mutex_unlock(recent_lock);
+	return rc;
+}
+// Caching is optional, so running out of memory isn't an error.
+// Must be called with recent_lock held.
+static struct queue_recent *queue_recent_get(strarg_t const surt) {
+	struct queue_recent *const r = queue_recent_slot(surt);
+	if(r->surt && 0 == strcmp(r->surt, surt)) return r;
+	char *const copy = strdup(surt);
+	if(!copy) return NULL;
+	free(r->surt);
+	*r = (struct queue_recent){ .surt = copy };
+	return r;
+}
+// Callers finish their writes in any order, so an entry that already
+// finished can't be marked queued again.
+static void queue_recent_queued(strarg_t const surt, uint64_t const qid, hx_policy const policy, hx_class const class, uint64_t const crawled) {
+	async_mutex_lock(recent_lock);
+	struct queue_recent *const r = queue_recent_get(surt);
+	if(r && crawled > r->crawled) r->crawled = crawled;
+	if(r && qid != r->finished) {
+		r->queued = true;
+		r->qid = qid;
+		r->policy = policy;
+		r->class = class;
+	}
+	async_mutex_unlock(recent_lock);
+}
+// The qid is the queue entry that was just crawled, or 0 if we only
+// learned the crawl time.
+static void queue_recent_crawled(strarg_t const surt, uint64_t const crawled, uint64_t const qid) {
+	async_mutex_lock(recent_lock);
+	struct queue_recent *const r = queue_recent_get(surt);
+	if(r && crawled > r->crawled) r->crawled = crawled;
+	if(r && qid) {
+		if(r->queued && qid == r->qid) r->queued = false;
+		r->finished = qid;
+	}
+	async_mutex_unlock(recent_lock);
+}
 
-	rc = hx_db_open(&db);
-	if(rc < 0) goto cleanup;
-	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
-	if(rc < 0) goto cleanup;
-	rc = kvs_txn_cursor(txn, &cursor);
-	if(rc < 0) goto cleanup;
+struct queue_add_args {
+	uint64_t time;
+	uint64_t id;
+	strarg_t URL;
+	strarg_t client;
+	hx_policy policy; // Updated if already queued
+	hx_class class;
+	uint64_t interval;
+	strarg_t surt;
+	bool queued; // Already queued as qtime/qid
+	uint64_t qtime;
+	uint64_t qid;
+	uint64_t crawled; // Latest crawl time, if it was checked
+};
+static int queue_insert(KVS_txn *const txn, KVS_cursor *const cursor, struct queue_add_args *const args) {
+	int rc = 0;
+	// Most new URLs have never been seen, so skip both checks.
+	if(!hx_filter_maybe(args->surt)) goto insert;
 
-	KVS_val chk_key[1];
+	KVS_val chk_key[1], chk_val[1];
 	KVS_range range_queued[1];
-	HXQueuedURLSurtAndTimeIDRange1(range_queued, txn, surt);
-	rc = kvs_cursor_firstr(cursor, range_queued, chk_key, NULL, -1);
-	if(rc >= 0) goto cleanup; // If it's already queued, return success.
+	HXQueuedURLSurtAndTimeIDRange1(range_queued, txn, args->surt);
+	rc = kvs_cursor_firstr(cursor, range_queued, chk_key, chk_val, -1);
+	if(rc >= 0) {
+		// If it's already queued, return success.
+		strarg_t x;
+		hx_class qclass;
+		HXQueuedURLSurtAndTimeIDKeyUnpack(chk_key, txn, &x, &args->qtime, &args->qid);
+		HXQueuedURLSurtAndTimeIDValUnpack(chk_val, &qclass);
+		args->queued = true;
+		rc = queue_upgrade(txn, cursor, args->surt, args->qtime, args->qid, qclass, &args->policy, &args->class);
+		goto cleanup;
+	}
 	if(KVS_NOTFOUND != rc) goto cleanup;
 
 	KVS_range range_crawled[1];
-	HXURLSurtAndTimeIDRange1(range_crawled, txn, surt);
+	HXURLSurtAndTimeIDRange1(range_crawled, txn, args->surt);
 	rc = kvs_cursor_firstr(cursor, range_crawled, chk_key, NULL, -1);
 	if(rc >= 0) {
 		strarg_t x;
 		uint64_t ltime, lid;
 		HXURLSurtAndTimeIDKeyUnpack(chk_key, txn, &x, &ltime, &lid);
-		assert(0 == strcmp(x, surt));
-		rc = ltime+CONFIG_CRAWL_DELAY_SECONDS < time ?
+		assert(0 == strcmp(x, args->surt));
+		args->crawled = ltime;
+		rc = ltime+args->interval < args->time ?
 			KVS_NOTFOUND : KVS_KEYEXIST;
 	}
 	if(KVS_NOTFOUND != rc) goto cleanup;
 
+	// The last crawl was the last failure, if there were any.
+	if(args->crawled) {
+		KVS_val fail_key[1], fail_val[1];
+		HXURLSurtToFailuresKeyPack(fail_key, txn, args->surt);
+		rc = kvs_get(txn, fail_key, fail_val);
+		if(rc >= 0) {
+			uint64_t failures;
+			HXURLSurtToFailuresValUnpack(fail_val, &failures);
+			uint64_t const delay = failure_backoff(failures, CONFIG_CRAWL_FAILURE_BACKOFF, CONFIG_CRAWL_FAILURE_BACKOFF_MAX);
+			rc = args->crawled+delay < args->time ?
+				KVS_NOTFOUND : KVS_KEYEXIST;
+		}
+		if(KVS_NOTFOUND != rc) goto cleanup;
+	}
+
+insert:;
 	KVS_val fwd_key[1];
-	HXTimeIDQueuedURLAndClientKeyPack(fwd_key, txn, time, id, URL, client);
+	HXTimeIDQueuedURLAndClientKeyPack(fwd_key, txn, args->class, args->time, args->id, args->URL, args->client, args->policy);
 	rc = kvs_put(txn, fwd_key, NULL, 0); // KVS_NOOVERWRITE_FAST
 	if(rc < 0) goto cleanup;
 
-	KVS_val rev_key[1];
-	HXQueuedURLSurtAndTimeIDKeyPack(rev_key, txn, surt, time, id);
-	rc = kvs_put(txn, rev_key, NULL, 0);
+	KVS_val rev_key[1], rev_val[1];
+	HXQueuedURLSurtAndTimeIDKeyPack(rev_key, txn, args->surt, args->time, args->id);
+	HXQueuedURLSurtAndTimeIDValPack(rev_val, args->class);
+	rc = kvs_put(txn, rev_key, rev_val, 0);
 	if(rc < 0) goto cleanup;
+	hx_filter_add(args->surt);
+cleanup:
+	return rc;
+}
+static int queue_add_txn(KVS_txn *const txn, void *const ctx) {
+	KVS_cursor *cursor = NULL;
+	int rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	rc = queue_insert(txn, cursor, ctx);
+	cursor = NULL;
+	return rc;
+}
+int queue_add(uint64_t const time, strarg_t const URL, strarg_t const client, hx_policy const policy, hx_class const class) {
+	return queue_add_interval(time, URL, client, policy, class, CONFIG_CRAWL_DELAY_SECONDS);
+}
+int queue_add_interval(uint64_t const time, strarg_t const URL, strarg_t const client, hx_policy const policy, hx_class const class, uint64_t const interval) {
+	assert(time);
+	assert(URL);
+	assert(client);
+	char surt[URI_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) return rc;
+	rc = queue_recent_check(surt, time, interval, policy, class);
+	if(KVS_NOTFOUND != rc) return rc;
 
-	rc = kvs_txn_commit(txn); txn = NULL;
-	if(rc < 0) goto cleanup;
-	hx_db_close(&db);
+	uint64_t id;
+	rc = hx_ids_next(ids, 1, &id);
+	if(rc < 0) return rc;
+
+	struct queue_add_args args[1] = {{
+		.time = time,
+		.id = id,
+		.URL = URL,
+		.client = client,
+		.policy = policy,
+		.class = class,
+		.interval = interval,
+		.surt = surt,
+	}};
+	rc = hx_db_write(queue_add_txn, args);
+	if(KVS_KEYEXIST == rc) queue_recent_crawled(surt, args->crawled, 0);
+	if(rc < 0) return rc;
+	if(args->queued) {
+		queue_recent_queued(surt, args->qid, args->policy, args->class, args->crawled);
+		frontier_upgrade(URL, args->qtime, args->qid, args->policy, args->class);
+		return 0;
+	}
+	queue_recent_queued(surt, id, policy, class, args->crawled);
 
 	alogf("Enqueued %s (%s)\n", URL, hx_strerror(rc));
-	async_cond_broadcast(work_cond);
+	// It's on disk, so it'll still be crawled after a restart.
+	if(frontier_push(time, id, URL, client, policy, class) < 0) {
+		alogf("Frontier full, skipping %s until restart\n", URL);
+	}
+	return 0;
+}
+
+// Writes again if the entry was upgraded while the last write was
+// in flight, so the stronger request isn't lost.
+static void queue_add_async_run(void *const arg) {
+	struct queue_deferred *const p = arg;
+	async_mutex_lock(deferred_lock);
+	for(;;) {
+		hx_policy const policy = p->policy;
+		hx_class const class = p->class;
+		p->upgraded = false;
+		async_mutex_unlock(deferred_lock);
+		int rc = queue_add(p->time, p->URL, p->client, policy, class);
+		if(rc < 0 && KVS_KEYEXIST != rc) {
+			alogf("Queue error for %s: %s\n", p->URL, hx_strerror(rc));
+		}
+		async_mutex_lock(deferred_lock);
+		if(!p->upgraded) break;
+	}
+	for(struct queue_deferred **x = &deferred; *x; x = &(*x)->next) {
+		if(p != *x) continue;
+		*x = p->next;
+		deferred_count--;
+		break;
+	}
+	async_mutex_unlock(deferred_lock);
+	free(p);
+}
+int queue_add_async(uint64_t const time, strarg_t const URL, strarg_t const client, hx_policy const policy, hx_class const class) {
+	assert(time);
+	assert(URL);
+	assert(client);
+	char surt[URI_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) return rc;
+	rc = queue_recent_check(surt, time, CONFIG_CRAWL_DELAY_SECONDS, policy, class);
+	if(KVS_NOTFOUND != rc) return rc;
+
+	struct queue_deferred *p = NULL;
+	async_mutex_lock(deferred_lock);
+	for(p = deferred; p; p = p->next) {
+		if(0 == strcmp(p->surt, surt)) break;
+	}
+	if(p) {
+		if(HX_POLICY_FULL == policy && HX_POLICY_FULL != p->policy) {
+			p->policy = policy;
+			p->upgraded = true;
+		}
+		if(class > p->class) {
+			p->class = class;
+			p->upgraded = true;
+		}
+		rc = 0;
+		goto cleanup;
+	}
+	if(deferred_count >= CONFIG_QUEUE_DEFERRED_MAX) {
+		// The next page view will try again.
+		rc = UV_EAGAIN;
+		goto cleanup;
+	}
+	p = calloc(1, sizeof(*p));
+	if(!p) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+	p->time = time;
+	p->policy = policy;
+	p->class = class;
+	strlcpy(p->surt, surt, sizeof(p->surt));
+	strlcpy(p->URL, URL, sizeof(p->URL));
+	strlcpy(p->client, client, sizeof(p->client));
+	p->next = deferred;
+	deferred = p;
+	deferred_count++;
+	rc = async_spawn(STACK_DEFAULT, queue_add_async_run, p);
+	if(rc < 0) {
+		deferred = p->next;
+		deferred_count--;
+		goto cleanup;
+	}
+	p = NULL;
 cleanup:
+	async_mutex_unlock(deferred_lock);
+	if(rc < 0) free(p);
+	p = NULL;
+	return rc;
+}
+
+struct queue_bulk_args {
+	struct queue_add_args **items;
+	int *results;
+	size_t count;
+};
+// Only a database error aborts the batch.
+static int queue_bulk_txn(KVS_txn *const txn, void *const ctx) {
+	struct queue_bulk_args const *const args = ctx;
+	KVS_cursor *cursor = NULL;
+	int rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	for(size_t i = 0; i < args->count; i++) {
+		rc = queue_insert(txn, cursor, args->items[i]);
+		args->results[i] = rc;
+		if(rc < 0 && KVS_KEYEXIST != rc) break;
+		rc = 0;
+	}
 	cursor = NULL;
-	kvs_txn_abort(txn); txn = NULL;
-	hx_db_close(&db);
 	return rc;
 }
-int queue_timedwait(uint64_t const time, strarg_t const URL, uint64_t const future) {
-	KVS_env *db = NULL;
-	KVS_txn *txn = NULL;
+static int queue_add_cmp(void const *const a, void const *const b) {
+	struct queue_add_args const *const *const x = a;
+	struct queue_add_args const *const *const y = b;
+	return strcmp((*x)->surt, (*y)->surt);
+}
+int queue_add_bulk(uint64_t const time, strarg_t const *const URLs, size_t const count, hx_policy const policy, hx_class const class, int *const results) {
+	assert(URLs || !count);
+	assert(results || !count);
+	struct queue_add_args *items = NULL;
+	struct queue_add_args **sorted = NULL;
+	int *batch_results = NULL;
+	size_t valid = 0;
+	size_t added = 0;
 	int rc = 0;
+
+	items = calloc(count, sizeof(*items));
+	sorted = calloc(count, sizeof(*sorted));
+	batch_results = calloc(CONFIG_QUEUE_BULK_BATCH, sizeof(*batch_results));
+	if(!items || !sorted || !batch_results) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	for(size_t i = 0; i < count; i++) {
+		char surt[URI_MAX];
+		results[i] = url_normalize_surt(URLs[i], surt, sizeof(surt));
+		if(results[i] < 0) continue;
+		int const known = queue_recent_check(surt, time, CONFIG_CRAWL_DELAY_SECONDS, policy, class);
+		if(KVS_NOTFOUND != known) {
+			results[i] = KVS_KEYEXIST == known ? known : 1;
+			continue;
+		}
+		items[i].surt = strdup(surt);
+		if(!items[i].surt) rc = UV_ENOMEM;
+		if(rc < 0) goto cleanup;
+		items[i].time = time;
+		items[i].URL = URLs[i];
+		items[i].client = "";
+		items[i].policy = policy;
+		items[i].class = class;
+		items[i].interval = CONFIG_CRAWL_DELAY_SECONDS;
+		sorted[valid++] = &items[i];
+	}
+
+	// Walking the SURT indexes in order keeps the probes local.
+	// Duplicates end up next to each other.
+	qsort(sorted, valid, sizeof(*sorted), queue_add_cmp);
+	size_t unique = 0;
+	for(size_t i = 0; i < valid; i++) {
+		if(unique && 0 == strcmp(sorted[unique-1]->surt, sorted[i]->surt)) continue;
+		sorted[unique++] = sorted[i];
+	}
+
+	for(size_t i = 0; i < unique; i += CONFIG_QUEUE_BULK_BATCH) {
+		size_t const n = MIN(unique-i, CONFIG_QUEUE_BULK_BATCH);
+		uint64_t first = 0;
+		rc = hx_ids_next(ids, n, &first);
+		for(size_t j = 0; j < n; j++) sorted[i+j]->id = first+j;
+
+		struct queue_bulk_args args[1] = {{ sorted+i, batch_results, n }};
+		if(rc >= 0) rc = hx_db_write(queue_bulk_txn, args);
+		for(size_t j = 0; j < n; j++) {
+			struct queue_add_args *const item = sorted[i+j];
+			int const x = rc < 0 ? rc : batch_results[j];
+			results[item - items] = x < 0 ? x : item->queued ? 1 : 0;
+		}
+		if(rc < 0) continue;
+
+		for(size_t j = 0; j < n; j++) {
+			struct queue_add_args const *const item = sorted[i+j];
+			int const x = results[item - items];
+			if(KVS_KEYEXIST == x) {
+				queue_recent_crawled(item->surt, item->crawled, 0);
+			}
+			if(1 == x) {
+				queue_recent_queued(item->surt, item->qid, item->policy, item->class, item->crawled);
+				frontier_upgrade(item->URL, item->qtime, item->qid, item->policy, item->class);
+			}
+			if(0 != x) continue;
+			queue_recent_queued(item->surt, item->id, item->policy, item->class, item->crawled);
+			added++;
+			if(frontier_push(item->time, item->id, item->URL, item->client, item->policy, item->class) < 0) {
+				alogf("Frontier full, skipping %s until restart\n", item->URL);
+			}
+		}
+	}
+	rc = 0;
+
+	// Duplicates get the same result as the copy that was inserted.
+	for(size_t i = 0; i < count; i++) {
+		if(!items[i].surt) continue;
+		struct queue_add_args *const key = &items[i];
+		struct queue_add_args **const x = bsearch(&key, sorted, unique, sizeof(*sorted), queue_add_cmp);
+		assert(x);
+		results[i] = results[*x - items];
+	}
+	alogf("Bulk enqueued %zu of %zu URLs\n", added, count);
+
+cleanup:
+	for(size_t i = 0; items && i < count; i++) {
+		free((char *)items[i].surt); items[i].surt = NULL;
+	}
+	free(items); items = NULL;
+	free(sorted); sorted = NULL;
+	free(batch_results); batch_results = NULL;
+	return rc;
+}
+// Critical URLs always get every algorithm, even when they're
+// recrawled as part of bulk traffic.
+void queue_add_critical(void) {
+	uint64_t const now = time(NULL);
+	for(size_t i = 0; i < numberof(critical); i++) {
+		int rc = queue_add(now, critical[i], "", HX_POLICY_FULL, HX_CLASS_CRITICAL);
+		if(rc < 0 && KVS_KEYEXIST != rc) {
+			alogf("Queue critical error: %s\n", hx_strerror(rc));
+		}
+	}
+}
+static struct queue_waiter **queue_waiter_bucket(strarg_t const surt) {
+	return &waiters[surt_hash(surt) % WAITER_BUCKETS];
+}
+static void queue_waiter_remove(struct queue_waiter *const w) {
+	struct queue_waiter **x = queue_waiter_bucket(w->surt);
+	for(; *x; x = &(*x)->next) {
+		if(*x != w) continue;
+		*x = w->next;
+		break;
+	}
+	w->next = NULL;
+}
+// Hands a newly added response to everyone waiting on its URL.
+static void queue_wake(struct response const *const res, uint64_t const id) {
+	char surt[URI_MAX];
+	if(url_normalize_surt(res->url, surt, sizeof(surt)) < 0) return;
 	async_mutex_lock(wait_lock);
-	for(;;) {
-		// It was tempting to use double-checked locking
-		// or something even fancier, but for now it doesn't
-		// seem worth it.
-		uint64_t ltime, lid;
-		rc = hx_db_open(&db);
-		if(rc < 0) break;
-		rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
-		if(rc < 0) break;
-		rc = hx_get_latest(URL, txn, &ltime, &lid);
-		kvs_txn_abort(txn); txn = NULL;
-		hx_db_close(&db);
-		if(rc >= 0) {
-			if(ltime+CONFIG_CRAWL_DELAY_SECONDS >= time) break;
-			rc = KVS_NOTFOUND;
+	struct queue_waiter **x = queue_waiter_bucket(surt);
+	while(*x) {
+		struct queue_waiter *const w = *x;
+		if(0 != strcmp(w->surt, surt)) {
+			x = &w->next;
+			continue;
 		}
-		if(KVS_NOTFOUND != rc) break;
-		rc = async_cond_timedwait(wait_cond, wait_lock, future);
-		if(rc < 0) break;
+		*x = w->next;
+		w->next = NULL;
+		*w->out = *res;
+		w->out->id = id;
+		w->out->next = NULL;
+		w->out->prev = NULL;
+		w->out->flags = HX_RES_LATEST;
+		w->done = true;
+		async_cond_signal(w->cond);
 	}
 	async_mutex_unlock(wait_lock);
+}
+// Waits for a response to URL from at or after time, and returns it in out.
+int queue_timedwait(uint64_t const time, strarg_t const URL, uint64_t const future, struct response *const out) {
+	assert(out);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	char surt[URI_MAX];
+	struct queue_waiter w[1] = {};
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) return rc;
+	w->surt = surt;
+	w->out = out;
+	async_cond_init(w->cond, 0);
+
+	// Register before checking, so a fetch that finishes
+	// in between isn't missed.
+	async_mutex_lock(wait_lock);
+	struct queue_waiter **const bucket = queue_waiter_bucket(surt);
+	w->next = *bucket;
+	*bucket = w;
+	async_mutex_unlock(wait_lock);
+
+	uint64_t ltime, lid;
+	rc = hx_db_open(&db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = hx_get_latest(URL, txn, &ltime, &lid);
 	kvs_txn_abort(txn); txn = NULL;
 	hx_db_close(&db);
+	if(rc >= 0 && ltime+CONFIG_CRAWL_DELAY_SECONDS < time) rc = KVS_NOTFOUND;
+	if(KVS_NOTFOUND != rc) goto cleanup;
+
+	async_mutex_lock(wait_lock);
+	rc = 0;
+	while(!w->done && rc >= 0) {
+		rc = async_cond_timedwait(w->cond, wait_lock, future);
+	}
+	if(w->done) rc = 0;
+	else queue_waiter_remove(w);
+	async_mutex_unlock(wait_lock);
+	async_cond_destroy(w->cond);
 	return rc;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	hx_db_close(&db);
+	async_mutex_lock(wait_lock);
+	bool const done = w->done;
+	if(!done) queue_waiter_remove(w);
+	async_mutex_unlock(wait_lock);
+	async_cond_destroy(w->cond);
+	if(done) return 0;
+	if(rc < 0) return rc;
+	// It was already there.
+	ssize_t const count = hx_get_history(URL, out, 1);
+	if(count < 0) return (int)count;
+	if(count < 1) return KVS_NOTFOUND;
+	return 0;
 }
 
-static void queue_work(void) {
-	uint64_t then;
-	uint64_t old_id;
-	char URL[URI_MAX];
-	char client[255+1];
+// Errors and 5xx responses might go away if we wait.
+static bool response_failed(struct response const *const res) {
+	return res->status < 0 || res->status >= 500;
+}
+// Counts consecutive failures by URL and by host. A success clears both.
+static int queue_failures_update(KVS_txn *const txn, strarg_t const URL, struct response const *const res, uint64_t *const host_failures) {
+	char surt[URI_MAX];
+	char name[URL_HOST_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) return rc;
+	frontier_host_name(URL, name, sizeof(name));
+	bool const failed = response_failed(res);
 
-	struct response res[1];
-	uint64_t new_id;
+	KVS_val url_key[1], url_val[1];
+	uint64_t count = 0;
+	HXURLSurtToFailuresKeyPack(url_key, txn, surt);
+	rc = kvs_get(txn, url_key, url_val);
+	if(rc >= 0) HXURLSurtToFailuresValUnpack(url_val, &count);
+	else if(KVS_NOTFOUND != rc) return rc;
+	if(failed) {
+		KVS_val new_val[1];
+		HXURLSurtToFailuresValPack(new_val, count+1);
+		rc = kvs_put(txn, url_key, new_val, 0);
+		if(rc < 0) return rc;
+	} else if(count) {
+		rc = kvs_del(txn, url_key, 0);
+		if(rc < 0) return rc;
+	}
 
-	KVS_env *db = NULL;
-	KVS_txn *txn = NULL;
-	int rc = 0;
+	KVS_val host_key[1], host_val[1];
+	uint64_t hcount = 0, htime = 0;
+	HXHostToFailuresKeyPack(host_key, txn, name);
+	rc = kvs_get(txn, host_key, host_val);
+	if(rc >= 0) HXHostToFailuresValUnpack(host_val, &hcount, &htime);
+	else if(KVS_NOTFOUND != rc) return rc;
+	if(failed) {
+		KVS_val new_val[1];
+		HXHostToFailuresValPack(new_val, hcount+1, res->time);
+		rc = kvs_put(txn, host_key, new_val, 0);
+		if(rc < 0) return rc;
+	} else if(hcount) {
+		rc = kvs_del(txn, host_key, 0);
+		if(rc < 0) return rc;
+	}
+	*host_failures = failed ? hcount+1 : 0;
+	return 0;
+}
 
-	async_mutex_lock(work_lock);
-	for(;;) {
-		rc = queue_peek(&then, &old_id, URL, sizeof(URL), client, sizeof(client));
-		if(KVS_NOTFOUND != rc) break;
-		rc = async_cond_wait(work_cond, work_lock);
-		if(rc < 0) break;
+struct queue_done_args {
+	struct frontier_job const *job;
+	struct response const *res;
+	uint64_t id;
+	uint64_t host_failures; // Out
+};
+static int queue_done_txn(KVS_txn *const txn, void *const ctx) {
+	struct queue_done_args *const args = ctx;
+	int rc = queue_remove(txn, args->job->time, args->job->id, args->job->URL);
+	if(rc < 0) return rc;
+	rc = queue_failures_update(txn, args->job->URL, args->res, &args->host_failures);
+	if(rc < 0) return rc;
+	return hx_response_add(txn, args->res, args->id);
+}
+// Records the response in place of the job's queue entry.
+static int queue_record(struct frontier_job *const job, struct response const *const res, uint64_t *const id) {
+	uint64_t new_id = 0;
+	int rc = hx_ids_next(ids, 1, &new_id);
+	struct queue_done_args args[1] = {{ job, res, new_id, 0 }};
+	if(rc >= 0) rc = hx_db_write(queue_done_txn, args);
+	if(rc >= 0) {
+		char surt[URI_MAX];
+		if(url_normalize_surt(job->URL, surt, sizeof(surt)) >= 0) {
+			queue_recent_crawled(surt, res->time, job->id);
+		}
 	}
-	async_mutex_unlock(work_lock);
+	if(rc >= 0 && args->host_failures) {
+		uint64_t const delay = failure_backoff(args->host_failures, CONFIG_CRAWL_HOST_BACKOFF, CONFIG_CRAWL_HOST_BACKOFF_MAX);
+		alogf("Backing off %s for %llus after %llu failures\n", job->host->name, (unsigned long long)delay/1000, (unsigned long long)args->host_failures);
+		async_mutex_lock(work_lock);
+		uint64_t const now = uv_now(async_loop);
+		frontier_host_backoff(job->host, now + delay, now);
+		async_mutex_unlock(work_lock);
+	}
+	if(rc < 0) return rc;
+	*id = new_id;
+	return 0;
+}
+// Records the response and ends the lease either way.
+static int queue_finish(struct frontier_job *const job, struct response const *const res) {
+	uint64_t id = 0;
+	int rc = queue_record(job, res, &id);
+	frontier_release(job, rc);
+	if(rc < 0) return rc;
+	queue_wake(res, id);
+	return 0;
+}
+// Records the last error as the response, so the entry leaves the
+// queue and the URL backs off like after any other failed fetch.
+static int queue_give_up(struct frontier_job *const job, int const err) {
+	struct response res[1] = {};
+	res->time = time(NULL);
+	strlcpy(res->url, job->URL, sizeof(res->url));
+	res->status = err;
+	res->length = UINT64_MAX;
+	uint64_t id = 0;
+	int rc = queue_record(job, res, &id);
+	if(rc < 0) return rc;
+	alogf("Failed %s after %u attempts: %s\n", job->URL, job->attempts+1, hx_strerror(err));
+	queue_wake(res, id);
+	return 0;
+}
+static int queue_work(void) {
+	struct frontier_job *job = NULL;
+	struct response res[1];
+	int rc = 0;
+
+	rc = frontier_lease(&job, true, 0);
+	if(UV_ECANCELED == rc) return rc;
 	if(rc < 0) goto cleanup;
 
-	alogf("fetching %s\n", URL);
+	alogf("fetching %s\n", job->URL);
 
-	async_mutex_lock(id_lock);
-	new_id = current_id++;
-	async_mutex_unlock(id_lock);
-	rc = url_fetch(URL, client, res);
+	uint64_t const start = uv_hrtime();
+	rc = url_fetch(job->URL, job->client, policy_algos(job->policy), res);
+	fetch_time += uv_hrtime() - start;
 	if(rc < 0) goto cleanup;
 
-	rc = hx_db_open(&db);
-	if(rc < 0) goto cleanup;
-	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
-	if(rc < 0) goto cleanup;
-	rc = queue_remove(txn, then, old_id, URL, client);
-	if(rc < 0) goto cleanup;
-	rc = hx_response_add(txn, res, new_id);
-	if(rc < 0) goto cleanup;
-	rc = kvs_txn_commit(txn); txn = NULL;
-	if(rc < 0) goto cleanup;
+	rc = queue_finish(job, res);
+	job = NULL;
 
 cleanup:
-	kvs_txn_abort(txn); txn = NULL;
-	hx_db_close(&db);
+	if(job) frontier_release(job, rc);
+	job = NULL;
 
 	if(rc < 0) {
 		alogf("Worker error: %s\n", hx_strerror(rc));
 		async_sleep(1000*5);
-		return;
 	}
+	return 0;
+}
+static void queue_work_loop(void *ignored) {
+	while(UV_ECANCELED != queue_work());
+}
+// Must be called with work_lock held.
+static void queue_workers_spawn(void) {
+	while(workers < workers_target) {
+		if(async_spawn(STACK_DEFAULT, queue_work_loop, NULL) < 0) {
+			workers_target = workers;
+			break;
+		}
+		workers++;
+	}
+	async_cond_broadcast(work_cond); // Let extra workers exit
+}
+static void queue_workers_scale(uint64_t const elapsed, uint64_t const fetching, uint64_t const hashing) {
+	static long ncpu = 0;
+	if(!ncpu) ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpu < 1) ncpu = 1;
+	// Share of the CPUs spent hashing, and share of fetch time
+	// spent waiting on the network rather than hashing.
+	double const hash_load = (double)hashing / elapsed / ncpu;
+	double const io_share = fetching > hashing ?
+		(double)(fetching - hashing) / fetching : 0;
+
+	async_mutex_lock(work_lock);
+	size_t const old = workers_target;
+	size_t target = old;
+	if(hash_load >= CONFIG_QUEUE_SCALE_HASH_MAX) {
+		// More fetches at once would only queue up for the CPUs.
+		if(target) target -= MAX(target/4, 1);
+	} else if(!workers_idle && ready_count) {
+		// Slow servers mostly cost us waiting, so grow faster.
+		size_t const step = io_share >= 0.5 ? MAX(target/4, 1) : 1;
+		target += MIN(step, ready_count);
+	} else if(workers_idle > target/4) {
+		target -= MIN(workers_idle/2, target);
+	}
+	if(target < CONFIG_QUEUE_WORKERS_MIN) target = CONFIG_QUEUE_WORKERS_MIN;
+	if(target > CONFIG_QUEUE_WORKERS_MAX) target = CONFIG_QUEUE_WORKERS_MAX;
+	workers_target = target;
+	queue_workers_spawn();
+	size_t const ready = ready_count;
+	size_t const idle = workers_idle;
+	async_mutex_unlock(work_lock);
 
-	async_cond_broadcast(wait_cond);
+	if(old == target) return;
+	alogf("Workers %zu -> %zu (ready hosts %zu, idle %zu, hashing %.2f, waiting %.2f)\n",
+		old, target, ready, idle, hash_load, io_share);
 }
-void queue_work_loop(void *ignored) {
-	for(;;) queue_work();
+static void queue_workers_loop(void *ignored) {
+	uint64_t last = uv_hrtime();
+	uint64_t last_fetch = fetch_time;
+	uint64_t last_hash = fetch_hash_time();
+	for(;;) {
+		async_sleep(CONFIG_QUEUE_SCALE_DELAY);
+		uint64_t const now = uv_hrtime();
+		uint64_t const fetch = fetch_time;
+		uint64_t const hash = fetch_hash_time();
+		queue_workers_scale(MAX(now - last, 1), fetch - last_fetch, hash - last_hash);
+		last = now;
+		last_fetch = fetch;
+		last_hash = hash;
+	}
 }
+int queue_workers_init(void) {
+	async_mutex_lock(work_lock);
+	workers_target = CONFIG_QUEUE_WORKERS;
+	queue_workers_spawn();
+	size_t const count = workers;
+	async_mutex_unlock(work_lock);
+	if(!count && CONFIG_QUEUE_WORKERS) return UV_ENOMEM;
+	return async_spawn(STACK_DEFAULT, queue_workers_loop, NULL);
+}
+
 
+
+// Jobs leased to other processes. There are only as many as there
+// are remote workers, so a list is fine.
+struct queue_remote {
+	struct queue_remote *next;
+	uint64_t lease;
+	uint64_t deadline; // uv_now()
+	struct frontier_job *job;
+};
+static struct queue_remote *remotes = NULL; // Protected by work_lock
+static uint64_t remote_next = 0;
+
+static struct frontier_job *queue_remote_take(uint64_t const lease) {
+	struct frontier_job *job = NULL;
+	async_mutex_lock(work_lock);
+	for(struct queue_remote **x = &remotes; *x; x = &(*x)->next) {
+		if(lease != (*x)->lease) continue;
+		struct queue_remote *const r = *x;
+		*x = r->next;
+		job = r->job;
+		free(r);
+		break;
+	}
+	async_mutex_unlock(work_lock);
+	return job;
+}
+int queue_lease(uint64_t const wait, uint64_t const timeout, struct queue_lease *const out) {
+	assert(out);
+	struct queue_remote *r = calloc(1, sizeof(*r));
+	if(!r) return UV_ENOMEM;
+	struct frontier_job *job = NULL;
+	int rc = frontier_lease(&job, false, uv_now(async_loop) + MAX(wait, 1));
+	if(rc < 0) {
+		free(r); r = NULL;
+		return rc;
+	}
+	out->algos = policy_algos(job->policy);
+	strlcpy(out->URL, job->URL, sizeof(out->URL));
+	strlcpy(out->client, job->client, sizeof(out->client));
+
+	async_mutex_lock(work_lock);
+	r->lease = ++remote_next;
+	r->deadline = uv_now(async_loop) + timeout;
+	r->job = job;
+	r->next = remotes;
+	remotes = r;
+	out->lease = r->lease;
+	async_mutex_unlock(work_lock);
+	return 0;
+}
+int queue_lease_done(uint64_t const lease, struct response *const res) {
+	assert(res);
+	struct frontier_job *const job = queue_remote_take(lease);
+	if(!job) return KVS_NOTFOUND;
+	// Workers can only answer for the URL they leased, and only
+	// with a time from while they held it.
+	strlcpy(res->url, job->URL, sizeof(res->url));
+	uint64_t const now = time(NULL);
+	if(res->time > now || res->time+CONFIG_LEASE_TIMEOUT/1000 < now) {
+		res->time = now;
+	}
+	return queue_finish(job, res);
+}
+int queue_lease_fail(uint64_t const lease, int const err) {
+	struct frontier_job *const job = queue_remote_take(lease);
+	if(!job) return KVS_NOTFOUND;
+	frontier_release(job, err < 0 ? err : UV_ECANCELED);
+	return 0;
+}
+void queue_lease_expire(void) {
+	struct queue_remote *expired = NULL;
+	async_mutex_lock(work_lock);
+	uint64_t const now = uv_now(async_loop);
+	for(struct queue_remote **x = &remotes; *x;) {
+		struct queue_remote *const r = *x;
+		if(r->deadline > now) {
+			x = &r->next;
+			continue;
+		}
+		*x = r->next;
+		r->next = expired;
+		expired = r;
+	}
+	async_mutex_unlock(work_lock);
+	while(expired) {
+		struct queue_remote *const r = expired;
+		expired = r->next;
+		alogf("Lease expired for %s\n", r->job->URL);
+		frontier_release(r->job, UV_ETIMEDOUT);
+		free(r);
+	}
+}
@@ -1,9 +1,37 @@
 // Copyright 2016 Ben Trask
 // MIT licensed (see LICENSE for details)
 
-void queue_init(void);
+int queue_init(void);
 void queue_log(size_t const n);
-int queue_add(uint64_t const time, strarg_t const URL, strarg_t const client);
-int queue_timedwait(uint64_t const time, strarg_t const URL, uint64_t const future);
-void queue_work_loop(void *ignored);
+int queue_add(uint64_t const time, strarg_t const URL, strarg_t const client, hx_policy const policy, hx_class const class);
+// Like queue_add(), but skips URLs crawled less than interval seconds ago.
+int queue_add_interval(uint64_t const time, strarg_t const URL, strarg_t const client, hx_policy const policy, hx_class const class, uint64_t const interval);
+// Like queue_add(), but the write happens in the background, so it
+// never waits on the database. Repeated calls for a URL that's already
+// known or pending don't write anything.
+int queue_add_async(uint64_t const time, strarg_t const URL, strarg_t const client, hx_policy const policy, hx_class const class);
+// Queues many URLs in a few large transactions without waiting for them.
+// Each result is 0 if the URL was added, 1 if it was already queued,
+// KVS_KEYEXIST if it was crawled recently, or another error.
+int queue_add_bulk(uint64_t const time, strarg_t const *const URLs, size_t const count, hx_policy const policy, hx_class const class, int *const results);
+void queue_add_critical(void);
+int queue_timedwait(uint64_t const time, strarg_t const URL, uint64_t const future, struct response *const out);
+// Starts CONFIG_QUEUE_WORKERS crawl workers, and adjusts the
+// number as the backlog and fetch times change.
+int queue_workers_init(void);
+
+// Jobs for crawl workers in other processes. A lease that isn't
+// finished or failed within its timeout goes back in line.
+struct queue_lease {
+	uint64_t lease;
+	uint64_t algos;
+	char URL[URI_MAX];
+	char client[255+1];
+};
+// Waits up to wait ms for a job. Returns UV_ETIMEDOUT if there's none.
+int queue_lease(uint64_t const wait, uint64_t const timeout, struct queue_lease *const out);
+// The response's URL and time are corrected to match the lease.
+int queue_lease_done(uint64_t const lease, struct response *const res);
+int queue_lease_fail(uint64_t const lease, int const err);
+void queue_lease_expire(void);
 
@@ -0,0 +1,137 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <async/async.h>
+#include "util/strext.h"
+#include "util/url.h"
+#include "db.h"
+#include "errors.h"
+#include "config.h"
+#include "queue.h"
+#include "recrawl.h"
+
+struct recrawl_state {
+	struct hx_recrawl items[CONFIG_RECRAWL_BATCH];
+	struct response history[CONFIG_RECRAWL_HISTORY];
+};
+
+static char critical_surts[numberof(critical)][URI_MAX];
+
+static bool is_critical(strarg_t const surt) {
+	for(size_t i = 0; i < numberof(critical); i++) {
+		if(0 == strcmp(critical_surts[i], surt)) return true;
+	}
+	return false;
+}
+// Only compares digests that both responses have.
+static bool digests_eq(struct response const *const a, struct response const *const b) {
+	if(a->status != b->status) return false;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		size_t const len = MIN(a->digests[i].len, b->digests[i].len);
+		if(0 != memcmp(a->digests[i].buf, b->digests[i].buf, len)) return false;
+	}
+	return true;
+}
+// Assumes changes happen at a steady rate, so the interval is the
+// time covered by the recent history divided by the changes in it.
+// A URL that never changes backs off geometrically as its history
+// spreads out, and one that changes every time tightens until it
+// hits the minimum.
+static uint64_t recrawl_interval(uint64_t const span, size_t const changes, bool const critical) {
+	uint64_t x = span / (changes+1);
+	if(x < CONFIG_RECRAWL_MIN_SECONDS) x = CONFIG_RECRAWL_MIN_SECONDS;
+	if(x > CONFIG_RECRAWL_MAX_SECONDS) x = CONFIG_RECRAWL_MAX_SECONDS;
+	if(critical && x > CONFIG_RECRAWL_CRITICAL_SECONDS) x = CONFIG_RECRAWL_CRITICAL_SECONDS;
+	return x;
+}
+
+// Works out from the URL's latest few responses when it's next due.
+static int recrawl_check(strarg_t const URL, struct response *const history, uint64_t *const due, uint64_t *const interval, bool *const critical) {
+	char surt[URI_MAX];
+	int rc = url_normalize_surt(URL, surt, sizeof(surt));
+	if(rc < 0) return rc;
+	// Only digest prefixes are needed to spot changes.
+	ssize_t const count = hx_get_history_unique(URL, history, CONFIG_RECRAWL_HISTORY);
+	if(count < 0) return (int)count;
+	if(!count) return KVS_NOTFOUND;
+	size_t changes = 0;
+	for(ssize_t i = 1; i < count; i++) {
+		if(!digests_eq(&history[i-1], &history[i])) changes++;
+	}
+	// With one response, there's nothing to go on but the default.
+	uint64_t const latest = history[0].time;
+	uint64_t const span = count > 1 ? latest - history[count-1].time : CONFIG_CRAWL_DELAY_SECONDS;
+	*critical = is_critical(surt);
+	*interval = recrawl_interval(span, changes, *critical);
+	*due = latest + *interval;
+	return 0;
+}
+
+struct recrawl_args {
+	struct hx_recrawl const *items;
+	size_t count;
+};
+static int recrawl_txn(KVS_txn *const txn, void *const ctx) {
+	struct recrawl_args const *const args = ctx;
+	for(size_t i = 0; i < args->count; i++) {
+		int rc = hx_recrawl_set(txn, args->items[i].URL, args->items[i].time);
+		if(rc < 0) return rc;
+	}
+	return 0;
+}
+// Only looks at URLs whose recrawl time has come. Each one is queued
+// if it's really due, and either way is put back for when it will be.
+static void recrawl_loop(void *arg) {
+	struct recrawl_state *const state = arg;
+	struct hx_recrawl *const items = state->items;
+	for(;;) {
+		uint64_t const now = time(NULL);
+		ssize_t const count = hx_recrawl_get(now, items, CONFIG_RECRAWL_BATCH);
+		if(count < 0) alogf("Recrawl error: %s\n", hx_strerror(count));
+		for(ssize_t i = 0; i < count; i++) {
+			uint64_t due = 0, interval = 0;
+			bool critical = false;
+			int rc = recrawl_check(items[i].URL, state->history, &due, &interval, &critical);
+			if(rc < 0) {
+				alogf("Recrawl error for %s: %s\n", items[i].URL, hx_strerror(rc));
+				items[i].time = now + CONFIG_RECRAWL_MIN_SECONDS;
+				continue;
+			}
+			if(due > now) {
+				items[i].time = due;
+				continue;
+			}
+			hx_policy const policy = critical ? HX_POLICY_FULL : HX_POLICY_BULK;
+			hx_class const class = critical ? HX_CLASS_CRITICAL : HX_CLASS_BULK;
+			rc = queue_add_interval(now, items[i].URL, "", policy, class, interval);
+			if(rc < 0 && KVS_KEYEXIST != rc) {
+				alogf("Recrawl queue error: %s\n", hx_strerror(rc));
+			}
+			// The new response will move it up again, unless
+			// the fetch never happens.
+			items[i].time = now + interval;
+		}
+		if(count > 0) {
+			struct recrawl_args args[1] = {{ items, (size_t)count }};
+			int rc = hx_db_write(recrawl_txn, args);
+			if(rc < 0) alogf("Recrawl error: %s\n", hx_strerror(rc));
+		}
+		bool const more = CONFIG_RECRAWL_BATCH == count;
+		async_sleep(more ? CONFIG_RECRAWL_BATCH_DELAY : CONFIG_RECRAWL_SWEEP_DELAY);
+	}
+}
+
+int recrawl_init(void) {
+	for(size_t i = 0; i < numberof(critical); i++) {
+		int rc = url_normalize_surt(critical[i], critical_surts[i], sizeof(critical_surts[i]));
+		if(rc < 0) strlcpy(critical_surts[i], "", sizeof(critical_surts[i]));
+	}
+	struct recrawl_state *const state = calloc(1, sizeof(struct recrawl_state));
+	if(!state) return UV_ENOMEM;
+	int rc = async_spawn(STACK_DEFAULT, recrawl_loop, state);
+	if(rc < 0) free(state);
+	return rc;
+}
@@ -0,0 +1,5 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Periodically re-queues known URLs based on how often they change.
+int recrawl_init(void);
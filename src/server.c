@@ -15,6 +15,9 @@
 #include "errors.h"
 #include "config.h"
 #include "queue.h"
+#include "conn_pool.h"
+#include "recrawl.h"
+#include "lease.h"
 
 static HTTPServerRef server_raw = NULL;
 static HTTPServerRef server_tls = NULL;
@@ -133,6 +136,11 @@ static int GET_api_enqueue(HTTPConnectionRef const conn, HTTPMethod const method
 	if('\0' == url[0]) return -1;
 	return hx_httperr(api_enqueue(conn, url));
 }
+static int POST_api_enqueue(HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_POST != method) return -1;
+	if(0 != uripathcmp(URI, "/api/enqueue", NULL)) return -1;
+	return hx_httperr(api_enqueue_bulk(conn));
+}
 static int GET_api_history(HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
 	char url[1023+1]; url[0] = '\0';
@@ -230,6 +238,7 @@ static void listener(void *ctx, HTTPServerRef const server, HTTPConnectionRef co
 	rc = rc >= 0 ? rc : GET_sources(conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_critical(conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_api_enqueue(conn, method, URI, headers);
+	rc = rc >= 0 ? rc : POST_api_enqueue(conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_api_history(conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_api_sources(conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_api_dump(conn, method, URI, headers);
@@ -249,17 +258,43 @@ static void init(void *ignore) {
 	HTTPServerRef tls = NULL;
 	int rc;
 
+	rc = hasher_init();
+	if(rc < 0) {
+		alogf("Hasher init error: %s\n", hash_strerror(rc));
+		goto cleanup;
+	}
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		alogf("Hash %s: %s (%.0f MB/s single-stream%s)\n", hash_algo_names[i], hasher_kernel_name(i), hasher_kernel_speed(i),
+			hasher_kernel_by_policy(i) ? ", chosen by policy for concurrent load" : "");
+	}
+
 	rc = hx_db_load();
 	if(rc < 0) {
 		alogf("Database load error: %s\n", hx_strerror(rc));
 		goto cleanup;
 	}
 	queue_log(10);
+	size_t cache_size = 0;
+	hx_cache_stats(NULL, NULL, &cache_size);
+	alogf("Response cache: %zu KB warmed\n", cache_size/1024);
 
 
-	queue_init();
-	for(size_t i = 0; i < CONFIG_QUEUE_WORKERS; i++) {
-		async_spawn(STACK_DEFAULT, queue_work_loop, NULL);
+	conn_pool_init();
+	rc = queue_init();
+	if(rc < 0) {
+		alogf("Queue load error: %s\n", hx_strerror(rc));
+		goto cleanup;
+	}
+	rc = queue_workers_init();
+	if(rc < 0) {
+		alogf("Queue worker error: %s\n", hx_strerror(rc));
+		goto cleanup;
+	}
+	queue_add_critical();
+	rc = recrawl_init();
+	if(rc < 0) {
+		alogf("Recrawl init error: %s\n", hx_strerror(rc));
+		goto cleanup;
 	}
 
 	if(CONFIG_SERVER_TLS_PORT) {
@@ -300,6 +335,11 @@ static void init(void *ignore) {
 		alogf("Import socket error: %s\n", hx_strerror(rc));
 		goto cleanup;
 	}
+	rc = lease_init();
+	if(rc < 0) {
+		alogf("Worker socket error: %s\n", hx_strerror(rc));
+		goto cleanup;
+	}
 
 cleanup:
 	HTTPServerFree(&raw);
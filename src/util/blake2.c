@@ -0,0 +1,180 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <string.h>
+#include "blake2.h"
+
+static uint8_t const blake2_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+};
+
+static uint32_t const blake2s_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+static uint64_t const blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static uint32_t load32(unsigned char const *const p) {
+	return
+		(uint32_t)p[0] <<  0 |
+		(uint32_t)p[1] <<  8 |
+		(uint32_t)p[2] << 16 |
+		(uint32_t)p[3] << 24;
+}
+static uint64_t load64(unsigned char const *const p) {
+	return (uint64_t)load32(p) | (uint64_t)load32(p+4) << 32;
+}
+static void store32(unsigned char *const p, uint32_t const x) {
+	p[0] = x >>  0;
+	p[1] = x >>  8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+static void store64(unsigned char *const p, uint64_t const x) {
+	store32(p, (uint32_t)x);
+	store32(p+4, (uint32_t)(x >> 32));
+}
+static uint32_t rotr32(uint32_t const x, unsigned const n) {
+	return (x >> n) | (x << (32-n));
+}
+static uint64_t rotr64(uint64_t const x, unsigned const n) {
+	return (x >> n) | (x << (64-n));
+}
+
+#define G(r, i, a, b, c, d, R1, R2, R3, R4, ROTR) do { \
+	a = a + b + m[blake2_sigma[r][2*(i)+0]]; \
+	d = ROTR(d ^ a, R1); \
+	c = c + d; \
+	b = ROTR(b ^ c, R2); \
+	a = a + b + m[blake2_sigma[r][2*(i)+1]]; \
+	d = ROTR(d ^ a, R3); \
+	c = c + d; \
+	b = ROTR(b ^ c, R4); \
+} while(0)
+#define ROUND(r, R1, R2, R3, R4, ROTR) do { \
+	G(r, 0, v[0], v[4], v[ 8], v[12], R1, R2, R3, R4, ROTR); \
+	G(r, 1, v[1], v[5], v[ 9], v[13], R1, R2, R3, R4, ROTR); \
+	G(r, 2, v[2], v[6], v[10], v[14], R1, R2, R3, R4, ROTR); \
+	G(r, 3, v[3], v[7], v[11], v[15], R1, R2, R3, R4, ROTR); \
+	G(r, 4, v[0], v[5], v[10], v[15], R1, R2, R3, R4, ROTR); \
+	G(r, 5, v[1], v[6], v[11], v[12], R1, R2, R3, R4, ROTR); \
+	G(r, 6, v[2], v[7], v[ 8], v[13], R1, R2, R3, R4, ROTR); \
+	G(r, 7, v[3], v[4], v[ 9], v[14], R1, R2, R3, R4, ROTR); \
+} while(0)
+
+static void blake2s_compress(BLAKE2S_CTX *const c, unsigned char const *const block, uint32_t const last) {
+	uint32_t m[16], v[16];
+	for(size_t i = 0; i < 16; i++) m[i] = load32(block + i*4);
+	for(size_t i = 0; i < 8; i++) v[i] = c->h[i];
+	for(size_t i = 0; i < 8; i++) v[i+8] = blake2s_iv[i];
+	v[12] ^= c->t[0];
+	v[13] ^= c->t[1];
+	v[14] ^= last;
+	for(size_t r = 0; r < 10; r++) ROUND(r, 16, 12, 8, 7, rotr32);
+	for(size_t i = 0; i < 8; i++) c->h[i] ^= v[i] ^ v[i+8];
+}
+static void blake2b_compress(BLAKE2B_CTX *const c, unsigned char const *const block, uint64_t const last) {
+	uint64_t m[16], v[16];
+	for(size_t i = 0; i < 16; i++) m[i] = load64(block + i*8);
+	for(size_t i = 0; i < 8; i++) v[i] = c->h[i];
+	for(size_t i = 0; i < 8; i++) v[i+8] = blake2b_iv[i];
+	v[12] ^= c->t[0];
+	v[13] ^= c->t[1];
+	v[14] ^= last;
+	for(size_t r = 0; r < 12; r++) ROUND(r, 32, 24, 16, 63, rotr64);
+	for(size_t i = 0; i < 8; i++) c->h[i] ^= v[i] ^ v[i+8];
+}
+
+#undef G
+#undef ROUND
+
+// The last block has to be compressed with the final flag set,
+// so a full buffer is only flushed once more input arrives.
+#define BLAKE2_UPDATE(c, data, len, BLOCK, compress) do { \
+	unsigned char const *p = (data); \
+	size_t rem = (len); \
+	while(rem) { \
+		if(BLOCK == (c)->num) { \
+			(c)->t[0] += BLOCK; \
+			if((c)->t[0] < BLOCK) (c)->t[1]++; \
+			compress((c), (c)->buf, 0); \
+			(c)->num = 0; \
+		} \
+		if(0 == (c)->num && rem > BLOCK) { \
+			(c)->t[0] += BLOCK; \
+			if((c)->t[0] < BLOCK) (c)->t[1]++; \
+			compress((c), p, 0); \
+			p += BLOCK; \
+			rem -= BLOCK; \
+			continue; \
+		} \
+		size_t x = BLOCK - (c)->num; \
+		if(x > rem) x = rem; \
+		memcpy((c)->buf + (c)->num, p, x); \
+		(c)->num += x; \
+		p += x; \
+		rem -= x; \
+	} \
+} while(0)
+
+int BLAKE2S_Init(BLAKE2S_CTX *const c) {
+	assert(c);
+	memset(c, 0, sizeof(*c));
+	for(size_t i = 0; i < 8; i++) c->h[i] = blake2s_iv[i];
+	c->h[0] ^= 0x01010000 ^ BLAKE2S_DIGEST_LENGTH;
+	return 1;
+}
+int BLAKE2S_Update(BLAKE2S_CTX *const c, void const *const data, size_t const len) {
+	assert(c);
+	BLAKE2_UPDATE(c, data, len, BLAKE2S_BLOCK, blake2s_compress);
+	return 1;
+}
+int BLAKE2S_Final(unsigned char *const md, BLAKE2S_CTX *const c) {
+	assert(md);
+	assert(c);
+	c->t[0] += c->num;
+	if(c->t[0] < c->num) c->t[1]++;
+	memset(c->buf + c->num, 0, BLAKE2S_BLOCK - c->num);
+	blake2s_compress(c, c->buf, UINT32_MAX);
+	for(size_t i = 0; i < 8; i++) store32(md + i*4, c->h[i]);
+	return 1;
+}
+
+int BLAKE2B_Init(BLAKE2B_CTX *const c) {
+	assert(c);
+	memset(c, 0, sizeof(*c));
+	for(size_t i = 0; i < 8; i++) c->h[i] = blake2b_iv[i];
+	c->h[0] ^= 0x01010000 ^ BLAKE2B_DIGEST_LENGTH;
+	return 1;
+}
+int BLAKE2B_Update(BLAKE2B_CTX *const c, void const *const data, size_t const len) {
+	assert(c);
+	BLAKE2_UPDATE(c, data, len, BLAKE2B_BLOCK, blake2b_compress);
+	return 1;
+}
+int BLAKE2B_Final(unsigned char *const md, BLAKE2B_CTX *const c) {
+	assert(md);
+	assert(c);
+	c->t[0] += c->num;
+	if(c->t[0] < c->num) c->t[1]++;
+	memset(c->buf + c->num, 0, BLAKE2B_BLOCK - c->num);
+	blake2b_compress(c, c->buf, UINT64_MAX);
+	for(size_t i = 0; i < 8; i++) store64(md + i*8, c->h[i]);
+	return 1;
+}
+
@@ -0,0 +1,37 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#ifndef BLAKE2_H
+#define BLAKE2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Unkeyed BLAKE2s-256 and BLAKE2b-512 (RFC 7693).
+// Same calling conventions as OpenSSL (return 1 on success).
+
+#define BLAKE2S_BLOCK 64
+#define BLAKE2S_DIGEST_LENGTH 32
+typedef struct {
+	uint32_t h[8];
+	uint32_t t[2];
+	unsigned char buf[BLAKE2S_BLOCK];
+	size_t num;
+} BLAKE2S_CTX;
+int BLAKE2S_Init(BLAKE2S_CTX *const c);
+int BLAKE2S_Update(BLAKE2S_CTX *const c, void const *const data, size_t const len);
+int BLAKE2S_Final(unsigned char *const md, BLAKE2S_CTX *const c);
+
+#define BLAKE2B_BLOCK 128
+#define BLAKE2B_DIGEST_LENGTH 64
+typedef struct {
+	uint64_t h[8];
+	uint64_t t[2];
+	unsigned char buf[BLAKE2B_BLOCK];
+	size_t num;
+} BLAKE2B_CTX;
+int BLAKE2B_Init(BLAKE2B_CTX *const c);
+int BLAKE2B_Update(BLAKE2B_CTX *const c, void const *const data, size_t const len);
+int BLAKE2B_Final(unsigned char *const md, BLAKE2B_CTX *const c);
+
+#endif
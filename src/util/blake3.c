@@ -0,0 +1,466 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "blake3.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLAKE3_X86 1
+#endif
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+// Subtrees smaller than this aren't worth a thread.
+#define BLAKE3_PARALLEL_MIN (1024*256)
+#define BLAKE3_FORK_DEPTH_MAX 4 // Up to 16 subtrees at once
+// Chunk CVs are reduced in batches of this many.
+#define BLAKE3_LEAF_CHUNKS 64
+#define BLAKE3_LANES 8
+
+static uint32_t const blake3_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+static uint8_t const blake3_schedule[7][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+	{  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+	{ 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+	{ 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+	{  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+	{ 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 },
+};
+
+static uint32_t load32(unsigned char const *const p) {
+	return
+		(uint32_t)p[0] <<  0 |
+		(uint32_t)p[1] <<  8 |
+		(uint32_t)p[2] << 16 |
+		(uint32_t)p[3] << 24;
+}
+static void store32(unsigned char *const p, uint32_t const x) {
+	p[0] = x >>  0;
+	p[1] = x >>  8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+// Works on scalars and on vectors alike.
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+#define G(a, b, c, d, mx, my) do { \
+	a = a + b + (mx); \
+	d = ROTR(d ^ a, 16); \
+	c = c + d; \
+	b = ROTR(b ^ c, 12); \
+	a = a + b + (my); \
+	d = ROTR(d ^ a, 8); \
+	c = c + d; \
+	b = ROTR(b ^ c, 7); \
+} while(0)
+#define ROUNDS(v, m) \
+	for(size_t r = 0; r < 7; r++) { \
+		uint8_t const *const s = blake3_schedule[r]; \
+		G(v[0], v[4], v[ 8], v[12], m[s[ 0]], m[s[ 1]]); \
+		G(v[1], v[5], v[ 9], v[13], m[s[ 2]], m[s[ 3]]); \
+		G(v[2], v[6], v[10], v[14], m[s[ 4]], m[s[ 5]]); \
+		G(v[3], v[7], v[11], v[15], m[s[ 6]], m[s[ 7]]); \
+		G(v[0], v[5], v[10], v[15], m[s[ 8]], m[s[ 9]]); \
+		G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]); \
+		G(v[2], v[7], v[ 8], v[13], m[s[12]], m[s[13]]); \
+		G(v[3], v[4], v[ 9], v[14], m[s[14]], m[s[15]]); \
+	}
+
+static void blake3_compress(uint32_t *const cv, uint32_t const *const m, uint32_t const len, uint64_t const counter, uint32_t const flags) {
+	uint32_t v[16] = {
+		cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+		blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+		(uint32_t)counter, (uint32_t)(counter >> 32), len, flags,
+	};
+	ROUNDS(v, m)
+	for(size_t i = 0; i < 8; i++) cv[i] = v[i] ^ v[i+8];
+}
+static void blake3_load_block(uint32_t *const m, unsigned char const *const block) {
+	for(size_t i = 0; i < 16; i++) m[i] = load32(block + i*4);
+}
+static void blake3_parent(uint32_t *const out, uint32_t const *const left, uint32_t const *const right, uint32_t const flags) {
+	uint32_t m[16];
+	memcpy(m+0, left, 32);
+	memcpy(m+8, right, 32);
+	memcpy(out, blake3_iv, 32);
+	blake3_compress(out, m, BLAKE3_BLOCK, 0, PARENT | flags);
+}
+
+// Hashes eight whole chunks side by side, one per lane.
+typedef uint32_t blake3_vec __attribute__((vector_size(BLAKE3_LANES*4)));
+static inline __attribute__((always_inline)) void blake3_hash8_body(unsigned char const *const input, uint64_t const counter, uint32_t (*const out)[8]) {
+	blake3_vec const zero = {0};
+	uint32_t lo[BLAKE3_LANES], hi[BLAKE3_LANES];
+	for(size_t l = 0; l < BLAKE3_LANES; l++) {
+		lo[l] = (uint32_t)(counter + l);
+		hi[l] = (uint32_t)((counter + l) >> 32);
+	}
+	blake3_vec cv[8], vlo, vhi;
+	for(size_t i = 0; i < 8; i++) cv[i] = zero + blake3_iv[i];
+	memcpy(&vlo, lo, sizeof(vlo));
+	memcpy(&vhi, hi, sizeof(vhi));
+	for(size_t b = 0; b < BLAKE3_CHUNK/BLAKE3_BLOCK; b++) {
+		uint32_t tmp[16*BLAKE3_LANES];
+		for(size_t l = 0; l < BLAKE3_LANES; l++) {
+			unsigned char const *const p = input + l*BLAKE3_CHUNK + b*BLAKE3_BLOCK;
+			for(size_t w = 0; w < 16; w++) tmp[w*BLAKE3_LANES+l] = load32(p + w*4);
+		}
+		blake3_vec m[16];
+		for(size_t w = 0; w < 16; w++) memcpy(&m[w], &tmp[w*BLAKE3_LANES], sizeof(m[w]));
+		uint32_t flags = 0;
+		if(0 == b) flags |= CHUNK_START;
+		if(BLAKE3_CHUNK/BLAKE3_BLOCK-1 == b) flags |= CHUNK_END;
+		blake3_vec v[16] = {
+			cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+			zero + blake3_iv[0], zero + blake3_iv[1], zero + blake3_iv[2], zero + blake3_iv[3],
+			vlo, vhi, zero + BLAKE3_BLOCK, zero + flags,
+		};
+		ROUNDS(v, m)
+		for(size_t i = 0; i < 8; i++) cv[i] = v[i] ^ v[i+8];
+	}
+	uint32_t tmp[8*BLAKE3_LANES];
+	for(size_t i = 0; i < 8; i++) memcpy(&tmp[i*BLAKE3_LANES], &cv[i], sizeof(cv[i]));
+	for(size_t l = 0; l < BLAKE3_LANES; l++) {
+		for(size_t i = 0; i < 8; i++) out[l][i] = tmp[i*BLAKE3_LANES+l];
+	}
+}
+static void blake3_hash8_generic(unsigned char const *const input, uint64_t const counter, uint32_t (*const out)[8]) {
+	blake3_hash8_body(input, counter, out);
+}
+#ifdef BLAKE3_X86
+static __attribute__((target("avx2"))) void blake3_hash8_avx2(unsigned char const *const input, uint64_t const counter, uint32_t (*const out)[8]) {
+	blake3_hash8_body(input, counter, out);
+}
+#endif
+
+#undef ROUNDS
+#undef G
+#undef ROTR
+
+static void blake3_chunks(unsigned char const *const input, size_t const n, uint64_t const counter, uint32_t (*const out)[8]) {
+	size_t i = 0;
+#ifdef BLAKE3_X86
+	bool const avx2 = __builtin_cpu_supports("avx2");
+#endif
+	for(; i+BLAKE3_LANES <= n; i += BLAKE3_LANES) {
+#ifdef BLAKE3_X86
+		if(avx2) {
+			blake3_hash8_avx2(input + i*BLAKE3_CHUNK, counter+i, out+i);
+			continue;
+		}
+#endif
+		blake3_hash8_generic(input + i*BLAKE3_CHUNK, counter+i, out+i);
+	}
+	for(; i < n; i++) {
+		memcpy(out[i], blake3_iv, 32);
+		for(size_t b = 0; b < BLAKE3_CHUNK/BLAKE3_BLOCK; b++) {
+			uint32_t m[16];
+			blake3_load_block(m, input + i*BLAKE3_CHUNK + b*BLAKE3_BLOCK);
+			uint32_t flags = 0;
+			if(0 == b) flags |= CHUNK_START;
+			if(BLAKE3_CHUNK/BLAKE3_BLOCK-1 == b) flags |= CHUNK_END;
+			blake3_compress(out[i], m, BLAKE3_BLOCK, counter+i, flags);
+		}
+	}
+}
+
+struct blake3_subtree {
+	unsigned char const *input;
+	size_t chunks; // Power of two
+	uint64_t counter;
+	size_t depth; // Levels left at which to fork
+	uint32_t cv[8];
+};
+// Forked subtrees go to a shared set of threads, started on first use
+// and kept for the life of the process. A subtree nobody has picked up
+// by the time its sibling is done is taken back and hashed in place,
+// so concurrent callers never wait on each other's queued work.
+struct blake3_task {
+	struct blake3_subtree *tree;
+	bool taken;
+	bool done;
+	struct blake3_task *next;
+};
+static pthread_once_t blake3_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t blake3_pool_lock[1] = { PTHREAD_MUTEX_INITIALIZER };
+static pthread_cond_t blake3_pool_work[1] = { PTHREAD_COND_INITIALIZER };
+static pthread_cond_t blake3_pool_done[1] = { PTHREAD_COND_INITIALIZER };
+static struct blake3_task *blake3_pool_head = NULL;
+static size_t blake3_pool_threads = 0;
+static size_t blake3_fork_depth = 0;
+
+static void blake3_subtree_pair(struct blake3_subtree *const tree, uint32_t (*const out)[8]);
+static void blake3_subtree_cv(struct blake3_subtree *const tree) {
+	if(tree->chunks <= BLAKE3_LEAF_CHUNKS) {
+		uint32_t cvs[BLAKE3_LEAF_CHUNKS][8];
+		blake3_chunks(tree->input, tree->chunks, tree->counter, cvs);
+		for(size_t n = tree->chunks; n > 1; n /= 2) {
+			for(size_t i = 0; i < n/2; i++) {
+				blake3_parent(cvs[i], cvs[i*2+0], cvs[i*2+1], 0);
+			}
+		}
+		memcpy(tree->cv, cvs[0], 32);
+		return;
+	}
+	uint32_t pair[2][8];
+	blake3_subtree_pair(tree, pair);
+	blake3_parent(tree->cv, pair[0], pair[1], 0);
+}
+static void *blake3_pool_main(void *const arg) {
+	pthread_mutex_lock(blake3_pool_lock);
+	for(;;) {
+		while(!blake3_pool_head) {
+			pthread_cond_wait(blake3_pool_work, blake3_pool_lock);
+		}
+		struct blake3_task *const task = blake3_pool_head;
+		blake3_pool_head = task->next;
+		task->taken = true;
+		pthread_mutex_unlock(blake3_pool_lock);
+		blake3_subtree_cv(task->tree);
+		pthread_mutex_lock(blake3_pool_lock);
+		task->done = true;
+		pthread_cond_broadcast(blake3_pool_done);
+	}
+	return NULL;
+}
+static void blake3_pool_init(void) {
+	long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t depth = 0;
+	while(depth < BLAKE3_FORK_DEPTH_MAX && cpus >= (2L << depth)) depth++;
+	// The caller is busy too, so one less than the number of subtrees.
+	size_t const max = ((size_t)1 << depth) - 1;
+	for(size_t i = 0; i < max; i++) {
+		pthread_t thread;
+		if(0 != pthread_create(&thread, NULL, blake3_pool_main, NULL)) break;
+		pthread_detach(thread);
+		blake3_pool_threads++;
+	}
+	if(blake3_pool_threads) blake3_fork_depth = depth;
+}
+static void blake3_subtree_pair(struct blake3_subtree *const tree, uint32_t (*const out)[8]) {
+	size_t const half = tree->chunks / 2;
+	size_t const depth = tree->depth ? tree->depth-1 : 0;
+	struct blake3_subtree left[1] = {{
+		.input = tree->input,
+		.chunks = half,
+		.counter = tree->counter,
+		.depth = depth,
+	}};
+	struct blake3_subtree right[1] = {{
+		.input = tree->input + half*BLAKE3_CHUNK,
+		.chunks = half,
+		.counter = tree->counter + half,
+		.depth = depth,
+	}};
+	if(!tree->depth || half*BLAKE3_CHUNK < BLAKE3_PARALLEL_MIN) {
+		blake3_subtree_cv(left);
+		blake3_subtree_cv(right);
+	} else {
+		struct blake3_task task[1] = {{
+			.tree = left,
+			.taken = false,
+			.done = false,
+			.next = NULL,
+		}};
+		pthread_mutex_lock(blake3_pool_lock);
+		task->next = blake3_pool_head;
+		blake3_pool_head = task;
+		pthread_cond_signal(blake3_pool_work);
+		pthread_mutex_unlock(blake3_pool_lock);
+
+		blake3_subtree_cv(right);
+
+		pthread_mutex_lock(blake3_pool_lock);
+		if(!task->taken) {
+			struct blake3_task **x = &blake3_pool_head;
+			while(*x != task) x = &(*x)->next;
+			*x = task->next;
+		}
+		while(task->taken && !task->done) {
+			pthread_cond_wait(blake3_pool_done, blake3_pool_lock);
+		}
+		pthread_mutex_unlock(blake3_pool_lock);
+		if(!task->taken) blake3_subtree_cv(left);
+	}
+	memcpy(out[0], left->cv, 32);
+	memcpy(out[1], right->cv, 32);
+}
+
+static void blake3_chunk_reset(BLAKE3_CHUNK_STATE *const s, uint64_t const counter) {
+	memcpy(s->cv, blake3_iv, 32);
+	s->counter = counter;
+	memset(s->buf, 0, sizeof(s->buf));
+	s->num = 0;
+	s->blocks = 0;
+}
+static size_t blake3_chunk_len(BLAKE3_CHUNK_STATE const *const s) {
+	return s->blocks*BLAKE3_BLOCK + s->num;
+}
+static uint32_t blake3_chunk_flags(BLAKE3_CHUNK_STATE const *const s) {
+	return 0 == s->blocks ? CHUNK_START : 0;
+}
+static void blake3_chunk_update(BLAKE3_CHUNK_STATE *const s, unsigned char const *p, size_t rem) {
+	while(rem) {
+		if(BLAKE3_BLOCK == s->num) {
+			uint32_t m[16];
+			blake3_load_block(m, s->buf);
+			blake3_compress(s->cv, m, BLAKE3_BLOCK, s->counter, blake3_chunk_flags(s));
+			s->blocks++;
+			s->num = 0;
+			memset(s->buf, 0, sizeof(s->buf));
+		}
+		size_t x = BLAKE3_BLOCK - s->num;
+		if(x > rem) x = rem;
+		memcpy(s->buf + s->num, p, x);
+		s->num += x;
+		p += x;
+		rem -= x;
+	}
+}
+
+// The last compression is deferred so that it can be flagged as the root.
+struct blake3_output {
+	uint32_t cv[8];
+	uint32_t m[16];
+	uint32_t len;
+	uint64_t counter;
+	uint32_t flags;
+};
+static void blake3_chunk_output(BLAKE3_CHUNK_STATE const *const s, struct blake3_output *const out) {
+	memcpy(out->cv, s->cv, 32);
+	blake3_load_block(out->m, s->buf);
+	out->len = s->num;
+	out->counter = s->counter;
+	out->flags = blake3_chunk_flags(s) | CHUNK_END;
+}
+static void blake3_parent_output(uint32_t const *const left, uint32_t const *const right, struct blake3_output *const out) {
+	memcpy(out->cv, blake3_iv, 32);
+	memcpy(out->m+0, left, 32);
+	memcpy(out->m+8, right, 32);
+	out->len = BLAKE3_BLOCK;
+	out->counter = 0;
+	out->flags = PARENT;
+}
+static void blake3_output_cv(struct blake3_output const *const out, uint32_t *const cv) {
+	memcpy(cv, out->cv, 32);
+	blake3_compress(cv, out->m, out->len, out->counter, out->flags);
+}
+
+// CVs are merged lazily, so that the last two can still become the root.
+static void blake3_merge(BLAKE3_CTX *const c, uint64_t const total) {
+	size_t const post = __builtin_popcountll(total);
+	while(c->depth > post) {
+		blake3_parent(c->stack[c->depth-2], c->stack[c->depth-2], c->stack[c->depth-1], 0);
+		c->depth--;
+	}
+}
+static void blake3_push(BLAKE3_CTX *const c, uint32_t const *const cv, uint64_t const counter) {
+	blake3_merge(c, counter);
+	assert(c->depth <= BLAKE3_STACK_MAX);
+	memcpy(c->stack[c->depth++], cv, 32);
+}
+
+int BLAKE3_Init(BLAKE3_CTX *const c) {
+	assert(c);
+	blake3_chunk_reset(&c->chunk, 0);
+	c->depth = 0;
+	return 1;
+}
+static void blake3_update(BLAKE3_CTX *const c, void const *const data, size_t const len, bool const parallel) {
+	unsigned char const *p = data;
+	size_t rem = len;
+
+	if(blake3_chunk_len(&c->chunk)) {
+		size_t x = BLAKE3_CHUNK - blake3_chunk_len(&c->chunk);
+		if(x > rem) x = rem;
+		blake3_chunk_update(&c->chunk, p, x);
+		p += x;
+		rem -= x;
+		if(!rem) return;
+		struct blake3_output out[1];
+		uint32_t cv[8];
+		blake3_chunk_output(&c->chunk, out);
+		blake3_output_cv(out, cv);
+		blake3_push(c, cv, c->chunk.counter);
+		blake3_chunk_reset(&c->chunk, c->chunk.counter+1);
+	}
+
+	// Hash the largest whole subtrees we can, keeping at least
+	// one byte back in case this is the end of the input.
+	while(rem > BLAKE3_CHUNK) {
+		size_t x = (size_t)1 << (sizeof(unsigned long long)*8-1 - __builtin_clzll(rem));
+		uint64_t const pos = c->chunk.counter * BLAKE3_CHUNK;
+		while((x-1) & pos) x /= 2;
+		size_t const chunks = x / BLAKE3_CHUNK;
+		if(1 == chunks) {
+			uint32_t cv[1][8];
+			blake3_chunks(p, 1, c->chunk.counter, cv);
+			blake3_push(c, cv[0], c->chunk.counter);
+		} else {
+			struct blake3_subtree tree[1] = {{
+				.input = p,
+				.chunks = chunks,
+				.counter = c->chunk.counter,
+				.depth = parallel && x >= BLAKE3_PARALLEL_MIN*2 ? blake3_fork_depth : 0,
+			}};
+			uint32_t pair[2][8];
+			blake3_subtree_pair(tree, pair);
+			blake3_push(c, pair[0], c->chunk.counter);
+			blake3_push(c, pair[1], c->chunk.counter + chunks/2);
+		}
+		c->chunk.counter += chunks;
+		p += x;
+		rem -= x;
+	}
+
+	if(rem) {
+		blake3_merge(c, c->chunk.counter);
+		blake3_chunk_update(&c->chunk, p, rem);
+	}
+}
+int BLAKE3_Update(BLAKE3_CTX *const c, void const *const data, size_t const len) {
+	assert(c);
+	blake3_update(c, data, len, false);
+	return 1;
+}
+int BLAKE3_Update_parallel(BLAKE3_CTX *const c, void const *const data, size_t const len) {
+	assert(c);
+	pthread_once(&blake3_pool_once, blake3_pool_init);
+	blake3_update(c, data, len, true);
+	return 1;
+}
+int BLAKE3_Final(unsigned char *const md, BLAKE3_CTX *const c) {
+	assert(md);
+	assert(c);
+	struct blake3_output out[1];
+	size_t rem = c->depth;
+	if(0 == c->depth || blake3_chunk_len(&c->chunk)) {
+		blake3_chunk_output(&c->chunk, out);
+	} else {
+		rem = c->depth-2;
+		blake3_parent_output(c->stack[rem], c->stack[rem+1], out);
+	}
+	while(rem) {
+		rem--;
+		uint32_t cv[8];
+		blake3_output_cv(out, cv);
+		blake3_parent_output(c->stack[rem], cv, out);
+	}
+	uint32_t root[8];
+	memcpy(root, out->cv, 32);
+	blake3_compress(root, out->m, out->len, 0, out->flags | ROOT);
+	for(size_t i = 0; i < 8; i++) store32(md + i*4, root[i]);
+	return 1;
+}
+
@@ -0,0 +1,39 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Unkeyed BLAKE3 with a 32-byte digest.
+// Same calling conventions as OpenSSL (return 1 on success).
+
+// Chunks are hashed eight at a time using SIMD. BLAKE3_Update_parallel()
+// also splits large updates into subtrees, which are hashed on a shared
+// set of threads. It's only worth it for updates of 512KB or more.
+
+#define BLAKE3_BLOCK 64
+#define BLAKE3_CHUNK 1024
+#define BLAKE3_DIGEST_LENGTH 32
+#define BLAKE3_STACK_MAX 54
+
+typedef struct {
+	uint32_t cv[8];
+	uint64_t counter; // Chunk index
+	unsigned char buf[BLAKE3_BLOCK];
+	size_t num;
+	size_t blocks; // Compressed within this chunk
+} BLAKE3_CHUNK_STATE;
+typedef struct {
+	BLAKE3_CHUNK_STATE chunk;
+	uint32_t stack[BLAKE3_STACK_MAX+1][8];
+	size_t depth;
+} BLAKE3_CTX;
+int BLAKE3_Init(BLAKE3_CTX *const c);
+int BLAKE3_Update(BLAKE3_CTX *const c, void const *const data, size_t const len);
+int BLAKE3_Update_parallel(BLAKE3_CTX *const c, void const *const data, size_t const len);
+int BLAKE3_Final(unsigned char *const md, BLAKE3_CTX *const c);
+
+#endif
@@ -22,14 +22,34 @@
 })
 #define STR_LEN(x) (x), (sizeof(x)-1)
 
-static int const multihash_algo_encode[HASH_ALGO_MAX] = {
+// Codes are unsigned varints, per the multicodec table.
+static uint64_t const multihash_algo_encode[HASH_ALGO_MAX] = {
 	[HASH_ALGO_SHA1] = 0x11,
 	[HASH_ALGO_SHA256] = 0x12,
 	[HASH_ALGO_SHA512] = 0x13,
 //	[HASH_ALGO_SHA3] = 0x14,
-//	[HASH_ALGO_BLAKE2B] = 0x40,
-//	[HASH_ALGO_BLAKE2S] = 0x41,
+	[HASH_ALGO_BLAKE3] = 0x1e,
+	[HASH_ALGO_BLAKE2B] = 0xb240, // blake2b-512
+	[HASH_ALGO_BLAKE2S] = 0xb260, // blake2s-256
 };
+#define MULTIHASH_VARINT_MAX 3
+
+static size_t multihash_varint_encode(uint64_t x, unsigned char *const out) {
+	size_t len = 0;
+	for(; x >= 0x80; x >>= 7) out[len++] = (x & 0x7f) | 0x80;
+	out[len++] = x;
+	return len;
+}
+static size_t multihash_varint_decode(unsigned char const *const buf, size_t const len, uint64_t *const out) {
+	uint64_t x = 0;
+	for(size_t i = 0; i < len && i < MULTIHASH_VARINT_MAX; i++) {
+		x |= (uint64_t)(buf[i] & 0x7f) << (i*7);
+		if(buf[i] & 0x80) continue;
+		*out = x;
+		return i+1;
+	}
+	return 0;
+}
 
 static int strnncasecmp(char const *const a, size_t const alen, char const *const b, size_t const blen) {
 	if(alen != blen) return -1;
@@ -199,23 +219,26 @@ int hash_uri_parse_multihash(char const *const URI, hash_uri_t *const out) {
 	rc = regexec(re, URI, numberof(m), m, 0);
 	if(0 != rc) return HASH_EPARSE;
 	out->type = LINK_MULTIHASH;
-	unsigned char tmp[2+HASH_DIGEST_MAX];
+	unsigned char tmp[MULTIHASH_VARINT_MAX+1+HASH_DIGEST_MAX];
 	ssize_t len = b58_decode(URI+m[0].rm_so, match_len(&m[0]), tmp, sizeof(tmp));
 	if(len < 0) return len;
-	if(len < 2) return HASH_EPARSE;
-	switch(tmp[0]) {
+	uint64_t code = 0;
+	size_t const hlen = multihash_varint_decode(tmp, len, &code);
+	if(!hlen || len < hlen+1) return HASH_EPARSE;
+	switch(code) {
 		case 0x11: out->algo = HASH_ALGO_SHA1; break;
 		case 0x12: out->algo = HASH_ALGO_SHA256; break;
 		case 0x13: out->algo = HASH_ALGO_SHA512; break;
 //		case 0x14: out->algo = HASH_ALGO_SHA3; break;
-//		case 0x40: out->algo = HASH_ALGO_BLAKE2B; break;
-//		case 0x41: out->algo = HASH_ALGO_BLAKE2S; break;
+		case 0x1e: out->algo = HASH_ALGO_BLAKE3; break;
+		case 0xb240: out->algo = HASH_ALGO_BLAKE2B; break;
+		case 0xb260: out->algo = HASH_ALGO_BLAKE2S; break;
 		default: return HASH_EPARSE;
 	}
-	out->buf = malloc(len-2+1);
+	out->buf = malloc(len-hlen-1+1);
 	if(!out->buf) return HASH_ENOMEM;
-	memcpy(out->buf, tmp+2, len-2);
-	out->len = len-2;
+	memcpy(out->buf, tmp+hlen+1, len-hlen-1);
+	out->len = len-hlen-1;
 	return 0;
 }
 int hash_uri_parse_ssb(char const *const URI, hash_uri_t *const out) {
@@ -277,13 +300,14 @@ int hash_uri_format(hash_uri_t const *const obj, char *const out, size_t const m
 		b64_encode(B64_URL, obj->buf, obj->len, b64, sizeof(b64));
 		return snprintf(out, max, "ni:///%s;%s", name, b64);
 	} case LINK_MULTIHASH: {
-		unsigned char tmp[2+HASH_DIGEST_MAX];
-		tmp[0] = multihash_algo_encode[obj->algo];
-		if(0 == tmp[0]) return HASH_ENOTSUP;
-		tmp[1] = hash_algo_digest_len(obj->algo);
-		memcpy(tmp+2, obj->buf, obj->len);
+		unsigned char tmp[MULTIHASH_VARINT_MAX+1+HASH_DIGEST_MAX];
+		uint64_t const code = multihash_algo_encode[obj->algo];
+		if(0 == code) return HASH_ENOTSUP;
+		size_t const hlen = multihash_varint_encode(code, tmp);
+		tmp[hlen] = hash_algo_digest_len(obj->algo);
+		memcpy(tmp+hlen+1, obj->buf, obj->len);
 		char b58[sizeof(tmp)*8/5+1+1];
-		b58_encode(tmp, 2+obj->len, b58, sizeof(b58));
+		b58_encode(tmp, hlen+1+obj->len, b58, sizeof(b58));
 		return snprintf(out, max, "%s", b58);
 	} case LINK_PREFIX: {
 		char b64[HASH_DIGEST_MAX*8/6+1+1];
@@ -455,12 +479,13 @@ size_t b58_encode(unsigned char const *const buf, size_t const len, char *const
 	return x;
 }
 ssize_t b58_decode(char const *const str, size_t const len, unsigned char *const out, size_t const max) {
-	// TODO: This library has funny handling of leading zeros.
-	// This fraction happens to work for full length SHA-256 hashes,
-	// but is probably broken in most other circumstances.
-	size_t x = MIN(max, len*6/8);
+	// This library right-aligns its output within the whole buffer
+	// and returns the canonical length, so we have to move it back.
+	size_t x = max;
 	bool success = b58tobin(out, &x, str, len);
 	if(!success) return HASH_EPARSE;
+	if(x > max) return HASH_EPARSE;
+	memmove(out, out+max-x, x);
 	return x;
 }
 
@@ -5,6 +5,7 @@
 #define HASH_H
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -20,8 +21,9 @@
 	XX( 2, SHA256,  32, "sha256") \
 	XX( 3, SHA384,  48, "sha384") \
 	XX( 4, SHA512,  64, "sha512") \
-/*	XX( 5, BLAKE2S, 32, "blake2s")*/ \
-/*	XX( 6, BLAKE2B, 64, "blake2b")*/
+	XX( 5, BLAKE2S, 32, "blake2s") \
+	XX( 6, BLAKE2B, 64, "blake2b") \
+	XX( 7, BLAKE3,  32, "blake3")
 
 #define HASH_DIGEST_MAX 64
 
@@ -93,10 +95,30 @@ typedef struct {
 	unsigned char buf[HASH_DIGEST_MAX];
 } hash_digest_t;
 typedef struct hasher_s hasher_t;
+// Picks the fastest available implementation of each algorithm,
+// after checking it against known answers. The exception is the
+// multi-buffer kernel, which is picked by policy on CPUs with wide
+// enough lanes and no SHA instructions, since it only wins under
+// concurrent load. Call once at startup, before creating any hashers.
+int hasher_init(void);
+char const *hasher_kernel_name(hash_algo const algo);
+double hasher_kernel_speed(hash_algo const algo); // Single-stream MB/s
+bool hasher_kernel_by_policy(hash_algo const algo); // Not by speed
 int hasher_create(uint64_t const algos, hasher_t **const out);
+// Runs each algorithm on its own thread, so hashing takes as long as
+// the slowest algorithm instead of all of them combined.
+// Only worthwhile for large inputs.
+int hasher_create_threaded(uint64_t const algos, hasher_t **const out);
 void hasher_free();
 int hasher_update(hasher_t *const hasher, unsigned char const *const buf, size_t const len);
 int hasher_digests(hasher_t *const hasher, hash_digest_t *const out, size_t const count);
+// A checkpoint is the raw context of each algorithm, so it's only
+// good for the build that wrote it. hasher_restore() checks that,
+// and only works on a hasher that hasn't been updated yet.
+#define HASHER_CHECKPOINT_MAX (1024*4)
+ssize_t hasher_checkpoint(hasher_t *const hasher, unsigned char *const out, size_t const max);
+int hasher_checkpoint_verify(uint64_t const algos, unsigned char const *const buf, size_t const len);
+int hasher_restore(hasher_t *const hasher, unsigned char const *const buf, size_t const len);
 
 enum {
 	HASH_EINVAL = -EINVAL,
@@ -0,0 +1,36 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#ifndef HASH_KERNEL_H
+#define HASH_KERNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "hash.h"
+
+// Internal interface between hasher.c and the hashing implementations.
+// Functions follow the OpenSSL conventions (return 1 on success).
+struct hash_kernel {
+	char const *name;
+	size_t size; // Context size
+	int (*init)(void *const ctx);
+	int (*update)(void *const ctx, unsigned char const *const buf, size_t const len);
+	int (*final)(unsigned char *const out, void *const ctx);
+};
+
+// hasher_mb.c
+// Returns the number of SIMD lanes, or 0 if unsupported.
+size_t hasher_mb_init(void);
+// Returns NULL for algorithms without a multi-buffer kernel.
+struct hash_kernel const *hasher_mb_kernel(hash_algo const algo);
+// Hashes buf in every lane at once, bypassing the engine, which hashes
+// a job alone with the scalar transform. Fills one digest per lane.
+#define HASHER_MB_LANES_MAX 16
+int hasher_mb_lanes_hash(hash_algo const algo, unsigned char const *const buf, size_t const len, hash_digest_t *const out);
+
+// hasher_shani.c
+bool hasher_shani_supported(void);
+// Returns NULL if the CPU lacks SHA extensions.
+struct hash_kernel const *hasher_shani_kernel(hash_algo const algo);
+
+#endif
@@ -2,56 +2,444 @@
 // MIT licensed (see LICENSE for details)
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <openssl/sha.h>
 #include <openssl/md5.h>
+#include <openssl/opensslv.h>
 #include "hash.h"
+#include "hash_kernel.h"
+#include "blake2.h"
+#include "blake3.h"
 
 typedef SHA_CTX SHA1_CTX;
 typedef SHA512_CTX SHA384_CTX;
 
+// In threaded mode, each algorithm runs on its own thread and consumes
+// a shared ring of buffers. Small updates are coalesced into full slots,
+// so the threads only synchronize once per slot. The slots are
+// contiguous, so a thread that falls behind can catch up with a
+// single update spanning several of them.
+#define HASHER_RING_SIZE 8
+#define HASHER_SLOT_SIZE (1024*512)
+
+// Startup benchmark for choosing between kernels.
+#define HASHER_BENCH_CHUNK (1024*64)
+#define HASHER_BENCH_PASSES 3
+
+// Checkpoint header: magic, OpenSSL and LibreSSL versions and the set
+// of algorithms. LibreSSL pins OPENSSL_VERSION_NUMBER for every release,
+// so its own version is needed to tell context layouts apart.
+#define HASHER_CHECKPOINT_MAGIC "hxc2"
+#define HASHER_CHECKPOINT_HEADER (4+8+8+8)
+#ifdef LIBRESSL_VERSION_NUMBER
+#define HASHER_LIBRESSL_VERSION LIBRESSL_VERSION_NUMBER
+#else
+#define HASHER_LIBRESSL_VERSION 0
+#endif
+
+#define XX(val, name, xlen, str) \
+	static int name##_init(void *const ctx) { \
+		return name##_Init(ctx); \
+	} \
+	static int name##_update(void *const ctx, unsigned char const *const buf, size_t const len) { \
+		return name##_Update(ctx, buf, len); \
+	} \
+	static int name##_final(unsigned char *const out, void *const ctx) { \
+		return name##_Final(out, ctx); \
+	}
+HASH_ALGOS(XX)
+#undef XX
+static int BLAKE3_update_parallel(void *const ctx, unsigned char const *const buf, size_t const len) {
+	return BLAKE3_Update_parallel(ctx, buf, len);
+}
+// OpenSSL, except for BLAKE2 and BLAKE3 which are our own.
+static struct hash_kernel const default_kernels[HASH_ALGO_MAX] = {
+#define XX(val, name, xlen, str) \
+	[(val)] = { "default", sizeof(name##_CTX), name##_init, name##_update, name##_final },
+	HASH_ALGOS(XX)
+#undef XX
+};
+// Fixed by hasher_init() before any hashers are created.
+static struct hash_kernel const *kernels[HASH_ALGO_MAX] = {
+#define XX(val, name, xlen, str) [(val)] = &default_kernels[(val)],
+	HASH_ALGOS(XX)
+#undef XX
+};
+// Used instead of the default kernel's update on threaded hashers,
+// since only they get updates big enough to split across threads.
+static int (*const parallel_updates[HASH_ALGO_MAX])(void *const ctx, unsigned char const *const buf, size_t const len) = {
+	[HASH_ALGO_BLAKE3] = BLAKE3_update_parallel,
+};
+static double speeds[HASH_ALGO_MAX] = {0}; // MB/s
+static bool by_policy[HASH_ALGO_MAX] = {0};
+
+// Known answers for "abc" and for a million "a"s. The latter is fed
+// in uneven pieces so both partial and bulk block paths get exercised.
+#define HASHER_KAT_MILLION 1000000
+static char const *const kat_abc[HASH_ALGO_MAX] = {
+	[HASH_ALGO_MD5] = "900150983cd24fb0d6963f7d28e17f72",
+	[HASH_ALGO_SHA1] = "a9993e364706816aba3e25717850c26c9cd0d89d",
+	[HASH_ALGO_SHA256] = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+	[HASH_ALGO_SHA384] = "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded163"
+		"1a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7",
+	[HASH_ALGO_SHA512] = "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+		"2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f",
+	[HASH_ALGO_BLAKE2S] = "508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982",
+	[HASH_ALGO_BLAKE2B] = "ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d1"
+		"7d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923",
+	[HASH_ALGO_BLAKE3] = "6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85",
+};
+static char const *const kat_million[HASH_ALGO_MAX] = {
+	[HASH_ALGO_MD5] = "7707d6ae4e027c70eea2a935c2296f21",
+	[HASH_ALGO_SHA1] = "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+	[HASH_ALGO_SHA256] = "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+	[HASH_ALGO_SHA384] = "9d0e1809716474cb086e834e310a4a1ced149e9c00f24852"
+		"7972cec5704c2a5b07b8b3dc38ecc4ebae97ddd87f3d8985",
+	[HASH_ALGO_SHA512] = "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb"
+		"de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b",
+	[HASH_ALGO_BLAKE2S] = "bec0c0e6cde5b67acb73b81f79a67a4079ae1c60dac9d2661af18e9f8b50dfa5",
+	[HASH_ALGO_BLAKE2B] = "98fb3efb7206fd19ebf69b6f312cf7b64e3b94dbe1a17107913975a793f177e1"
+		"d077609d7fba363cbba00d05f7aa4e4fa8715d6428104c0a75643b0ff3fd3eaf",
+	[HASH_ALGO_BLAKE3] = "616f575a1b58d4c9797d4217b9730ae5e6eb319d76edef6549b46f4efe31ff8b",
+};
+
+struct hasher_worker {
+	struct hasher_s *hasher;
+	size_t algo;
+	pthread_t thread;
+	uint64_t tail; // Slots consumed
+	int rc;
+};
+struct hasher_ring {
+	pthread_mutex_t lock[1];
+	pthread_cond_t cond[1];
+	unsigned char *buf; // All of the slots
+	unsigned char *slots[HASHER_RING_SIZE];
+	size_t lens[HASHER_RING_SIZE];
+	size_t fill; // Bytes written to the unpublished slot
+	uint64_t head; // Slots published
+	bool eof;
+	struct hasher_worker workers[HASH_ALGO_MAX];
+	size_t nworkers;
+};
 struct hasher_s {
 	void *state[HASH_ALGO_MAX];
+	struct hasher_ring *ring;
 };
 
+static void *hasher_worker_main(void *const arg);
+static void hasher_ring_stop(struct hasher_ring *const ring);
+
+static int kernel_hash(hash_algo const algo, struct hash_kernel const *const k, unsigned char const *const buf, size_t const len, size_t const chunk, hash_digest_t *const out) {
+	void *ctx = malloc(k->size);
+	if(!ctx) return HASH_ENOMEM;
+	int rc = k->init(ctx);
+	if(rc < 0) goto cleanup;
+	// Vary the piece size when hashing the same buffer repeatedly.
+	for(size_t pos = 0, i = 0; pos < len; i++) {
+		size_t x = chunk ? chunk : (i * 3989 % 10007) + 1;
+		if(x > len-pos) x = len-pos;
+		rc = k->update(ctx, buf+pos, x);
+		if(rc < 0) goto cleanup;
+		pos += x;
+	}
+	rc = k->final(out->buf, ctx);
+	if(rc < 0) goto cleanup;
+	out->len = hash_algo_digest_len(algo);
+cleanup:
+	free(ctx); ctx = NULL;
+	return rc;
+}
+static int kernel_check(hash_algo const algo, struct hash_kernel const *const k, unsigned char const *const million) {
+	char const *const expected[] = { kat_abc[algo], kat_million[algo] };
+	for(size_t i = 0; i < numberof(expected); i++) {
+		if(!expected[i]) return HASH_EPANIC;
+		hash_digest_t digest[1];
+		char hex[HASH_DIGEST_MAX*2+1];
+		int rc = 0 == i ?
+			kernel_hash(algo, k, (unsigned char const *)"abc", 3, 0, digest) :
+			kernel_hash(algo, k, million, HASHER_KAT_MILLION, 0, digest);
+		if(rc < 0) return rc;
+		hex_encode(digest->buf, digest->len, hex, sizeof(hex));
+		if(0 != strcmp(hex, expected[i])) return HASH_EPANIC;
+	}
+	return 0;
+}
+// Every lane has to match, since a bad one would go unnoticed until
+// the engine is busy enough to use it.
+static int kernel_check_lanes(hash_algo const algo, size_t const lanes, unsigned char const *const million) {
+	char const *const expected[] = { kat_abc[algo], kat_million[algo] };
+	for(size_t i = 0; i < numberof(expected); i++) {
+		hash_digest_t digests[HASHER_MB_LANES_MAX];
+		char hex[HASH_DIGEST_MAX*2+1];
+		int rc = 0 == i ?
+			hasher_mb_lanes_hash(algo, (unsigned char const *)"abc", 3, digests) :
+			hasher_mb_lanes_hash(algo, million, HASHER_KAT_MILLION, digests);
+		if(rc < 0) return rc;
+		for(size_t l = 0; l < lanes; l++) {
+			hex_encode(digests[l].buf, digests[l].len, hex, sizeof(hex));
+			if(0 != strcmp(hex, expected[i])) return HASH_EPANIC;
+		}
+	}
+	return 0;
+}
+static double kernel_bench(hash_algo const algo, struct hash_kernel const *const k, unsigned char const *const buf, size_t const len) {
+	double best = 0;
+	for(size_t i = 0; i < HASHER_BENCH_PASSES; i++) {
+		struct timespec start[1], end[1];
+		hash_digest_t digest[1];
+		clock_gettime(CLOCK_MONOTONIC, start);
+		int rc = kernel_hash(algo, k, buf, len, HASHER_BENCH_CHUNK, digest);
+		clock_gettime(CLOCK_MONOTONIC, end);
+		if(rc < 0) return 0;
+		double const secs = (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+		if(secs <= 0) continue;
+		double const speed = len / (1024.0*1024.0) / secs;
+		if(speed > best) best = speed;
+	}
+	return best;
+}
+
+int hasher_init(void) {
+	unsigned char *buf = malloc(HASHER_KAT_MILLION);
+	if(!buf) return HASH_ENOMEM;
+	memset(buf, 'a', HASHER_KAT_MILLION);
+	int rc = 0;
+
+	// Multi-buffer only pays off once the lanes are wider than
+	// the speedup of OpenSSL's own assembly over portable C,
+	// and never beats dedicated SHA instructions.
+	size_t const lanes = hasher_mb_init();
+	bool const mb = lanes >= 8 && !hasher_shani_supported();
+
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		struct hash_kernel const *const candidates[] = {
+			&default_kernels[i],
+			hasher_shani_kernel(i),
+			mb ? hasher_mb_kernel(i) : NULL,
+		};
+		struct hash_kernel const *best = NULL;
+		double best_speed = 0;
+		for(size_t j = 0; j < numberof(candidates); j++) {
+			struct hash_kernel const *const k = candidates[j];
+			if(!k) continue;
+			// The multi-buffer kernel is only faster under concurrent
+			// load, which a single-stream benchmark can't show, so it's
+			// chosen by policy rather than by speed.
+			bool const preferred = mb && k == candidates[2];
+			rc = kernel_check(i, k, buf);
+			if(rc >= 0 && preferred) rc = kernel_check_lanes(i, lanes, buf);
+			if(HASH_EPANIC == rc) continue;
+			if(rc < 0) goto cleanup;
+			double const speed = kernel_bench(i, k, buf, HASHER_KAT_MILLION);
+			if(best && speed <= best_speed && !preferred) continue;
+			best = k;
+			best_speed = speed;
+			by_policy[i] = preferred;
+		}
+		if(!best) {
+			rc = HASH_EPANIC;
+			goto cleanup;
+		}
+		kernels[i] = best;
+		speeds[i] = best_speed;
+	}
+	rc = 0;
+cleanup:
+	free(buf); buf = NULL;
+	return rc;
+}
+char const *hasher_kernel_name(hash_algo const algo) {
+	if(algo < 0 || algo >= HASH_ALGO_MAX) return NULL;
+	return kernels[algo]->name;
+}
+double hasher_kernel_speed(hash_algo const algo) {
+	if(algo < 0 || algo >= HASH_ALGO_MAX) return 0;
+	return speeds[algo];
+}
+bool hasher_kernel_by_policy(hash_algo const algo) {
+	if(algo < 0 || algo >= HASH_ALGO_MAX) return false;
+	return by_policy[algo];
+}
+
 int hasher_create(uint64_t const algos, hasher_t **const out) {
 	assert(out);
 	hasher_t *hasher = calloc(1, sizeof(struct hasher_s));
 	if(!hasher) return HASH_ENOMEM;
 	int rc = 0;
-#define XX(val, name, xlen, str) \
-	if(1 << (val) & algos) { \
-		hasher->state[(val)] = malloc(sizeof(name##_CTX)); \
-		if(!hasher->state[(val)]) rc = HASH_ENOMEM; \
-		if(rc < 0) goto cleanup; \
-		rc = name##_Init(hasher->state[(val)]); \
-		if(rc < 0) goto cleanup; \
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(!(1ull << i & algos)) continue;
+		hasher->state[i] = malloc(kernels[i]->size);
+		if(!hasher->state[i]) rc = HASH_ENOMEM;
+		if(rc < 0) goto cleanup;
+		rc = kernels[i]->init(hasher->state[i]);
+		if(rc < 0) goto cleanup;
 	}
-	HASH_ALGOS(XX)
-#undef XX
 	*out = hasher; hasher = NULL;
 cleanup:
 	hasher_free(&hasher);
 	return rc;
 }
+int hasher_create_threaded(uint64_t const algos, hasher_t **const out) {
+	assert(out);
+	hasher_t *hasher = NULL;
+	struct hasher_ring *ring = NULL;
+	int rc = hasher_create(algos, &hasher);
+	if(rc < 0) goto cleanup;
+
+	ring = calloc(1, sizeof(struct hasher_ring));
+	if(!ring) rc = HASH_ENOMEM;
+	if(rc < 0) goto cleanup;
+	ring->buf = malloc(HASHER_RING_SIZE*HASHER_SLOT_SIZE);
+	if(!ring->buf) rc = HASH_ENOMEM;
+	if(rc < 0) goto cleanup;
+	for(size_t i = 0; i < HASHER_RING_SIZE; i++) {
+		ring->slots[i] = ring->buf + i*HASHER_SLOT_SIZE;
+	}
+	rc = pthread_mutex_init(ring->lock, NULL);
+	if(0 != rc) { rc = -rc; goto cleanup; }
+	rc = pthread_cond_init(ring->cond, NULL);
+	if(0 != rc) { rc = -rc; pthread_mutex_destroy(ring->lock); goto cleanup; }
+	hasher->ring = ring; ring = NULL;
+
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(!hasher->state[i]) continue;
+		struct hasher_worker *const w = &hasher->ring->workers[hasher->ring->nworkers];
+		w->hasher = hasher;
+		w->algo = i;
+		rc = pthread_create(&w->thread, NULL, hasher_worker_main, w);
+		if(0 != rc) { rc = -rc; goto cleanup; }
+		hasher->ring->nworkers++;
+	}
+
+	*out = hasher; hasher = NULL;
+cleanup:
+	if(ring) free(ring->buf);
+	free(ring); ring = NULL;
+	hasher_free(&hasher);
+	return rc;
+}
 void hasher_free(hasher_t **const hasherptr) {
 	hasher_t *hasher = *hasherptr; *hasherptr = NULL;
 	if(!hasher) return;
-#define XX(val, name, xlen, str) \
-	free(hasher->state[(val)]); hasher->state[(val)] = NULL;
-	HASH_ALGOS(XX)
-#undef XX
+	if(hasher->ring) {
+		hasher_ring_stop(hasher->ring);
+		pthread_mutex_destroy(hasher->ring->lock);
+		pthread_cond_destroy(hasher->ring->cond);
+		free(hasher->ring->buf); hasher->ring->buf = NULL;
+		free(hasher->ring); hasher->ring = NULL;
+	}
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		free(hasher->state[i]); hasher->state[i] = NULL;
+	}
 	free(hasher); hasher = NULL;
 }
+
+static void *hasher_worker_main(void *const arg) {
+	struct hasher_worker *const w = arg;
+	struct hasher_ring *const ring = w->hasher->ring;
+	void *const state = w->hasher->state[w->algo];
+	int (*update)(void *const, unsigned char const *const, size_t const) = kernels[w->algo]->update;
+	if(parallel_updates[w->algo] && kernels[w->algo] == &default_kernels[w->algo]) {
+		update = parallel_updates[w->algo];
+	}
+	pthread_mutex_lock(ring->lock);
+	for(;;) {
+		while(w->tail == ring->head && !ring->eof) {
+			pthread_cond_wait(ring->cond, ring->lock);
+		}
+		if(w->tail == ring->head) break;
+		// Take every published slot up to the end of the buffer,
+		// as long as they're full and so contiguous.
+		size_t const x = w->tail % HASHER_RING_SIZE;
+		size_t n = 0, len = 0;
+		while(w->tail+n < ring->head && x+n < HASHER_RING_SIZE) {
+			len += ring->lens[x+n];
+			n++;
+			if(HASHER_SLOT_SIZE != ring->lens[x+n-1]) break;
+		}
+		pthread_mutex_unlock(ring->lock);
+		// Keep draining after an error so the producer never stalls.
+		if(w->rc >= 0) w->rc = update(state, ring->slots[x], len);
+		pthread_mutex_lock(ring->lock);
+		w->tail += n;
+		pthread_cond_broadcast(ring->cond);
+	}
+	pthread_mutex_unlock(ring->lock);
+	return NULL;
+}
+static uint64_t hasher_ring_tail(struct hasher_ring *const ring) {
+	uint64_t tail = ring->head;
+	for(size_t i = 0; i < ring->nworkers; i++) {
+		if(ring->workers[i].tail < tail) tail = ring->workers[i].tail;
+	}
+	return tail;
+}
+static void hasher_ring_publish(struct hasher_ring *const ring) {
+	if(!ring->fill) return;
+	pthread_mutex_lock(ring->lock);
+	ring->lens[ring->head % HASHER_RING_SIZE] = ring->fill;
+	ring->head++;
+	ring->fill = 0;
+	pthread_cond_broadcast(ring->cond);
+	pthread_mutex_unlock(ring->lock);
+}
+static void hasher_ring_write(struct hasher_ring *const ring, unsigned char const *const buf, size_t const len) {
+	size_t pos = 0;
+	while(pos < len) {
+		if(0 == ring->fill) {
+			// Wait for the slowest algorithm to free up the next slot.
+			pthread_mutex_lock(ring->lock);
+			while(ring->head - hasher_ring_tail(ring) >= HASHER_RING_SIZE) {
+				pthread_cond_wait(ring->cond, ring->lock);
+			}
+			pthread_mutex_unlock(ring->lock);
+		}
+		unsigned char *const slot = ring->slots[ring->head % HASHER_RING_SIZE];
+		size_t x = HASHER_SLOT_SIZE-ring->fill;
+		if(x > len-pos) x = len-pos;
+		memcpy(slot+ring->fill, buf+pos, x);
+		ring->fill += x;
+		pos += x;
+		if(HASHER_SLOT_SIZE == ring->fill) hasher_ring_publish(ring);
+	}
+}
+// Waits for every algorithm to catch up with what's been written so far.
+static void hasher_ring_sync(struct hasher_ring *const ring) {
+	hasher_ring_publish(ring);
+	pthread_mutex_lock(ring->lock);
+	while(hasher_ring_tail(ring) != ring->head) {
+		pthread_cond_wait(ring->cond, ring->lock);
+	}
+	pthread_mutex_unlock(ring->lock);
+}
+static void hasher_ring_stop(struct hasher_ring *const ring) {
+	pthread_mutex_lock(ring->lock);
+	ring->eof = true;
+	pthread_cond_broadcast(ring->cond);
+	pthread_mutex_unlock(ring->lock);
+	for(size_t i = 0; i < ring->nworkers; i++) {
+		pthread_join(ring->workers[i].thread, NULL);
+	}
+	ring->nworkers = 0;
+}
+
 int hasher_update(hasher_t *const hasher, unsigned char const *const buf, size_t const len) {
 	if(!hasher) return 0;
-#define XX(val, name, xlen, str) \
-	if(hasher->state[(val)]) { \
-		int rc = name##_Update(hasher->state[(val)], buf, len); \
-		if(rc < 0) return rc; \
+	if(hasher->ring) {
+		if(hasher->ring->eof) return HASH_EINVAL;
+		hasher_ring_write(hasher->ring, buf, len);
+		return 0;
+	}
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(!hasher->state[i]) continue;
+		int rc = kernels[i]->update(hasher->state[i], buf, len);
+		if(rc < 0) return rc;
 	}
-	HASH_ALGOS(XX)
-#undef XX
 	return 0;
 }
 int hasher_digests(hasher_t *const hasher, hash_digest_t *const out, size_t const count) {
@@ -60,14 +448,103 @@ int hasher_digests(hasher_t *const hasher, hash_digest_t *const out, size_t cons
 	for(size_t i = 0; i < count; i++) {
 		out[i].len = 0;
 	}
-#define XX(val, name, xlen, str) \
-	if((val) < count && hasher->state[(val)]) { \
-		int rc = name##_Final(out[(val)].buf, hasher->state[(val)]); \
-		if(rc < 0) return rc; \
-		out[(val)].len = (xlen); \
+	if(hasher->ring) {
+		struct hasher_ring *const ring = hasher->ring;
+		if(ring->eof) return HASH_EINVAL;
+		hasher_ring_publish(ring);
+		size_t const nworkers = ring->nworkers;
+		hasher_ring_stop(ring);
+		for(size_t i = 0; i < nworkers; i++) {
+			if(ring->workers[i].rc < 0) return ring->workers[i].rc;
+		}
+	}
+	for(size_t i = 0; i < HASH_ALGO_MAX && i < count; i++) {
+		if(!hasher->state[i]) continue;
+		int rc = kernels[i]->final(out[i].buf, hasher->state[i]);
+		if(rc < 0) return rc;
+		out[i].len = hash_algo_digest_len(i);
 	}
-	HASH_ALGOS(XX)
-#undef XX
 	return 0;
 }
 
+static void put64(unsigned char *const p, uint64_t const x) {
+	for(size_t i = 0; i < 8; i++) p[i] = x >> (i*8);
+}
+static uint64_t get64(unsigned char const *const p) {
+	uint64_t x = 0;
+	for(size_t i = 0; i < 8; i++) x |= (uint64_t)p[i] << (i*8);
+	return x;
+}
+ssize_t hasher_checkpoint(hasher_t *const hasher, unsigned char *const out, size_t const max) {
+	assert(out);
+	if(!hasher) return HASH_EINVAL;
+	if(hasher->ring) {
+		if(hasher->ring->eof) return HASH_EINVAL;
+		hasher_ring_sync(hasher->ring);
+		for(size_t i = 0; i < hasher->ring->nworkers; i++) {
+			if(hasher->ring->workers[i].rc < 0) return hasher->ring->workers[i].rc;
+		}
+	}
+	uint64_t algos = 0;
+	size_t len = HASHER_CHECKPOINT_HEADER;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(!hasher->state[i]) continue;
+		algos |= 1ull << i;
+		len += 8 + kernels[i]->size;
+	}
+	if(len > max) return HASH_ENOMEM;
+	unsigned char *p = out;
+	memcpy(p, HASHER_CHECKPOINT_MAGIC, 4); p += 4;
+	put64(p, OPENSSL_VERSION_NUMBER); p += 8;
+	put64(p, HASHER_LIBRESSL_VERSION); p += 8;
+	put64(p, algos); p += 8;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(!hasher->state[i]) continue;
+		put64(p, kernels[i]->size); p += 8;
+		memcpy(p, hasher->state[i], kernels[i]->size); p += kernels[i]->size;
+	}
+	assert(p == out+len);
+	return (ssize_t)len;
+}
+int hasher_checkpoint_verify(uint64_t const algos, unsigned char const *const buf, size_t const len) {
+	assert(buf || 0 == len);
+	unsigned char const *p = buf;
+	if(len < HASHER_CHECKPOINT_HEADER) return HASH_EINVAL;
+	if(0 != memcmp(p, HASHER_CHECKPOINT_MAGIC, 4)) return HASH_EINVAL;
+	p += 4;
+	if(OPENSSL_VERSION_NUMBER != get64(p)) return HASH_EINVAL;
+	p += 8;
+	if(HASHER_LIBRESSL_VERSION != get64(p)) return HASH_EINVAL;
+	p += 8;
+	uint64_t const mask = (1ull << HASH_ALGO_MAX) - 1;
+	if((get64(p) ^ algos) & mask) return HASH_EINVAL;
+	p += 8;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(!(1ull << i & algos)) continue;
+		if((size_t)(buf+len-p) < 8) return HASH_EINVAL;
+		if(kernels[i]->size != get64(p)) return HASH_EINVAL;
+		p += 8;
+		if((size_t)(buf+len-p) < kernels[i]->size) return HASH_EINVAL;
+		p += kernels[i]->size;
+	}
+	if(p != buf+len) return HASH_EINVAL;
+	return 0;
+}
+int hasher_restore(hasher_t *const hasher, unsigned char const *const buf, size_t const len) {
+	if(!hasher) return HASH_EINVAL;
+	uint64_t algos = 0;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(hasher->state[i]) algos |= 1ull << i;
+	}
+	int rc = hasher_checkpoint_verify(algos, buf, len);
+	if(rc < 0) return rc;
+	// Threaded workers only touch their state once a slot is published.
+	if(hasher->ring && (hasher->ring->head || hasher->ring->fill)) return HASH_EINVAL;
+	unsigned char const *p = buf + HASHER_CHECKPOINT_HEADER;
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		if(!hasher->state[i]) continue;
+		p += 8;
+		memcpy(hasher->state[i], p, kernels[i]->size); p += kernels[i]->size;
+	}
+	return 0;
+}
@@ -0,0 +1,372 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Multi-buffer hashing for MD5, SHA-1 and SHA-256.
+// Whole blocks submitted by concurrent hashers (one per fetch) are
+// interleaved across SIMD lanes, so throughput scales with vector width.
+// Whichever submitter finds the engine idle becomes the leader and runs
+// the lanes until its own job is done, picking up new jobs as they arrive.
+// A job alone in the engine is hashed with the scalar OpenSSL transform.
+
+// The contexts are the OpenSSL ones, so partial blocks and padding
+// are still handled by OpenSSL.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+#include "hash_kernel.h"
+
+#define MB_BLOCK 64
+#define MB_LANES_MAX HASHER_MB_LANES_MAX
+#define MB_WORDS_MAX 8
+// Smaller updates aren't worth a trip through the engine.
+#define MB_BLOCKS_MIN 16
+// Scalar work done per turn, so that new jobs can join the lanes.
+#define MB_SCALAR_SLICE 256
+
+static unsigned char const mb_zero_block[MB_BLOCK] = {0};
+
+static uint32_t const mb_md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static unsigned const mb_md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+static uint32_t const mb_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t mb_le32(unsigned char const *const p) {
+	return
+		(uint32_t)p[0] <<  0 |
+		(uint32_t)p[1] <<  8 |
+		(uint32_t)p[2] << 16 |
+		(uint32_t)p[3] << 24;
+}
+static inline uint32_t mb_be32(unsigned char const *const p) {
+	return
+		(uint32_t)p[0] << 24 |
+		(uint32_t)p[1] << 16 |
+		(uint32_t)p[2] <<  8 |
+		(uint32_t)p[3] <<  0;
+}
+
+#define MB_CAT2(a, b) a##b
+#define MB_CAT(a, b) MB_CAT2(a, b)
+
+#define MB_LANES 4
+#define MB_TARGET
+#define MB_NAME(x) MB_CAT(x, _x4)
+#include "hasher_mb_lanes.h"
+#undef MB_LANES
+#undef MB_TARGET
+#undef MB_NAME
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MB_X86 1
+
+#define MB_LANES 8
+#define MB_TARGET __attribute__((target("avx2")))
+#define MB_NAME(x) MB_CAT(x, _x8)
+#include "hasher_mb_lanes.h"
+#undef MB_LANES
+#undef MB_TARGET
+#undef MB_NAME
+
+#define MB_LANES 16
+#define MB_TARGET __attribute__((target("avx512f")))
+#define MB_NAME(x) MB_CAT(x, _x16)
+#include "hasher_mb_lanes.h"
+#undef MB_LANES
+#undef MB_TARGET
+#undef MB_NAME
+
+#endif
+
+typedef void (*mb_lanes_fn)(uint32_t *const state, unsigned char const *const *const data, size_t const n, size_t const blocks);
+
+struct mb_job {
+	void *ctx;
+	unsigned char const *data;
+	size_t blocks;
+	bool done;
+	struct mb_job *next;
+};
+struct mb_engine {
+	pthread_mutex_t lock[1];
+	pthread_cond_t cond[1];
+	struct mb_job *head;
+	struct mb_job **tail;
+	bool busy;
+	size_t words;
+	bool le; // Little-endian (MD5)
+	void (*iv)(uint32_t *const h);
+	void (*get)(void const *const ctx, uint32_t *const h);
+	void (*set)(void *const ctx, uint32_t const *const h);
+	void (*transform)(void *const ctx, unsigned char const *const block);
+	mb_lanes_fn lanes;
+};
+
+static size_t mb_width = 0;
+
+static void mb_run(struct mb_engine *const e, struct mb_job *const self) {
+	// Called with the lock held.
+	while(!self->done) {
+		struct mb_job *jobs[MB_LANES_MAX];
+		size_t n = 0;
+		while(n < mb_width && e->head) {
+			jobs[n++] = e->head;
+			e->head = e->head->next;
+		}
+		if(!e->head) e->tail = &e->head;
+		assert(n > 0);
+		pthread_mutex_unlock(e->lock);
+
+		if(1 == n) {
+			struct mb_job *const j = jobs[0];
+			size_t const x = j->blocks < MB_SCALAR_SLICE ? j->blocks : MB_SCALAR_SLICE;
+			for(size_t i = 0; i < x; i++) {
+				e->transform(j->ctx, j->data + i*MB_BLOCK);
+			}
+			j->data += x*MB_BLOCK;
+			j->blocks -= x;
+		} else {
+			uint32_t state[MB_WORDS_MAX*MB_LANES_MAX];
+			unsigned char const *data[MB_LANES_MAX];
+			size_t step = SIZE_MAX;
+			for(size_t l = 0; l < n; l++) {
+				uint32_t h[MB_WORDS_MAX];
+				e->get(jobs[l]->ctx, h);
+				for(size_t i = 0; i < e->words; i++) state[i*mb_width+l] = h[i];
+				data[l] = jobs[l]->data;
+				if(jobs[l]->blocks < step) step = jobs[l]->blocks;
+			}
+			e->lanes(state, data, n, step);
+			for(size_t l = 0; l < n; l++) {
+				uint32_t h[MB_WORDS_MAX];
+				for(size_t i = 0; i < e->words; i++) h[i] = state[i*mb_width+l];
+				e->set(jobs[l]->ctx, h);
+				jobs[l]->data += step*MB_BLOCK;
+				jobs[l]->blocks -= step;
+			}
+		}
+
+		pthread_mutex_lock(e->lock);
+		// Unfinished jobs go back to the front, in order.
+		struct mb_job *requeue = NULL;
+		for(size_t l = n; l-- > 0;) {
+			if(jobs[l]->blocks) {
+				jobs[l]->next = requeue;
+				requeue = jobs[l];
+			} else {
+				jobs[l]->done = true;
+			}
+		}
+		if(requeue) {
+			struct mb_job *last = requeue;
+			while(last->next) last = last->next;
+			last->next = e->head;
+			if(!e->head) e->tail = &last->next;
+			e->head = requeue;
+		}
+		pthread_cond_broadcast(e->cond);
+	}
+}
+static void mb_submit(struct mb_engine *const e, void *const ctx, unsigned char const *const data, size_t const blocks) {
+	struct mb_job job[1] = {{
+		.ctx = ctx,
+		.data = data,
+		.blocks = blocks,
+		.done = false,
+		.next = NULL,
+	}};
+	pthread_mutex_lock(e->lock);
+	if(!e->tail) e->tail = &e->head;
+	*e->tail = job;
+	e->tail = &job->next;
+	while(!job->done) {
+		if(e->busy) {
+			pthread_cond_wait(e->cond, e->lock);
+			continue;
+		}
+		e->busy = true;
+		mb_run(e, job);
+		e->busy = false;
+		pthread_cond_broadcast(e->cond);
+	}
+	pthread_mutex_unlock(e->lock);
+}
+
+// Bit counts are stored as two 32-bit halves, same as OpenSSL.
+static void mb_count(unsigned int *const Nl, unsigned int *const Nh, size_t const blocks) {
+	uint64_t const bits = ((uint64_t)*Nh << 32 | *Nl) + (uint64_t)blocks*MB_BLOCK*8;
+	*Nl = (unsigned int)(bits >> 0);
+	*Nh = (unsigned int)(bits >> 32);
+}
+
+#define MB_KERNEL(name, CTX, nwords, little, getter, setter) \
+	static void name##_mb_get(void const *const ctx, uint32_t *const h) { \
+		CTX const *const c = ctx; \
+		getter \
+	} \
+	static void name##_mb_set(void *const ctx, uint32_t const *const h) { \
+		CTX *const c = ctx; \
+		setter \
+	} \
+	static void name##_mb_iv(uint32_t *const h) { \
+		CTX c[1]; \
+		name##_Init(c); \
+		name##_mb_get(c, h); \
+	} \
+	static void name##_mb_transform(void *const ctx, unsigned char const *const block) { \
+		name##_Transform(ctx, block); \
+	} \
+	static struct mb_engine name##_mb_engine[1] = {{ \
+		.lock = { PTHREAD_MUTEX_INITIALIZER }, \
+		.cond = { PTHREAD_COND_INITIALIZER }, \
+		.words = (nwords), \
+		.le = (little), \
+		.iv = name##_mb_iv, \
+		.get = name##_mb_get, \
+		.set = name##_mb_set, \
+		.transform = name##_mb_transform, \
+	}}; \
+	static int name##_mb_init(void *const ctx) { \
+		return name##_Init(ctx); \
+	} \
+	static int name##_mb_update(void *const ctx, unsigned char const *const buf, size_t const len) { \
+		CTX *const c = ctx; \
+		unsigned char const *p = buf; \
+		size_t rem = len; \
+		if(c->num) { \
+			size_t const x = MB_BLOCK - c->num < rem ? MB_BLOCK - c->num : rem; \
+			int rc = name##_Update(c, p, x); \
+			if(rc < 0) return rc; \
+			p += x; \
+			rem -= x; \
+		} \
+		size_t const blocks = rem / MB_BLOCK; \
+		if(blocks >= MB_BLOCKS_MIN) { \
+			mb_submit(name##_mb_engine, c, p, blocks); \
+			mb_count(&c->Nl, &c->Nh, blocks); \
+			p += blocks*MB_BLOCK; \
+			rem -= blocks*MB_BLOCK; \
+		} \
+		if(rem) return name##_Update(c, p, rem); \
+		return 1; \
+	} \
+	static int name##_mb_final(unsigned char *const out, void *const ctx) { \
+		return name##_Final(out, ctx); \
+	}
+
+MB_KERNEL(MD5, MD5_CTX, 4, true,
+	h[0] = c->A; h[1] = c->B; h[2] = c->C; h[3] = c->D;,
+	c->A = h[0]; c->B = h[1]; c->C = h[2]; c->D = h[3];)
+MB_KERNEL(SHA1, SHA_CTX, 5, false,
+	h[0] = c->h0; h[1] = c->h1; h[2] = c->h2; h[3] = c->h3; h[4] = c->h4;,
+	c->h0 = h[0]; c->h1 = h[1]; c->h2 = h[2]; c->h3 = h[3]; c->h4 = h[4];)
+MB_KERNEL(SHA256, SHA256_CTX, 8, false,
+	for(size_t i = 0; i < 8; i++) h[i] = c->h[i];,
+	for(size_t i = 0; i < 8; i++) c->h[i] = h[i];)
+
+static struct mb_engine *const mb_engines[HASH_ALGO_MAX] = {
+	[HASH_ALGO_MD5] = MD5_mb_engine,
+	[HASH_ALGO_SHA1] = SHA1_mb_engine,
+	[HASH_ALGO_SHA256] = SHA256_mb_engine,
+};
+static struct hash_kernel const mb_kernels[HASH_ALGO_MAX] = {
+	[HASH_ALGO_MD5] = { "multi-buffer", sizeof(MD5_CTX), MD5_mb_init, MD5_mb_update, MD5_mb_final },
+	[HASH_ALGO_SHA1] = { "multi-buffer", sizeof(SHA_CTX), SHA1_mb_init, SHA1_mb_update, SHA1_mb_final },
+	[HASH_ALGO_SHA256] = { "multi-buffer", sizeof(SHA256_CTX), SHA256_mb_init, SHA256_mb_update, SHA256_mb_final },
+};
+
+size_t hasher_mb_init(void) {
+	if(mb_width) return mb_width;
+	size_t width = 4;
+	mb_lanes_fn md5 = mb_md5_x4, sha1 = mb_sha1_x4, sha256 = mb_sha256_x4;
+#ifdef MB_X86
+	if(__builtin_cpu_supports("avx512f")) {
+		width = 16;
+		md5 = mb_md5_x16; sha1 = mb_sha1_x16; sha256 = mb_sha256_x16;
+	} else if(__builtin_cpu_supports("avx2")) {
+		width = 8;
+		md5 = mb_md5_x8; sha1 = mb_sha1_x8; sha256 = mb_sha256_x8;
+	}
+#endif
+	MD5_mb_engine->lanes = md5;
+	SHA1_mb_engine->lanes = sha1;
+	SHA256_mb_engine->lanes = sha256;
+	mb_width = width;
+	return mb_width;
+}
+struct hash_kernel const *hasher_mb_kernel(hash_algo const algo) {
+	assert(mb_width);
+	if(algo < 0 || algo >= HASH_ALGO_MAX) return NULL;
+	if(!mb_kernels[algo].name) return NULL;
+	return &mb_kernels[algo];
+}
+
+int hasher_mb_lanes_hash(hash_algo const algo, unsigned char const *const buf, size_t const len, hash_digest_t *const out) {
+	assert(mb_width);
+	if(algo < 0 || algo >= HASH_ALGO_MAX) return HASH_EPANIC;
+	struct mb_engine *const e = mb_engines[algo];
+	if(!e) return HASH_EPANIC;
+	uint32_t state[MB_WORDS_MAX*MB_LANES_MAX];
+	unsigned char const *data[MB_LANES_MAX];
+	uint32_t h[MB_WORDS_MAX];
+	e->iv(h);
+	for(size_t l = 0; l < mb_width; l++) {
+		for(size_t i = 0; i < e->words; i++) state[i*mb_width+l] = h[i];
+	}
+
+	size_t const blocks = len / MB_BLOCK;
+	for(size_t l = 0; l < mb_width; l++) data[l] = buf;
+	e->lanes(state, data, mb_width, blocks);
+
+	// Padding is normally left to OpenSSL, so do it by hand here.
+	unsigned char tail[MB_BLOCK*2] = {0};
+	size_t const rem = len - blocks*MB_BLOCK;
+	size_t const tail_blocks = rem + 1 + 8 > MB_BLOCK ? 2 : 1;
+	uint64_t const bits = (uint64_t)len * 8;
+	unsigned char *const end = tail + tail_blocks*MB_BLOCK - 8;
+	memcpy(tail, buf + blocks*MB_BLOCK, rem);
+	tail[rem] = 0x80;
+	for(size_t i = 0; i < 8; i++) {
+		end[i] = bits >> (e->le ? i*8 : (7-i)*8);
+	}
+	for(size_t l = 0; l < mb_width; l++) data[l] = tail;
+	e->lanes(state, data, mb_width, tail_blocks);
+
+	for(size_t l = 0; l < mb_width; l++) {
+		for(size_t i = 0; i < e->words; i++) {
+			uint32_t const x = state[i*mb_width+l];
+			for(size_t j = 0; j < 4; j++) {
+				out[l].buf[i*4+j] = x >> (e->le ? j*8 : (3-j)*8);
+			}
+		}
+		out[l].len = e->words*4;
+	}
+	return 0;
+}
+
@@ -0,0 +1,144 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Multi-buffer compression functions for one vector width.
+// Included by hasher_mb.c once per width, with MB_LANES, MB_TARGET
+// and MB_NAME(x) defined.
+
+// State is word-major: state[word*MB_LANES + lane].
+// Lanes past n are fed zeros and their results discarded.
+
+#define MB_VEC MB_NAME(mb_vec)
+typedef uint32_t MB_VEC __attribute__((vector_size(MB_LANES*4)));
+
+#define MB_ROTL(x, n) (((x) << (n)) | ((x) >> (32-(n))))
+#define MB_ROTR(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+
+static MB_TARGET void MB_NAME(mb_md5)(uint32_t *const state, unsigned char const *const *const data, size_t const n, size_t const blocks) {
+	MB_VEC s[4];
+	for(size_t i = 0; i < 4; i++) memcpy(&s[i], &state[i*MB_LANES], sizeof(MB_VEC));
+	for(size_t b = 0; b < blocks; b++) {
+		uint32_t tmp[16*MB_LANES];
+		for(size_t l = 0; l < MB_LANES; l++) {
+			unsigned char const *const p = l < n ? data[l] + b*MB_BLOCK : mb_zero_block;
+			for(size_t t = 0; t < 16; t++) tmp[t*MB_LANES+l] = mb_le32(p + t*4);
+		}
+		MB_VEC m[16];
+		for(size_t t = 0; t < 16; t++) memcpy(&m[t], &tmp[t*MB_LANES], sizeof(MB_VEC));
+		MB_VEC a = s[0], b_ = s[1], c = s[2], d = s[3];
+		for(size_t t = 0; t < 64; t++) {
+			MB_VEC f;
+			size_t g;
+			if(t < 16) {
+				f = (b_ & c) | (~b_ & d);
+				g = t;
+			} else if(t < 32) {
+				f = (d & b_) | (~d & c);
+				g = (5*t + 1) % 16;
+			} else if(t < 48) {
+				f = b_ ^ c ^ d;
+				g = (3*t + 5) % 16;
+			} else {
+				f = c ^ (b_ | ~d);
+				g = (7*t) % 16;
+			}
+			f = f + a + mb_md5_k[t] + m[g];
+			a = d;
+			d = c;
+			c = b_;
+			b_ = b_ + MB_ROTL(f, mb_md5_r[t]);
+		}
+		s[0] += a; s[1] += b_; s[2] += c; s[3] += d;
+	}
+	for(size_t i = 0; i < 4; i++) memcpy(&state[i*MB_LANES], &s[i], sizeof(MB_VEC));
+}
+
+static MB_TARGET void MB_NAME(mb_sha1)(uint32_t *const state, unsigned char const *const *const data, size_t const n, size_t const blocks) {
+	MB_VEC s[5];
+	for(size_t i = 0; i < 5; i++) memcpy(&s[i], &state[i*MB_LANES], sizeof(MB_VEC));
+	for(size_t b = 0; b < blocks; b++) {
+		uint32_t tmp[16*MB_LANES];
+		for(size_t l = 0; l < MB_LANES; l++) {
+			unsigned char const *const p = l < n ? data[l] + b*MB_BLOCK : mb_zero_block;
+			for(size_t t = 0; t < 16; t++) tmp[t*MB_LANES+l] = mb_be32(p + t*4);
+		}
+		MB_VEC w[16];
+		for(size_t t = 0; t < 16; t++) memcpy(&w[t], &tmp[t*MB_LANES], sizeof(MB_VEC));
+		MB_VEC a = s[0], b_ = s[1], c = s[2], d = s[3], e = s[4];
+		for(size_t t = 0; t < 80; t++) {
+			if(t >= 16) {
+				MB_VEC const x = w[(t+13)&15] ^ w[(t+8)&15] ^ w[(t+2)&15] ^ w[t&15];
+				w[t&15] = MB_ROTL(x, 1);
+			}
+			MB_VEC f;
+			uint32_t k;
+			if(t < 20) {
+				f = (b_ & c) | (~b_ & d);
+				k = 0x5a827999;
+			} else if(t < 40) {
+				f = b_ ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if(t < 60) {
+				f = (b_ & c) | (b_ & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b_ ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+			MB_VEC const x = MB_ROTL(a, 5) + f + e + k + w[t&15];
+			e = d;
+			d = c;
+			c = MB_ROTL(b_, 30);
+			b_ = a;
+			a = x;
+		}
+		s[0] += a; s[1] += b_; s[2] += c; s[3] += d; s[4] += e;
+	}
+	for(size_t i = 0; i < 5; i++) memcpy(&state[i*MB_LANES], &s[i], sizeof(MB_VEC));
+}
+
+static MB_TARGET void MB_NAME(mb_sha256)(uint32_t *const state, unsigned char const *const *const data, size_t const n, size_t const blocks) {
+	MB_VEC s[8];
+	for(size_t i = 0; i < 8; i++) memcpy(&s[i], &state[i*MB_LANES], sizeof(MB_VEC));
+	for(size_t b = 0; b < blocks; b++) {
+		uint32_t tmp[16*MB_LANES];
+		for(size_t l = 0; l < MB_LANES; l++) {
+			unsigned char const *const p = l < n ? data[l] + b*MB_BLOCK : mb_zero_block;
+			for(size_t t = 0; t < 16; t++) tmp[t*MB_LANES+l] = mb_be32(p + t*4);
+		}
+		MB_VEC w[16];
+		for(size_t t = 0; t < 16; t++) memcpy(&w[t], &tmp[t*MB_LANES], sizeof(MB_VEC));
+		MB_VEC a = s[0], b_ = s[1], c = s[2], d = s[3];
+		MB_VEC e = s[4], f = s[5], g = s[6], h = s[7];
+		for(size_t t = 0; t < 64; t++) {
+			if(t >= 16) {
+				MB_VEC const w15 = w[(t+1)&15];
+				MB_VEC const w2 = w[(t+14)&15];
+				MB_VEC const s0 = MB_ROTR(w15, 7) ^ MB_ROTR(w15, 18) ^ (w15 >> 3);
+				MB_VEC const s1 = MB_ROTR(w2, 17) ^ MB_ROTR(w2, 19) ^ (w2 >> 10);
+				w[t&15] += s0 + w[(t+9)&15] + s1;
+			}
+			MB_VEC const S1 = MB_ROTR(e, 6) ^ MB_ROTR(e, 11) ^ MB_ROTR(e, 25);
+			MB_VEC const ch = (e & f) ^ (~e & g);
+			MB_VEC const t1 = h + S1 + ch + mb_sha256_k[t] + w[t&15];
+			MB_VEC const S0 = MB_ROTR(a, 2) ^ MB_ROTR(a, 13) ^ MB_ROTR(a, 22);
+			MB_VEC const maj = (a & b_) ^ (a & c) ^ (b_ & c);
+			MB_VEC const t2 = S0 + maj;
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b_;
+			b_ = a;
+			a = t1 + t2;
+		}
+		s[0] += a; s[1] += b_; s[2] += c; s[3] += d;
+		s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+	}
+	for(size_t i = 0; i < 8; i++) memcpy(&state[i*MB_LANES], &s[i], sizeof(MB_VEC));
+}
+
+#undef MB_ROTL
+#undef MB_ROTR
+#undef MB_VEC
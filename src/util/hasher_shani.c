@@ -0,0 +1,212 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// SHA-1 and SHA-256 using the x86 SHA extensions (SHA-NI).
+// Like the multi-buffer kernels, these only replace the compression
+// function and keep using the OpenSSL contexts for everything else.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+#include "hash_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHANI_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHANI_BLOCK 64
+
+#ifdef SHANI_X86
+
+#define SHANI_TARGET __attribute__((target("sha,ssse3,sse4.1")))
+
+static uint32_t const sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static SHANI_TARGET void sha256_shani(uint32_t *const state, unsigned char const *data, size_t blocks) {
+	__m128i const mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_loadu_si128((__m128i const *)&state[0]);
+	__m128i s1 = _mm_loadu_si128((__m128i const *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1); // CDAB
+	s1 = _mm_shuffle_epi32(s1, 0x1B); // EFGH
+	__m128i s0 = _mm_alignr_epi8(tmp, s1, 8); // ABEF
+	s1 = _mm_blend_epi16(s1, tmp, 0xF0); // CDGH
+
+	for(; blocks; blocks--, data += SHANI_BLOCK) {
+		__m128i const abef = s0, cdgh = s1;
+		__m128i w[4];
+#pragma GCC unroll 16
+		for(size_t i = 0; i < 16; i++) {
+			if(i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + i*16)), mask);
+			} else {
+				__m128i x = _mm_sha256msg1_epu32(w[i&3], w[(i+1)&3]);
+				x = _mm_add_epi32(x, _mm_alignr_epi8(w[(i+3)&3], w[(i+2)&3], 4));
+				w[i&3] = _mm_sha256msg2_epu32(x, w[(i+3)&3]);
+			}
+			__m128i msg = _mm_add_epi32(w[i&3], _mm_loadu_si128((__m128i const *)&sha256_k[i*4]));
+			s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			s0 = _mm_sha256rnds2_epu32(s0, s1, msg);
+		}
+		s0 = _mm_add_epi32(s0, abef);
+		s1 = _mm_add_epi32(s1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(s0, 0x1B); // FEBA
+	s1 = _mm_shuffle_epi32(s1, 0xB1); // DCHG
+	s0 = _mm_blend_epi16(tmp, s1, 0xF0); // DCBA
+	s1 = _mm_alignr_epi8(s1, tmp, 8); // HGFE
+	_mm_storeu_si128((__m128i *)&state[0], s0);
+	_mm_storeu_si128((__m128i *)&state[4], s1);
+}
+
+// The round function selector must be an immediate.
+#define SHA1_GROUPS(func) \
+	_Pragma("GCC unroll 5") \
+	for(size_t j = 0; j < 5; j++, i++) { \
+		if(i >= 4) { \
+			__m128i x = _mm_sha1msg1_epu32(w[i&3], w[(i+1)&3]); \
+			x = _mm_xor_si128(x, w[(i+2)&3]); \
+			w[i&3] = _mm_sha1msg2_epu32(x, w[(i+3)&3]); \
+		} \
+		__m128i const e = 0 == i ? \
+			_mm_add_epi32(e0, w[0]) : \
+			_mm_sha1nexte_epu32(e0, w[i&3]); \
+		e0 = abcd; \
+		abcd = _mm_sha1rnds4_epu32(abcd, e, (func)); \
+	}
+
+static SHANI_TARGET void sha1_shani(uint32_t *const state, unsigned char const *data, size_t blocks) {
+	__m128i const mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const *)state), 0x1B);
+	__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for(; blocks; blocks--, data += SHANI_BLOCK) {
+		__m128i const abcd_save = abcd, e0_save = e0;
+		__m128i w[4];
+		for(size_t i = 0; i < 4; i++) {
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + i*16)), mask);
+		}
+		size_t i = 0;
+		SHA1_GROUPS(0)
+		SHA1_GROUPS(1)
+		SHA1_GROUPS(2)
+		SHA1_GROUPS(3)
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#undef SHA1_GROUPS
+
+static void shani_count(unsigned int *const Nl, unsigned int *const Nh, size_t const blocks) {
+	uint64_t const bits = ((uint64_t)*Nh << 32 | *Nl) + (uint64_t)blocks*SHANI_BLOCK*8;
+	*Nl = (unsigned int)(bits >> 0);
+	*Nh = (unsigned int)(bits >> 32);
+}
+
+static int SHA1_shani_init(void *const ctx) {
+	return SHA1_Init(ctx);
+}
+static int SHA1_shani_update(void *const ctx, unsigned char const *const buf, size_t const len) {
+	SHA_CTX *const c = ctx;
+	unsigned char const *p = buf;
+	size_t rem = len;
+	if(c->num) {
+		size_t const x = SHANI_BLOCK - c->num < rem ? SHANI_BLOCK - c->num : rem;
+		int rc = SHA1_Update(c, p, x);
+		if(rc < 0) return rc;
+		p += x;
+		rem -= x;
+	}
+	size_t const blocks = rem / SHANI_BLOCK;
+	if(blocks) {
+		uint32_t h[5] = { c->h0, c->h1, c->h2, c->h3, c->h4 };
+		sha1_shani(h, p, blocks);
+		c->h0 = h[0]; c->h1 = h[1]; c->h2 = h[2]; c->h3 = h[3]; c->h4 = h[4];
+		shani_count(&c->Nl, &c->Nh, blocks);
+		p += blocks*SHANI_BLOCK;
+		rem -= blocks*SHANI_BLOCK;
+	}
+	if(rem) return SHA1_Update(c, p, rem);
+	return 1;
+}
+static int SHA1_shani_final(unsigned char *const out, void *const ctx) {
+	return SHA1_Final(out, ctx);
+}
+
+static int SHA256_shani_init(void *const ctx) {
+	return SHA256_Init(ctx);
+}
+static int SHA256_shani_update(void *const ctx, unsigned char const *const buf, size_t const len) {
+	SHA256_CTX *const c = ctx;
+	unsigned char const *p = buf;
+	size_t rem = len;
+	if(c->num) {
+		size_t const x = SHANI_BLOCK - c->num < rem ? SHANI_BLOCK - c->num : rem;
+		int rc = SHA256_Update(c, p, x);
+		if(rc < 0) return rc;
+		p += x;
+		rem -= x;
+	}
+	size_t const blocks = rem / SHANI_BLOCK;
+	if(blocks) {
+		uint32_t h[8];
+		for(size_t i = 0; i < 8; i++) h[i] = c->h[i];
+		sha256_shani(h, p, blocks);
+		for(size_t i = 0; i < 8; i++) c->h[i] = h[i];
+		shani_count(&c->Nl, &c->Nh, blocks);
+		p += blocks*SHANI_BLOCK;
+		rem -= blocks*SHANI_BLOCK;
+	}
+	if(rem) return SHA256_Update(c, p, rem);
+	return 1;
+}
+static int SHA256_shani_final(unsigned char *const out, void *const ctx) {
+	return SHA256_Final(out, ctx);
+}
+
+static struct hash_kernel const shani_kernels[HASH_ALGO_MAX] = {
+	[HASH_ALGO_SHA1] = { "sha-ni", sizeof(SHA_CTX), SHA1_shani_init, SHA1_shani_update, SHA1_shani_final },
+	[HASH_ALGO_SHA256] = { "sha-ni", sizeof(SHA256_CTX), SHA256_shani_init, SHA256_shani_update, SHA256_shani_final },
+};
+
+bool hasher_shani_supported(void) {
+	unsigned a, b, c, d;
+	if(!__get_cpuid(1, &a, &b, &c, &d)) return false;
+	if(!(c & bit_SSSE3) || !(c & bit_SSE4_1)) return false;
+	if(!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+	return !!(b & bit_SHA);
+}
+struct hash_kernel const *hasher_shani_kernel(hash_algo const algo) {
+	if(algo < 0 || algo >= HASH_ALGO_MAX) return NULL;
+	if(!shani_kernels[algo].name) return NULL;
+	if(!hasher_shani_supported()) return NULL;
+	return &shani_kernels[algo];
+}
+
+#else
+
+bool hasher_shani_supported(void) {
+	return false;
+}
+struct hash_kernel const *hasher_shani_kernel(hash_algo const algo) {
+	return NULL;
+}
+
+#endif
+
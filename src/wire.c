@@ -0,0 +1,182 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <string.h>
+#include <async/async.h>
+#include "util/hash.h"
+#include "util/strext.h"
+#include "db.h"
+#include "config.h"
+#include "wire.h"
+
+static int read_len(uv_stream_t *const stream, unsigned char *const out, size_t const len) {
+	assert(out);
+	if(!len) return 0;
+	ssize_t x = async_read(stream, out, len);
+	if(x < 0) return x;
+	if(x < len) return UV_EOF;
+	return 0;
+}
+int wire_read_uint8(uv_stream_t *const stream, uint8_t *const out) {
+	assert(out);
+	return read_len(stream, out, 1);
+}
+int wire_read_uint16(uv_stream_t *const stream, uint16_t *const out) {
+	assert(out);
+	unsigned char x[2];
+	int rc = read_len(stream, x, sizeof(x));
+	if(rc < 0) return rc;
+	*out =
+		(uint16_t)x[0] << 8 |
+		(uint16_t)x[1] << 0;
+	return 0;
+}
+int wire_read_uint64(uv_stream_t *const stream, uint64_t *const out) {
+	assert(out);
+	unsigned char x[8];
+	int rc = read_len(stream, x, sizeof(x));
+	if(rc < 0) return rc;
+	*out =
+		(uint64_t)x[0] << 56 |
+		(uint64_t)x[1] << 48 |
+		(uint64_t)x[2] << 40 |
+		(uint64_t)x[3] << 32 |
+		(uint64_t)x[4] << 24 |
+		(uint64_t)x[5] << 16 |
+		(uint64_t)x[6] <<  8 |
+		(uint64_t)x[7] <<  0;
+	return 0;
+}
+int wire_read_string(uv_stream_t *const stream, char *const out, size_t const max) {
+	assert(out);
+	assert(max > 0);
+	uint16_t len = 0;
+	int rc = wire_read_uint16(stream, &len);
+	if(rc < 0) return rc;
+	if(len+1 > max) return UV_EMSGSIZE;
+	rc = read_len(stream, (unsigned char *)out, len);
+	if(rc < 0) return rc;
+	out[len] = '\0';
+	return 0;
+}
+ssize_t wire_read_blob(uv_stream_t *const stream, unsigned char *const out, size_t const max) {
+	assert(out);
+	assert(max > 0);
+	uint16_t len = 0;
+	int rc = wire_read_uint16(stream, &len);
+	if(rc < 0) return rc;
+	if(len > max) return UV_EMSGSIZE;
+	rc = read_len(stream, out, len);
+	if(rc < 0) return rc;
+	return len;
+}
+static int read_response_rest(uv_stream_t *const stream, struct response *const out) {
+	uint64_t tmp;
+	uint16_t hcount;
+	int rc = wire_read_string(stream, out->url, sizeof(out->url));
+	if(rc < 0) return rc;
+	rc = wire_read_uint64(stream, &tmp);
+	if(rc < 0) return rc;
+	out->status = tmp - 0xffff;
+	rc = wire_read_string(stream, out->type, sizeof(out->type));
+	if(rc < 0) return rc;
+	rc = wire_read_uint64(stream, &out->length);
+	if(rc < 0) return rc;
+	out->etag[0] = '\0';
+	out->modified[0] = '\0';
+
+	rc = wire_read_uint16(stream, &hcount);
+	if(rc < 0) return rc;
+	for(size_t i = 0; i < MIN(hcount, HASH_ALGO_MAX); i++) {
+		ssize_t len = wire_read_blob(stream, out->digests[i].buf, HASH_DIGEST_MAX);
+		if(len < 0) return len;
+		// Remote workers send these too, so they can't be trusted.
+		if(0 != len && hash_algo_digest_len(i) != len) return UV_EPROTO;
+		out->digests[i].len = len;
+	}
+	for(size_t i = HASH_ALGO_MAX; i < hcount; i++) {
+		unsigned char discard[HASH_DIGEST_MAX];
+		ssize_t len = wire_read_blob(stream, discard, HASH_DIGEST_MAX);
+		if(len < 0) return len;
+	}
+	for(size_t i = hcount; i < HASH_ALGO_MAX; i++) {
+		out->digests[i].len = 0;
+	}
+	return 0;
+}
+int wire_read_response(uv_stream_t *const stream, struct response *const out) {
+	assert(out);
+	if(!stream) return UV_EINVAL;
+	int rc = wire_read_uint64(stream, &out->time);
+	if(rc < 0) return rc;
+	// Ending partway through a record isn't a clean end.
+	rc = read_response_rest(stream, out);
+	if(UV_EOF == rc) rc = UV_EPROTO;
+	return rc;
+}
+
+static unsigned char *write_len(struct wire_buf *const buf, size_t const len) {
+	assert(buf);
+	if(buf->rc < 0) return NULL;
+	if(len > WIRE_BUF_MAX - buf->len) {
+		buf->rc = UV_EMSGSIZE;
+		return NULL;
+	}
+	unsigned char *const x = buf->data + buf->len;
+	buf->len += len;
+	return x;
+}
+void wire_write_uint8(struct wire_buf *const buf, uint8_t const x) {
+	unsigned char *const out = write_len(buf, 1);
+	if(!out) return;
+	out[0] = x;
+}
+void wire_write_uint16(struct wire_buf *const buf, uint16_t const x) {
+	unsigned char *const out = write_len(buf, 2);
+	if(!out) return;
+	out[0] = x >> 8;
+	out[1] = x >> 0;
+}
+void wire_write_uint64(struct wire_buf *const buf, uint64_t const x) {
+	unsigned char *const out = write_len(buf, 8);
+	if(!out) return;
+	for(size_t i = 0; i < 8; i++) out[i] = x >> (56 - i*8);
+}
+void wire_write_string(struct wire_buf *const buf, strarg_t const str) {
+	size_t const len = str ? strlen(str) : 0;
+	wire_write_blob(buf, (unsigned char const *)str, len);
+}
+void wire_write_blob(struct wire_buf *const buf, unsigned char const *const data, size_t const len) {
+	if(len > UINT16_MAX) {
+		if(buf->rc >= 0) buf->rc = UV_EMSGSIZE;
+		return;
+	}
+	wire_write_uint16(buf, len);
+	unsigned char *const out = write_len(buf, len);
+	if(!out) return;
+	memcpy(out, data, len);
+}
+void wire_write_response(struct wire_buf *const buf, struct response const *const res) {
+	assert(res);
+	wire_write_uint64(buf, res->time);
+	wire_write_string(buf, res->url);
+	wire_write_uint64(buf, (uint64_t)(0xffff + res->status));
+	wire_write_string(buf, res->type);
+	wire_write_uint64(buf, res->length);
+	wire_write_uint16(buf, HASH_ALGO_MAX);
+	for(size_t i = 0; i < HASH_ALGO_MAX; i++) {
+		wire_write_blob(buf, res->digests[i].buf, res->digests[i].len);
+	}
+}
+int wire_flush(uv_stream_t *const stream, struct wire_buf *const buf) {
+	assert(buf);
+	int rc = buf->rc;
+	if(rc >= 0 && buf->len) {
+		uv_buf_t const x = uv_buf_init((char *)buf->data, buf->len);
+		rc = async_write(stream, &x, 1);
+	}
+	buf->len = 0;
+	buf->rc = 0;
+	return rc;
+}
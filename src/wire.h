@@ -0,0 +1,37 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <async/async.h>
+#include "common.h"
+
+struct response;
+
+// Big-endian integers and length-prefixed strings, as used by the
+// import socket and the worker protocol.
+
+int wire_read_uint8(uv_stream_t *const stream, uint8_t *const out);
+int wire_read_uint16(uv_stream_t *const stream, uint16_t *const out);
+int wire_read_uint64(uv_stream_t *const stream, uint64_t *const out);
+int wire_read_string(uv_stream_t *const stream, char *const out, size_t const max);
+ssize_t wire_read_blob(uv_stream_t *const stream, unsigned char *const out, size_t const max);
+// The import record: time, URL, status, type, length and digests.
+// Validators aren't part of it. Digests of the wrong length, or a
+// stream that ends partway through a record, are UV_EPROTO, and the
+// connection should be dropped. UV_EOF is a clean end.
+int wire_read_response(uv_stream_t *const stream, struct response *const out);
+
+// Writes are collected and sent with wire_flush(). The first error
+// sticks, so callers only need to check the flush.
+#define WIRE_BUF_MAX (1024*16)
+struct wire_buf {
+	size_t len;
+	int rc;
+	unsigned char data[WIRE_BUF_MAX];
+};
+void wire_write_uint8(struct wire_buf *const buf, uint8_t const x);
+void wire_write_uint16(struct wire_buf *const buf, uint16_t const x);
+void wire_write_uint64(struct wire_buf *const buf, uint64_t const x);
+void wire_write_string(struct wire_buf *const buf, strarg_t const str);
+void wire_write_blob(struct wire_buf *const buf, unsigned char const *const data, size_t const len);
+void wire_write_response(struct wire_buf *const buf, struct response const *const res);
+int wire_flush(uv_stream_t *const stream, struct wire_buf *const buf);
@@ -0,0 +1,272 @@
+// Copyright 2016 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Fetches and hashes URLs leased from a hash-archive server, so crawl
+// capacity can be added without more web servers. See lease.h.
+// Usage: hash-archive-worker [socket-path | ipv4:port] [workers]
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <async/async.h>
+#include "util/hash.h"
+#include "util/strext.h"
+#include "util/url.h"
+#include "db.h"
+#include "errors.h"
+#include "config.h"
+#include "conn_pool.h"
+#include "wire.h"
+
+#define WORKER_COUNT 16 // Default
+#define WORKER_CHECKPOINTS_MAX 16
+#define WORKER_RETRY_DELAY (1000*5)
+
+// fetch.c
+int url_fetch(strarg_t const URL, strarg_t const client, uint64_t const algos, struct response *const out);
+
+static strarg_t server_addr = CONFIG_LEASE_SOCKET_PATH;
+
+// fetch.c asks the database for validators and checkpoints. Here the
+// validators come with the lease, and checkpoints only live in memory,
+// which is still enough to resume a dropped connection.
+struct worker_job {
+	struct worker_job *next;
+	uint64_t lease;
+	uint64_t algos;
+	char URL[URI_MAX];
+	char client[255+1];
+	bool has_prev;
+	struct response prev[1];
+};
+struct worker_checkpoint {
+	struct worker_checkpoint *next;
+	char URL[URI_MAX];
+	struct checkpoint cp[1];
+};
+static struct worker_job *jobs = NULL; // In progress
+static struct worker_checkpoint *checkpoints = NULL; // Newest first
+
+int hx_validators_get(strarg_t const URL, struct response *const out) {
+	assert(out);
+	for(struct worker_job *job = jobs; job; job = job->next) {
+		if(!job->has_prev) continue;
+		if(0 != strcmp(job->URL, URL)) continue;
+		*out = *job->prev;
+		return 0;
+	}
+	return KVS_NOTFOUND;
+}
+static struct worker_checkpoint **checkpoint_find(strarg_t const URL) {
+	struct worker_checkpoint **x = &checkpoints;
+	for(; *x; x = &(*x)->next) {
+		if(0 == strcmp((*x)->URL, URL)) break;
+	}
+	return x;
+}
+int hx_checkpoint_get(strarg_t const URL, struct checkpoint *const out) {
+	assert(out);
+	struct worker_checkpoint *const x = *checkpoint_find(URL);
+	if(!x) return KVS_NOTFOUND;
+	*out = *x->cp;
+	return 0;
+}
+int hx_checkpoint_put(strarg_t const URL, struct checkpoint const *const cp) {
+	assert(cp);
+	struct worker_checkpoint **const x = checkpoint_find(URL);
+	struct worker_checkpoint *c = *x;
+	if(c) {
+		*x = c->next;
+	} else {
+		c = malloc(sizeof(*c));
+		if(!c) return UV_ENOMEM;
+		strlcpy(c->URL, URL, sizeof(c->URL));
+	}
+	*c->cp = *cp;
+	c->next = checkpoints;
+	checkpoints = c;
+
+	// Checkpoints for URLs we gave up on can't pile up.
+	size_t i = 0;
+	for(struct worker_checkpoint **y = &checkpoints; *y; y = &(*y)->next) {
+		if(++i <= WORKER_CHECKPOINTS_MAX) continue;
+		struct worker_checkpoint *old = *y;
+		*y = NULL;
+		while(old) {
+			struct worker_checkpoint *const next = old->next;
+			free(old);
+			old = next;
+		}
+		break;
+	}
+	return 0;
+}
+int hx_checkpoint_del(strarg_t const URL) {
+	struct worker_checkpoint **const x = checkpoint_find(URL);
+	struct worker_checkpoint *const c = *x;
+	if(!c) return KVS_NOTFOUND;
+	*x = c->next;
+	free(c);
+	return 0;
+}
+
+struct pipe_connect {
+	async_t *thread;
+	int status;
+};
+static void pipe_connect_cb(uv_connect_t *const req, int const status) {
+	struct pipe_connect *const x = req->data;
+	x->status = status;
+	async_wakeup(x->thread);
+}
+static int worker_connect(uv_stream_t **const out, uv_pipe_t *const pipe, uv_tcp_t *const tcp) {
+	char host[255+1];
+	int port = 0;
+	if(!strchr(server_addr, '/') && 2 == sscanf(server_addr, "%255[^:]:%d", host, &port)) {
+		struct sockaddr_in addr[1];
+		int rc = uv_ip4_addr(host, port, addr);
+		if(rc < 0) return rc;
+		rc = uv_tcp_init(async_loop, tcp);
+		if(rc < 0) return rc;
+		*out = (uv_stream_t *)tcp;
+		return async_tcp_connect(tcp, (struct sockaddr const *)addr);
+	}
+	int rc = uv_pipe_init(async_loop, pipe, false);
+	if(rc < 0) return rc;
+	*out = (uv_stream_t *)pipe;
+	struct pipe_connect x[1] = {{ async_active(), 0 }};
+	uv_connect_t req[1];
+	req->data = x;
+	uv_pipe_connect(req, pipe, server_addr, pipe_connect_cb);
+	async_yield();
+	return x->status;
+}
+
+static int worker_lease(uv_stream_t *const stream, struct wire_buf *const buf, struct worker_job *const job) {
+	wire_write_uint8(buf, 'L');
+	wire_write_uint16(buf, 1);
+	wire_write_uint64(buf, CONFIG_LEASE_WAIT_MAX);
+	int rc = wire_flush(stream, buf);
+	if(rc < 0) return rc;
+	uint16_t count;
+	rc = wire_read_uint16(stream, &count);
+	if(rc < 0) return rc;
+	if(!count) return UV_EAGAIN;
+	if(count > 1) return UV_EPROTO;
+
+	uint64_t timeout;
+	uint8_t has_prev;
+	rc = rc < 0 ? rc : wire_read_uint64(stream, &job->lease);
+	rc = rc < 0 ? rc : wire_read_uint64(stream, &timeout);
+	rc = rc < 0 ? rc : wire_read_uint64(stream, &job->algos);
+	rc = rc < 0 ? rc : wire_read_string(stream, job->URL, sizeof(job->URL));
+	rc = rc < 0 ? rc : wire_read_string(stream, job->client, sizeof(job->client));
+	rc = rc < 0 ? rc : wire_read_uint8(stream, &has_prev);
+	if(rc < 0) return rc;
+	job->has_prev = !!has_prev;
+	if(!job->has_prev) return 0;
+	rc = rc < 0 ? rc : wire_read_response(stream, job->prev);
+	rc = rc < 0 ? rc : wire_read_string(stream, job->prev->etag, sizeof(job->prev->etag));
+	rc = rc < 0 ? rc : wire_read_string(stream, job->prev->modified, sizeof(job->prev->modified));
+	return rc;
+}
+static int worker_submit(uv_stream_t *const stream, struct wire_buf *const buf, struct worker_job const *const job, struct response const *const res, int const result) {
+	if(result < 0) {
+		wire_write_uint8(buf, 'F');
+		wire_write_uint64(buf, job->lease);
+		wire_write_uint64(buf, (uint64_t)-(int64_t)result);
+	} else {
+		wire_write_uint8(buf, 'D');
+		wire_write_uint64(buf, job->lease);
+		wire_write_response(buf, res);
+		wire_write_string(buf, res->etag);
+		wire_write_string(buf, res->modified);
+	}
+	int rc = wire_flush(stream, buf);
+	if(rc < 0) return rc;
+	uint64_t err;
+	rc = wire_read_uint64(stream, &err);
+	if(rc < 0) return rc;
+	// The lease might have expired, but that's the server's problem.
+	if(err) alogf("Submit error for %s: %s\n", job->URL, hx_strerror(-(int)err));
+	return 0;
+}
+
+static void worker_loop(void *ignored) {
+	struct worker_job *job = calloc(1, sizeof(*job));
+	struct response *res = calloc(1, sizeof(*res));
+	struct wire_buf *buf = calloc(1, sizeof(*buf));
+	if(!job || !res || !buf) {
+		alogf("Worker error: %s\n", uv_strerror(UV_ENOMEM));
+		goto cleanup;
+	}
+	for(;;) {
+		uv_pipe_t pipe[1];
+		uv_tcp_t tcp[1];
+		uv_stream_t *stream = NULL;
+		int rc = worker_connect(&stream, pipe, tcp);
+		for(; rc >= 0;) {
+			rc = worker_lease(stream, buf, job);
+			if(UV_EAGAIN == rc) {
+				rc = 0;
+				continue;
+			}
+			if(rc < 0) break;
+
+			alogf("fetching %s\n", job->URL);
+			job->next = jobs;
+			jobs = job;
+			int const result = url_fetch(job->URL, job->client, job->algos, res);
+			for(struct worker_job **x = &jobs; *x; x = &(*x)->next) {
+				if(job != *x) continue;
+				*x = job->next;
+				break;
+			}
+			rc = worker_submit(stream, buf, job, res, result);
+		}
+		alogf("Server connection error: %s\n", hx_strerror(rc));
+		if(stream) async_close((uv_handle_t *)stream);
+		async_sleep(WORKER_RETRY_DELAY);
+	}
+cleanup:
+	free(job); job = NULL;
+	free(res); res = NULL;
+	free(buf); buf = NULL;
+}
+
+static size_t worker_count = WORKER_COUNT;
+static void init(void *ignore) {
+	int rc = hasher_init();
+	if(rc < 0) {
+		alogf("Hasher init error: %s\n", hash_strerror(rc));
+		return;
+	}
+	conn_pool_init();
+	for(size_t i = 0; i < worker_count; i++) {
+		rc = async_spawn(STACK_DEFAULT, worker_loop, NULL);
+		if(rc < 0) {
+			alogf("Worker error: %s\n", uv_strerror(rc));
+			return;
+		}
+	}
+	alogf("Crawling for %s with %zu workers\n", server_addr, worker_count);
+}
+
+int main(int const argc, char const *const *const argv) {
+	if(argc > 1) server_addr = argv[1];
+	if(argc > 2) worker_count = strtoull(argv[2], NULL, 10);
+	if(argc > 3 || !worker_count) {
+		fprintf(stderr, "Usage: %s [socket-path | ipv4:port] [workers]\n", argv[0]);
+		return 1;
+	}
+	int rc = async_process_init();
+	if(rc < 0) {
+		fprintf(stderr, "Initialization error: %s\n", uv_strerror(rc));
+		return 1;
+	}
+	async_spawn(STACK_DEFAULT, init, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+	async_process_destroy();
+	return 0;
+}
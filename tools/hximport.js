@@ -11,7 +11,8 @@ ALGOS[3] = "sha384";
 ALGOS[4] = "sha512";
 ALGOS[5] = "blake2s";
 ALGOS[6] = "blake2b";
-var ALGO_MAX = 7;
+ALGOS[7] = "blake3";
+var ALGO_MAX = 8;
 
 function write_uint16(sock, val) {
 	var buf = new Buffer(2);